@@ -34,6 +34,10 @@
 #include <string_view>
 #include <filesystem>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <algorithm>
+#include <ctime>
 #include <dlfcn.h>
 #include <CDetour/detours.h>
 #include <iclient.h>
@@ -42,6 +46,22 @@
 #include <tier1/interface.h>
 #include "netmessages.h"
 #include "voicecodec_celt.h"
+#include "voiceencoder.h"
+#include "voiceplayback.h"
+#include "voiceclip.h"
+#include "voicemixer.h"
+#include "voiceclients.h"
+#include "voicetranscode.h"
+#include "voicepcm.h"
+#include "voiceresample.h"
+#include "voicerecord.h"
+#include "voicereplay.h"
+#include "voicestats.h"
+#include "voicebench.h"
+#include "voicestream.h"
+#include "voicehearing.h"
+#include "voicebroadcast.h"
+#include "voicevad.h"
 
 /**
  * @file extension.cpp
@@ -58,9 +78,25 @@ ConVar *sv_voicecodec;
 ConVar *sv_use_steam_voice;
 ConVar *sv_voiceenable;
 ConVar *voice_debugfeedbackfrom;
+ConVar voicesend_encoder_threads{"voicesend_encoder_threads", "2", FCVAR_NONE, "Number of worker threads used by VoiceCodec.CompressAsync, read on first use", true, 1.0f, true, 16.0f};
+ConVar voicesend_mix{"voicesend_mix", "0", FCVAR_NONE, "Mix vaudio_celt speakers per group of listeners into one stream per frame"};
+ConVar voicesend_transcode{"voicesend_transcode", "1", FCVAR_NONE, "Transcode voice for clients that SendVoiceInit put on another codec or sample rate"};
+ConVar voicesend_preserialize{"voicesend_preserialize", "1", FCVAR_NONE, "Serialize voice messages once per broadcast instead of once per recipient"};
+ConVar voicesend_record_buffer_kb{"voicesend_record_buffer_kb", "4096", FCVAR_NONE, "Size of the voice recording ring buffer in KB, read when a recording starts", true, 128.0f, false, 0.0f};
+ConVar voicesend_budget_rate{"voicesend_budget_rate", "0", FCVAR_NONE, "Bytes of voice per second a client may receive, 0 for no limit", true, 0.0f, false, 0.0f};
+ConVar voicesend_budget_burst{"voicesend_budget_burst", "4096", FCVAR_NONE, "Bytes of voice a client may receive at once after being quiet", true, 256.0f, false, 0.0f};
+ConVar voicesend_vad{"voicesend_vad", "0", FCVAR_NONE, "Drop vaudio_celt packets that are not speech before they are broadcast"};
+ConVar voicesend_vad_energy{"voicesend_vad_energy", "-50", FCVAR_NONE, "Level in dBFS a packet has to reach to be speech", true, -100.0f, true, 0.0f};
+ConVar voicesend_vad_flatness{"voicesend_vad_flatness", "0.5", FCVAR_NONE, "Spectral flatness a packet has to stay under to be speech, 0 tonal to 1 noise", true, 0.0f, true, 1.0f};
+ConVar voicesend_vad_hangover{"voicesend_vad_hangover", "0.3", FCVAR_NONE, "Seconds voice keeps passing after the last speech packet", true, 0.0f, true, 5.0f};
+ConVar voicesend_always_detour{"voicesend_always_detour", "0", FCVAR_NONE, "Keep SV_BroadcastVoiceData detoured while no plugin or feature needs it"};
+ConVar voicesend_record_segment_mb{"voicesend_record_segment_mb", "64", FCVAR_NONE, "Size at which voice recordings start a new segment file in MB, read when a recording starts", true, 1.0f, true, 1024.0f};
 HandleType_t voicecodec_handle;
 IForward *OnVoiceInit;
 IForward *OnVoiceData;
+IForward *OnVoiceDataPre;
+IForward *OnVoiceDecoded;
+IForward *OnVoicePlaybackFinished;
 struct codecdl
 {
 	CSysModule *dl;
@@ -94,7 +130,9 @@ inline int Voice_GetDefaultSampleRate( const char *pCodec ) // Inline for DEDICA
 
 static void clamp_samplerate(int &nSampleRate)
 {
-	if(nSampleRate >= 22050) {
+	if(nSampleRate >= 44100) {
+		nSampleRate = 44100;
+	} else if(nSampleRate >= 22050) {
 		nSampleRate = 22050;
 	} else if(nSampleRate >= 11025) {
 		nSampleRate = 11025;
@@ -105,6 +143,14 @@ static void clamp_samplerate(int &nSampleRate)
 	}
 }
 
+static int resolve_samplerate(const char *pCodec, int nSampleRate)
+{
+	if(nSampleRate == 0) {
+		return Voice_GetDefaultSampleRate(pCodec);
+	}
+	return nSampleRate;
+}
+
 CDetour *SV_WriteVoiceCodec_detour;
 DETOUR_DECL_STATIC1(SV_WriteVoiceCodec, void, bf_write &, pBuf)
 {
@@ -119,9 +165,12 @@ DETOUR_DECL_STATIC1(SV_WriteVoiceCodec, void, bf_write &, pBuf)
 	OnVoiceInit->PushCell(MAX_OSPATH);
 	OnVoiceInit->PushCellByRef(&nSampleRate);
 	OnVoiceInit->Execute();
+	g_VoiceStats.Add(VoiceStat_ForwardInit);
 
 	clamp_samplerate(nSampleRate);
 
+	g_VoiceClients.SetDefault(szVoiceCodec, resolve_samplerate(szVoiceCodec, nSampleRate), Plat_FloatTime());
+
 	SVC_VoiceInit voiceinit{szVoiceCodec, nSampleRate};
 	voiceinit.WriteToBuffer(pBuf);
 }
@@ -141,9 +190,115 @@ static cell_t SendVoiceInit(IPluginContext *pContext, const cell_t *params)
 
 	cl->SendNetMsg(voiceinit);
 
+	g_VoiceClients.Set(client, pCodec, resolve_samplerate(pCodec, nSampleRate), Plat_FloatTime());
+	g_VoiceTranscoder.ResetSender(client);
+
 	return 0;
 }
 
+struct senderdecoder
+{
+	VoiceCodec_Celt *codec;
+	int userid;
+};
+static senderdecoder sender_decoders[ABSOLUTE_PLAYER_LIMIT]{};
+static std::vector<celt_int16> sender_pcm;
+
+// Fills in the CELT settings clients on config encode with, false for other codecs
+static bool get_celt_settings(const voicecodecconfig &config, VoiceCodec_Celt::CEncoderSettings &settings)
+{
+	return VoiceCodec_Celt::GetCodecSettings(config.codec.c_str(), config.samplerate, settings);
+}
+
+static bool is_celt_voicecodec(const voicecodecconfig &config)
+{
+	VoiceCodec_Celt::CEncoderSettings settings;
+	return get_celt_settings(config, settings);
+}
+
+const celt_int16 *DecodeSenderVoice(IClient *pClient, const VoiceCodec_Celt::CEncoderSettings &settings, const char *data, int nBytes, int &nSamples)
+{
+	nSamples = 0;
+
+	const int slot{pClient->GetPlayerSlot()};
+	if(slot < 0 || slot >= ABSOLUTE_PLAYER_LIMIT) {
+		return nullptr;
+	}
+
+	senderdecoder &decoder{sender_decoders[slot]};
+	if(!decoder.codec) {
+		decoder.codec = new VoiceCodec_Celt{};
+		decoder.userid = -1;
+	}
+
+	// A voice_init with other settings, or a sender that never got a working decoder
+	const VoiceCodec_Celt::CEncoderSettings &current{decoder.codec->EncoderSettings()};
+	if(decoder.userid == -1 || current.SampleRate_Hz != settings.SampleRate_Hz || current.FrameSize != settings.FrameSize || current.PacketSize != settings.PacketSize) {
+		if(!decoder.codec->Init(settings.SampleRate_Hz, settings.FrameSize, settings.PacketSize)) {
+			decoder.userid = -1;
+			return nullptr;
+		}
+		decoder.userid = pClient->GetUserID();
+	} else if(decoder.userid != pClient->GetUserID()) {
+		decoder.codec->ResetState();
+		decoder.userid = pClient->GetUserID();
+	}
+
+	const size_t nMaxSamples{static_cast<size_t>(((VOICE_MAX_DATA_BYTES / settings.PacketSize) + 1) * settings.FrameSize)};
+	if(sender_pcm.size() < nMaxSamples) {
+		sender_pcm.resize(nMaxSamples);
+	}
+
+	const int ret{decoder.codec->Decompress(reinterpret_cast<const unsigned char *>(data), nBytes, sender_pcm.data(), static_cast<int>(sender_pcm.size()))};
+	if(ret <= 0) {
+		return nullptr;
+	}
+
+	nSamples = ret;
+	return sender_pcm.data();
+}
+
+static void free_sender_decoders()
+{
+	for(senderdecoder &decoder : sender_decoders) {
+		if(decoder.codec) {
+			decoder.codec->Release();
+			decoder.codec = nullptr;
+		}
+	}
+}
+
+static voicedatablobs voicedata_blobs;
+
+static listenermask voice_blocked[ABSOLUTE_PLAYER_LIMIT + 1]{};
+static int voice_blocked_count{0};
+
+static void count_voice_blocked()
+{
+	voice_blocked_count = 0;
+	for(const listenermask &blocked : voice_blocked) {
+		for(cell_t cell : blocked.cells) {
+			voice_blocked_count += __builtin_popcount(static_cast<uint32_t>(cell));
+		}
+	}
+}
+static std::vector<transcodetarget> transcode_targets;
+
+static void add_transcode_target(std::vector<transcodetarget> &targets, const voicecodecconfig &config, bool proximity, int client)
+{
+	for(transcodetarget &target : targets) {
+		if(target.proximity == proximity && *target.config == config) {
+			target.listeners.set(client, true);
+			return;
+		}
+	}
+
+	transcodetarget target{&config, proximity, {}};
+	target.listeners.set(client, true);
+	targets.emplace_back(target);
+}
+static char voice_pre_data[VOICE_MAX_DATA_BYTES];
+
 CDetour *SV_BroadcastVoiceData_detour;
 DETOUR_DECL_STATIC4(SV_BroadcastVoiceData, void, IClient *, pClient, int, nBytes, char *, data, int64, xuid)
 {
@@ -151,6 +306,58 @@ DETOUR_DECL_STATIC4(SV_BroadcastVoiceData, void, IClient *, pClient, int, nBytes
 	if( !sv_voiceenable->GetInt() )
 		return;
 
+	VoiceStatsTimer timer;
+
+	const cell_t sender{pClient->GetPlayerSlot()+1};
+	if(sender < 1 || sender > ABSOLUTE_PLAYER_LIMIT) {
+		return;
+	}
+
+	g_VoiceStats.Add(VoiceStat_PacketsIn);
+	g_VoiceStats.Add(VoiceStat_BytesIn, nBytes);
+	g_VoiceStats.AddClient(sender, VoiceClientStat_PacketsIn);
+	g_VoiceStats.AddClient(sender, VoiceClientStat_BytesIn, nBytes);
+
+	if(g_VoiceRecorder.IsRecording()) {
+		g_VoiceRecorder.Record(sender, xuid, sv->GetTick(), data, nBytes);
+	}
+
+	listenermask listeners;
+	for(int i{0}; i < VOICE_LISTENER_CELLS; ++i) {
+		listeners.cells[i] = ~voice_blocked[sender].cells[i];
+	}
+
+	if(OnVoiceDataPre->GetFunctionCount() > 0 && nBytes > VOICE_MAX_DATA_BYTES) {
+		g_VoiceStats.Add(VoiceStat_SkipPreOversized);
+	} else if(OnVoiceDataPre->GetFunctionCount() > 0) {
+		memcpy(voice_pre_data, data, nBytes);
+		cell_t length{nBytes};
+
+		// Only the packet itself goes to the plugin and back, it may shorten it but not grow it
+		OnVoiceDataPre->PushCell(sender);
+		OnVoiceDataPre->PushStringEx(voice_pre_data, std::max(nBytes, 1), SM_PARAM_STRING_COPY|SM_PARAM_STRING_BINARY, SM_PARAM_COPYBACK);
+		OnVoiceDataPre->PushCellByRef(&length);
+		OnVoiceDataPre->PushArray(listeners.cells, VOICE_LISTENER_CELLS, SM_PARAM_COPYBACK);
+
+		cell_t result{Pl_Continue};
+		OnVoiceDataPre->Execute(&result);
+		g_VoiceStats.Add(VoiceStat_ForwardPre);
+
+		if(result >= Pl_Handled) {
+			g_VoiceStats.Add(VoiceStat_DropHandled);
+			g_VoiceStats.AddClient(sender, VoiceClientStat_Drops);
+			return;
+		} else if(result == Pl_Changed) {
+			if(length < 0) {
+				length = 0;
+			} else if(length > nBytes) {
+				length = nBytes;
+			}
+			data = voice_pre_data;
+			nBytes = length;
+		}
+	}
+
 	// Build voice message once
 	SVC_VoiceData voiceData;
 	voiceData.m_nFromClient = pClient->GetPlayerSlot();
@@ -163,273 +370,1795 @@ DETOUR_DECL_STATIC4(SV_BroadcastVoiceData, void, IClient *, pClient, int, nBytes
 		Msg( "Sending voice from: %s - playerslot: %d\n", pClient->GetClientName(), pClient->GetPlayerSlot() + 1 );
 	}
 
-	for(int i=0; i < sv->GetClientCount(); i++)
-	{
-		IClient *pDestClient = sv->GetClient(i);
-		if(!pDestClient->IsActive()) {
-			continue;
+	// Decode with what the sender was told to encode with, OnVoiceInit or SendVoiceInit may differ from sv_voicecodec
+	const voicecodecconfig &source{g_VoiceClients.Get(sender)};
+	VoiceCodec_Celt::CEncoderSettings celtsettings;
+	const bool celt{get_celt_settings(source, celtsettings)};
+
+	// Only clients put on another codec by SendVoiceInit can need transcoding
+	const bool transcode{voicesend_transcode.GetBool() && g_VoiceClients.HasOverrides()};
+
+	// The mixer encodes with the server preset, senders on another one are sent as they are.
+	// Its groups skip per listener OnVoiceData and transcoding, so those take the normal path.
+	const VoiceCodec_Celt::CEncoderSettings &mixsettings{VoiceCodec_Celt::TheEncoderSettings()};
+	const bool mix{celt && voicesend_mix.GetBool() && celtsettings.SampleRate_Hz == mixsettings.SampleRate_Hz && celtsettings.FrameSize == mixsettings.FrameSize &&
+		!transcode && OnVoiceData->GetFunctionCount() == 0};
+	const bool vad{celt && (voicesend_vad.GetBool() || g_VoiceVAD.HasOverride(sender))};
+
+	// Decoders keep state between packets, so every packet is decoded at most once
+	int nSamples{0};
+	const celt_int16 *pcm{nullptr};
+	if(celt && (mix || vad || OnVoiceDecoded->GetFunctionCount() > 0)) {
+		pcm = DecodeSenderVoice(pClient, celtsettings, data, nBytes, nSamples);
+		if(!pcm) {
+			g_VoiceStats.Add(VoiceStat_DecodeFailed);
+		} else if(OnVoiceDecoded->GetFunctionCount() > 0) {
+			OnVoiceDecoded->PushCell(sender);
+			OnVoiceDecoded->PushStringEx(const_cast<celt_int16 *>(pcm), nSamples * BYTES_PER_SAMPLE, SM_PARAM_STRING_COPY|SM_PARAM_STRING_BINARY, 0);
+			OnVoiceDecoded->PushCell(nSamples);
+			OnVoiceDecoded->Execute(nullptr);
+			g_VoiceStats.Add(VoiceStat_ForwardDecoded);
 		}
+	}
 
-		voiceData.m_nFromClient = pClient->GetPlayerSlot();
+	if(vad && pcm && !g_VoiceVAD.Process(sender, pcm, nSamples, celtsettings.SampleRate_Hz, Plat_FloatTime())) {
+		g_VoiceStats.Add(VoiceStat_DropSilent);
+		g_VoiceStats.AddClient(sender, VoiceClientStat_Drops);
+		return;
+	}
 
-		bool bSelf = (pDestClient == pClient);
-		bool bHearsPlayer = pDestClient->IsHearingClient(voiceData.m_nFromClient);
+	// A packet the mixer could not decode is still sent as it is
+	if(mix && pcm) {
+		const voicehearingrow &row{g_VoiceHearing.Row(sv, sv->GetTick(), sender)};
+		const listenermask &active{g_VoiceHearing.Active()};
 
-		if(!bHearsPlayer && !bSelf) {
-			continue;
+		listenermask hearing{};
+		for(int i{0}; i < VOICE_LISTENER_CELLS; ++i) {
+			hearing.cells[i] = listeners.cells[i] & active.cells[i] & row.hearing.cells[i];
 		}
 
-		cell_t sender{pClient->GetPlayerSlot()+1};
-		cell_t proximity{pDestClient->IsProximityHearingClient(voiceData.m_nFromClient)};
+		if(listeners.get(sender) && active.get(sender) && !hearing.get(sender)) {
+			voiceData.m_bProximity = false;
+			voiceData.m_nLength = 0;
+			pClient->SendNetMsg(voiceData);
+		}
 
-		voiceData.m_bProximity = proximity;
+		g_VoiceMixer.AddVoice(sender, pcm, nSamples, hearing, Plat_FloatTime());
+		return;
+	}
 
-		OnVoiceData->PushCell(sender);
-		OnVoiceData->PushCell(i+1);
-		OnVoiceData->PushStringEx(data, nBytes, SM_PARAM_STRING_COPY|SM_PARAM_STRING_BINARY, SM_PARAM_COPYBACK);
-		OnVoiceData->PushCell(nBytes);
-		OnVoiceData->PushCellByRef(&proximity);
-		OnVoiceData->Execute(nullptr);
+	const bool cantranscode{transcode && VoiceTranscoder::CanTranscode(source)};
+	transcode_targets.clear();
+
+	// OnVoiceData may rewrite data for any listener, so only reuse serialized messages without it
+	const bool perlistener{OnVoiceData->GetFunctionCount() > 0};
+	const bool cacheable{voicesend_preserialize.GetBool() && nBytes <= VOICE_MAX_DATA_BYTES && !perlistener};
+
+	VoiceBroadcast_FanOut(sv, sender, voiceData, nBytes, listeners, cacheable ? &voicedata_blobs : nullptr,
+		[&](int client, bool bHearsPlayer, cell_t &proximity) {
+			if(transcode && bHearsPlayer) {
+				const voicecodecconfig &target{g_VoiceClients.Get(client)};
+				if(target != source) {
+					// The raw bytes would only be noise to this client
+					if(cantranscode && VoiceTranscoder::CanTranscode(target)) {
+						add_transcode_target(transcode_targets, target, proximity, client);
+					} else {
+						g_VoiceStats.Add(VoiceStat_DropCodec);
+						g_VoiceStats.AddClient(client, VoiceClientStat_Drops);
+					}
+					return false;
+				}
+			}
 
-		voiceData.m_bProximity = proximity;
+			if(perlistener) {
+				OnVoiceData->PushCell(sender);
+				OnVoiceData->PushCell(client);
+				OnVoiceData->PushStringEx(data, nBytes, SM_PARAM_STRING_COPY|SM_PARAM_STRING_BINARY, SM_PARAM_COPYBACK);
+				OnVoiceData->PushCell(nBytes);
+				OnVoiceData->PushCellByRef(&proximity);
+				OnVoiceData->Execute(nullptr);
+				g_VoiceStats.Add(VoiceStat_ForwardData);
+			}
 
-		if(!bHearsPlayer) {
-			voiceData.m_nLength = 0;
-		} else {
-			voiceData.m_nLength = nBytes * 8;
-		}
+			return true;
+		});
 
-		pDestClient->SendNetMsg( voiceData );
+	if(cantranscode) {
+		g_VoiceTranscoder.Transcode(sender, voiceData.m_nFromClient, source, data, nBytes, transcode_targets, Plat_FloatTime());
 	}
 }
 
-static cell_t SendVoiceData(IPluginContext *pContext, const cell_t *params)
+static cell_t SetVoiceBlocked(IPluginContext *pContext, const cell_t *params)
 {
-	const int client{params[1]};
-	char *data;
-	pContext->LocalToString(params[2], &data);
-	const int len{params[3]};
-	const int from{params[4]};
-	const bool proximity{static_cast<bool>(params[5])};
+	const int sender{params[1]};
+	const int client{params[2]};
 
-	IClient *cl{sv->GetClient(client-1)};
-
-	SVC_VoiceData voicedata;
-	voicedata.m_nFromClient = from;
-	voicedata.m_bProximity = proximity;
-	voicedata.m_nLength = (len * 8);
-	voicedata.m_xuid = 0;
-	voicedata.m_DataOut = data;
+	if(sender < 1 || sender > ABSOLUTE_PLAYER_LIMIT) {
+		return pContext->ThrowNativeError("Invalid sender index %d", sender);
+	}
+	if(client < 1 || client > ABSOLUTE_PLAYER_LIMIT) {
+		return pContext->ThrowNativeError("Invalid client index %d", client);
+	}
 
-	cl->SendNetMsg(voicedata);
+	const bool block{static_cast<bool>(params[3])};
+	if(voice_blocked[sender].get(client) != block) {
+		voice_blocked[sender].set(client, block);
+		voice_blocked_count += block ? 1 : -1;
+	}
 
 	return 0;
 }
 
-static cell_t handle_createvoicecodec(IPluginContext *pContext, const cell_t *params, bool ex)
+static cell_t IsVoiceBlocked(IPluginContext *pContext, const cell_t *params)
 {
-	using namespace std::literals::string_view_literals;
-
-	char *name_ptr;
-	pContext->LocalToString(params[1], &name_ptr);
-	std::string_view name{name_ptr};
+	const int sender{params[1]};
+	const int client{params[2]};
 
-	if(name == "voicesend_celt"sv) {
-		VoiceCodec_Celt *codec = new VoiceCodec_Celt();
-		return handlesys->CreateHandle(voicecodec_handle, codec, pContext->GetIdentity(), myself->GetIdentity(), NULL);
+	if(sender < 1 || sender > ABSOLUTE_PLAYER_LIMIT) {
+		return pContext->ThrowNativeError("Invalid sender index %d", sender);
+	}
+	if(client < 1 || client > ABSOLUTE_PLAYER_LIMIT) {
+		return pContext->ThrowNativeError("Invalid client index %d", client);
 	}
 
-	CreateInterfaceFn func{nullptr};
-	auto it{dlmap.find(std::string{name})};
-	if(it == dlmap.end()) {
-		std::string dlpath;
-		dlpath += name;
-		dlpath += ".so"sv;
+	return static_cast<cell_t>(voice_blocked[sender].get(client));
+}
 
-		//CSysModule *dl{Sys_LoadModule(dlpath.c_str(), SYS_NOFLAGS)};
-		CSysModule *dl{reinterpret_cast<CSysModule *>(dlopen(dlpath.c_str(), RTLD_NOW))};
-		if(dl) {
-			func = Sys_GetFactory(dl);
-			if(func) {
-				dlmap.emplace(std::pair<std::string,codecdl>{name,codecdl{dl,func}});
-			} else {
-				if(ex) {
-					const int len{static_cast<cell_t>(params[3])};
-					pContext->StringToLocal(params[2], len, "missing factory");
-				}
-				dlclose(dl);
-			}
-		} else {
-			if(ex) {
-				const int len{static_cast<cell_t>(params[3])};
-				const char *err{dlerror()};
-				if(!err) {
-					err = "";
-				}
-				pContext->StringToLocal(params[2], len, err);
-			}
-		}
-	} else {
-		func = it->second.func;
+static cell_t SetVoiceClientBudget(IPluginContext *pContext, const cell_t *params)
+{
+	const int client{params[1]};
+	if(client < 1 || client > ABSOLUTE_PLAYER_LIMIT) {
+		return pContext->ThrowNativeError("Invalid client index %d", client);
 	}
 
-	if(func) {
-		int status;
-		using namespace std::literals::string_literals;
-		std::string ifacename;
-		ifacename += name;
-		IVoiceCodec *codec{reinterpret_cast<IVoiceCodec *>(func(ifacename.data(), &status))};
-		if(codec) {
-			return handlesys->CreateHandle(voicecodec_handle, codec, pContext->GetIdentity(), myself->GetIdentity(), NULL);
-		} else {
-			if(ex) {
-				const int len{static_cast<cell_t>(params[3])};
-				pContext->StringToLocal(params[2], len, "factory returned null");
-			}
-		}
-	}
+	g_VoiceBudget.Set(client, params[2], params[3]);
 
 	return 0;
 }
 
-static cell_t CreateVoiceCodec(IPluginContext *pContext, const cell_t *params)
-{
-	return handle_createvoicecodec(pContext, params, false);
-}
-
-static cell_t CreateVoiceCodecEx(IPluginContext *pContext, const cell_t *params)
+static cell_t GetVoiceClientBudget(IPluginContext *pContext, const cell_t *params)
 {
-	return handle_createvoicecodec(pContext, params, true);
-}
+	const int client{params[1]};
+	if(client < 1 || client > ABSOLUTE_PLAYER_LIMIT) {
+		return pContext->ThrowNativeError("Invalid client index %d", client);
+	}
 
-static cell_t CreateCeltCodecEx(IPluginContext *pContext, const cell_t *params)
-{
-	int samplerate = params[1];
-	int framesize = params[2];
-	int packetsize = params[3];
+	cell_t *rate, *burst;
+	pContext->LocalToPhysAddr(params[2], &rate);
+	pContext->LocalToPhysAddr(params[3], &burst);
+	*rate = static_cast<cell_t>(g_VoiceBudget.Rate(client));
+	*burst = static_cast<cell_t>(g_VoiceBudget.Burst(client));
 
-	VoiceCodec_Celt *codec{new VoiceCodec_Celt{}};
-	codec->Init(samplerate, framesize, packetsize);
-	return handlesys->CreateHandle(voicecodec_handle, codec, pContext->GetIdentity(), myself->GetIdentity(), NULL);
+	return sp_ftoc(static_cast<float>(g_VoiceBudget.Tokens(client)));
 }
 
-static cell_t VoiceCodecInit(IPluginContext *pContext, const cell_t *params)
+static cell_t SetVoiceActivityThresholds(IPluginContext *pContext, const cell_t *params)
 {
-	HandleSecurity security(pContext->GetIdentity(), myself->GetIdentity());
+	const int client{params[1]};
+	if(client < 1 || client > ABSOLUTE_PLAYER_LIMIT) {
+		return pContext->ThrowNativeError("Invalid client index %d", client);
+	}
 
-	IVoiceCodec *obj = nullptr;
-	HandleError err = handlesys->ReadHandle(params[1], voicecodec_handle, &security, (void **)&obj);
-	if(err != HandleError_None)
-	{
-		return pContext->ThrowNativeError("Invalid Handle %x (error: %d)", params[1], err);
+	voiceactivitythresholds thresholds;
+	thresholds.energy = sp_ctof(params[2]);
+	thresholds.flatness = sp_ctof(params[3]);
+	thresholds.hangover = sp_ctof(params[4]);
+	if(thresholds.hangover < 0.0f) {
+		return pContext->ThrowNativeError("Invalid hangover %f", thresholds.hangover);
 	}
 
-	return static_cast<cell_t>(obj->Init(static_cast<int>(params[2])));
+	g_VoiceVAD.SetThresholds(client, thresholds);
+
+	return 0;
 }
 
-static cell_t VoiceCodecResetState(IPluginContext *pContext, const cell_t *params)
+static cell_t ResetVoiceActivityThresholds(IPluginContext *pContext, const cell_t *params)
 {
-	HandleSecurity security(pContext->GetIdentity(), myself->GetIdentity());
-
-	IVoiceCodec *obj = nullptr;
-	HandleError err = handlesys->ReadHandle(params[1], voicecodec_handle, &security, (void **)&obj);
-	if(err != HandleError_None)
-	{
-		return pContext->ThrowNativeError("Invalid Handle %x (error: %d)", params[1], err);
+	const int client{params[1]};
+	if(client < 1 || client > ABSOLUTE_PLAYER_LIMIT) {
+		return pContext->ThrowNativeError("Invalid client index %d", client);
 	}
 
-	return static_cast<cell_t>(obj->ResetState());
+	g_VoiceVAD.ResetThresholds(client);
+
+	return 0;
 }
 
-static cell_t VoiceCodecCompress(IPluginContext *pContext, const cell_t *params)
+static cell_t GetVoiceActivity(IPluginContext *pContext, const cell_t *params)
 {
-	HandleSecurity security(pContext->GetIdentity(), myself->GetIdentity());
-
-	IVoiceCodec *obj = nullptr;
-	HandleError err = handlesys->ReadHandle(params[1], voicecodec_handle, &security, (void **)&obj);
-	if(err != HandleError_None)
-	{
-		return pContext->ThrowNativeError("Invalid Handle %x (error: %d)", params[1], err);
+	const int client{params[1]};
+	if(client < 1 || client > ABSOLUTE_PLAYER_LIMIT) {
+		return pContext->ThrowNativeError("Invalid client index %d", client);
 	}
 
-	char *pUncompressed;
-	pContext->LocalToString(params[2], &pUncompressed);
-	const int nSamples{static_cast<int>(params[3])};
-
-	char *pCompressed;
-	pContext->LocalToString(params[4], &pCompressed);
-	int maxCompressedBytes{static_cast<int>(params[5])};
+	cell_t *energy, *flatness;
+	pContext->LocalToPhysAddr(params[2], &energy);
+	pContext->LocalToPhysAddr(params[3], &flatness);
+	*energy = sp_ftoc(g_VoiceVAD.LastEnergy(client));
+	*flatness = sp_ftoc(g_VoiceVAD.LastFlatness(client));
 
-	const bool bFinal{static_cast<bool>(params[6])};
+	return static_cast<cell_t>(g_VoiceVAD.IsSpeaking(client, Plat_FloatTime()));
+}
 
-	const int ret{obj->Compress(pUncompressed, nSamples, pCompressed, maxCompressedBytes, bFinal)};
+void Sample::OnClientPutInServer(int client)
+{
+	g_VoiceHearing.Invalidate();
 
-	return static_cast<cell_t>(ret);
+	// SV_WriteVoiceCodec does not know who it writes for, the last default
+	// written is the one this client got during its signon
+	g_VoiceClients.BindDefault(client);
 }
 
-static cell_t VoiceCodecDecompress(IPluginContext *pContext, const cell_t *params)
+void Sample::OnClientDisconnected(int client)
 {
-	HandleSecurity security(pContext->GetIdentity(), myself->GetIdentity());
+	g_VoiceHearing.Invalidate();
 
-	IVoiceCodec *obj = nullptr;
-	HandleError err = handlesys->ReadHandle(params[1], voicecodec_handle, &security, (void **)&obj);
-	if(err != HandleError_None)
-	{
-		return pContext->ThrowNativeError("Invalid Handle %x (error: %d)", params[1], err);
+	if(client < 1 || client > ABSOLUTE_PLAYER_LIMIT) {
+		return;
+	}
+
+	g_VoiceClients.Reset(client);
+	g_VoiceTranscoder.ResetSender(client);
+	g_VoiceMixer.ResetSender(client);
+	g_VoiceStats.ResetClient(client);
+	g_VoiceBudget.Reset(client);
+	g_VoiceVAD.Reset(client);
+
+	voice_blocked[client] = listenermask{};
+	for(listenermask &blocked : voice_blocked) {
+		blocked.set(client, false);
 	}
+	count_voice_blocked();
 
-	return -1;
+	senderdecoder &decoder{sender_decoders[client-1]};
+	if(decoder.codec) {
+		decoder.codec->Release();
+		decoder.codec = nullptr;
+	}
 }
 
-static constexpr const sp_nativeinfo_t natives[]{
-	{"SendVoiceData", SendVoiceData},
-	{"SendVoiceInit", SendVoiceInit},
-	{"CreateVoiceCodec", CreateVoiceCodec},
-	{"CreateVoiceCodecEx", CreateVoiceCodecEx},
-	{"CreateCeltCodecEx", CreateCeltCodecEx},
-	{"VoiceCodec.Init", VoiceCodecInit},
-	{"VoiceCodec.Compress", VoiceCodecCompress},
-	{"VoiceCodec.Decompress", VoiceCodecDecompress},
-	{"VoiceCodec.ResetState", VoiceCodecResetState},
-	{nullptr, nullptr}
-};
+// Separate from the broadcast blobs since plugins may send from inside voice forwards
+static voicedatablob native_blob;
 
-void Sample::OnHandleDestroy(HandleType_t type, void *object)
+static IClient *get_voice_client(int client)
 {
-	if(type == voicecodec_handle) {
-		IVoiceCodec *codec{reinterpret_cast<IVoiceCodec *>(object)};
-		codec->ResetState();
-		codec->Release();
+	if(client < 1 || client > sv->GetClientCount()) {
+		return nullptr;
+	}
+
+	IClient *cl{sv->GetClient(client-1)};
+	if(!cl || !cl->IsConnected()) {
+		return nullptr;
 	}
+
+	return cl;
 }
 
-void OnGameFrame(bool simulating)
+static voicedatablob *prepare_native_blob(int len)
 {
-	
+	native_blob.built = false;
+
+	if(!voicesend_preserialize.GetBool() || len > VOICE_MAX_DATA_BYTES) {
+		return nullptr;
+	}
+
+	return &native_blob;
 }
 
-bool Sample::SDK_OnLoad(char *error, size_t maxlen, bool late)
+static cell_t SendVoiceData(IPluginContext *pContext, const cell_t *params)
 {
-	IGameConfig *gameconf;
-	gameconfs->LoadGameConfigFile("voicesend", &gameconf, error, maxlen);
+	const int client{params[1]};
+	char *data;
+	pContext->LocalToString(params[2], &data);
+	const int len{params[3]};
+	const int from{params[4]};
+	const bool proximity{static_cast<bool>(params[5])};
 
-	CDetourManager::Init(smutils->GetScriptingEngine(), gameconf);
+	if(client < 1 || client > ABSOLUTE_PLAYER_LIMIT) {
+		return pContext->ThrowNativeError("Invalid client index %d", client);
+	}
+	if(len < 0 || len > VOICE_MAX_DATA_BYTES) {
+		return pContext->ThrowNativeError("Invalid data length %d", len);
+	}
 
-	SV_WriteVoiceCodec_detour = DETOUR_CREATE_STATIC(SV_WriteVoiceCodec, "SV_WriteVoiceCodec");
-	SV_WriteVoiceCodec_detour->EnableDetour();
+	IClient *cl{get_voice_client(client)};
+	if(!cl) {
+		return 0;
+	}
 
-	SV_BroadcastVoiceData_detour = DETOUR_CREATE_STATIC(SV_BroadcastVoiceData, "SV_BroadcastVoiceData");
-	SV_BroadcastVoiceData_detour->EnableDetour();
+	SVC_VoiceData voicedata;
+	voicedata.m_nFromClient = from;
+	voicedata.m_bProximity = proximity;
+	voicedata.m_nLength = (len * 8);
+	voicedata.m_xuid = 0;
+	voicedata.m_DataOut = data;
+
+	VoiceBroadcast_Send(cl, voicedata, nullptr, VoicePriority_Plugin);
+
+	return 0;
+}
+
+static cell_t SendVoiceDataToClients(IPluginContext *pContext, const cell_t *params)
+{
+	cell_t *clients;
+	pContext->LocalToPhysAddr(params[1], &clients);
+	const int count{params[2]};
+	char *data;
+	pContext->LocalToString(params[3], &data);
+	const int len{params[4]};
+	const int from{params[5]};
+	const bool proximity{static_cast<bool>(params[6])};
+
+	if(count < 0) {
+		return pContext->ThrowNativeError("Invalid client count %d", count);
+	}
+	if(len < 0 || len > VOICE_MAX_DATA_BYTES) {
+		return pContext->ThrowNativeError("Invalid data length %d", len);
+	}
+
+	SVC_VoiceData voicedata;
+	voicedata.m_nFromClient = from;
+	voicedata.m_bProximity = proximity;
+	voicedata.m_nLength = (len * 8);
+	voicedata.m_xuid = 0;
+	voicedata.m_DataOut = data;
+
+	voicedatablob *blob{prepare_native_blob(len)};
+
+	int sent{0};
+	for(int i{0}; i < count; ++i) {
+		IClient *cl{get_voice_client(clients[i])};
+		if(!cl) {
+			continue;
+		}
+
+		if(VoiceBroadcast_Send(cl, voicedata, blob, VoicePriority_Plugin)) {
+			++sent;
+		}
+	}
+
+	return sent;
+}
+
+int SendVoiceDataToListeners(const listenermask &listeners, const char *data, int len, int from, bool proximity, voicepriority priority)
+{
+	if(len < 0 || len > VOICE_MAX_DATA_BYTES) {
+		return 0;
+	}
+
+	SVC_VoiceData voicedata;
+	voicedata.m_nFromClient = from;
+	voicedata.m_bProximity = proximity;
+	voicedata.m_nLength = (len * 8);
+	voicedata.m_xuid = 0;
+	voicedata.m_DataOut = const_cast<char *>(data);
+
+	voicedatablob *blob{prepare_native_blob(len)};
+
+	int sent{0};
+	const int maxclients{sv->GetClientCount()};
+	for(int client{1}; client <= maxclients; ++client) {
+		if(!listeners.get(client)) {
+			continue;
+		}
+
+		IClient *cl{get_voice_client(client)};
+		if(!cl) {
+			continue;
+		}
+
+		if(VoiceBroadcast_Send(cl, voicedata, blob, priority)) {
+			++sent;
+		}
+	}
+
+	return sent;
+}
+
+static cell_t SendVoiceDataToMask(IPluginContext *pContext, const cell_t *params)
+{
+	cell_t *mask;
+	pContext->LocalToPhysAddr(params[1], &mask);
+	char *data;
+	pContext->LocalToString(params[2], &data);
+	const int len{params[3]};
+	const int from{params[4]};
+	const bool proximity{static_cast<bool>(params[5])};
+
+	if(len < 0 || len > VOICE_MAX_DATA_BYTES) {
+		return pContext->ThrowNativeError("Invalid data length %d", len);
+	}
+
+	return SendVoiceDataToListeners(*reinterpret_cast<const listenermask *>(mask), data, len, from, proximity);
+}
+
+// Separate from transcode_targets since plugins may send from inside voice forwards
+static std::vector<transcodetarget> pcm_targets;
+
+static cell_t send_voice_pcm(IPluginContext *pContext, const cell_t *clients, int count, const cell_t *params, bool bFinal)
+{
+	char *pcm;
+	pContext->LocalToString(params[1], &pcm);
+	const int nSamples{static_cast<int>(params[2])};
+	const int nSampleRate{static_cast<int>(params[3])};
+	const int from{params[4]};
+	const bool proximity{static_cast<bool>(params[5])};
+
+	if(nSamples < 0) {
+		return pContext->ThrowNativeError("Invalid sample count %i", nSamples);
+	}
+	if(!VoiceResampler::IsSupportedRate(nSampleRate)) {
+		return pContext->ThrowNativeError("Unsupported sample rate %i", nSampleRate);
+	}
+
+	pcm_targets.clear();
+	for(int i{0}; i < count; ++i) {
+		const int client{clients[i]};
+		IClient *cl{get_voice_client(client)};
+		if(!cl || cl->IsFakeClient()) {
+			continue;
+		}
+
+		const voicecodecconfig &config{g_VoiceClients.Get(client)};
+		if(!VoiceTranscoder::CanTranscode(config)) {
+			continue;
+		}
+
+		add_transcode_target(pcm_targets, config, proximity, client);
+	}
+
+	if(pcm_targets.empty()) {
+		return 0;
+	}
+
+	return static_cast<cell_t>(g_VoiceTranscoder.EncodePCM(from, reinterpret_cast<const celt_int16 *>(pcm), nSamples, nSampleRate, pcm_targets, bFinal, Plat_FloatTime()));
+}
+
+static cell_t SendVoicePCM(IPluginContext *pContext, const cell_t *params)
+{
+	const cell_t client{params[1]};
+	// Plugins compiled before final existed pass one parameter less
+	const bool bFinal{params[0] >= 7 && params[7] != 0};
+	return send_voice_pcm(pContext, &client, 1, params + 1, bFinal);
+}
+
+static cell_t SendVoicePCMToClients(IPluginContext *pContext, const cell_t *params)
+{
+	cell_t *clients;
+	pContext->LocalToPhysAddr(params[1], &clients);
+	const int count{params[2]};
+	const bool bFinal{params[0] >= 8 && params[8] != 0};
+
+	if(count < 0) {
+		return pContext->ThrowNativeError("Invalid client count %d", count);
+	}
+
+	return send_voice_pcm(pContext, clients, count, params + 2, bFinal);
+}
+
+static cell_t GetVoiceClientCodec(IPluginContext *pContext, const cell_t *params)
+{
+	const int client{params[1]};
+	if(client < 1 || client > ABSOLUTE_PLAYER_LIMIT) {
+		return pContext->ThrowNativeError("Invalid client index %d", client);
+	}
+
+	const voicecodecconfig &config{g_VoiceClients.Get(client)};
+	pContext->StringToLocal(params[2], params[3], config.codec.c_str());
+
+	cell_t *samplerate;
+	pContext->LocalToPhysAddr(params[4], &samplerate);
+	*samplerate = config.samplerate;
+
+	cell_t *inittime;
+	pContext->LocalToPhysAddr(params[5], &inittime);
+	*inittime = sp_ftoc(static_cast<float>(g_VoiceClients.InitTime(client)));
+
+	return static_cast<cell_t>(g_VoiceClients.HasOverride(client));
+}
+
+static IVoiceCodec *load_voicecodec(std::string_view name, const char *&error)
+{
+	using namespace std::literals::string_view_literals;
+
+	error = "";
+
+	CreateInterfaceFn func{nullptr};
+	auto it{dlmap.find(std::string{name})};
+	if(it == dlmap.end()) {
+		std::string dlpath;
+		dlpath += name;
+		dlpath += ".so"sv;
+
+		//CSysModule *dl{Sys_LoadModule(dlpath.c_str(), SYS_NOFLAGS)};
+		CSysModule *dl{reinterpret_cast<CSysModule *>(dlopen(dlpath.c_str(), RTLD_NOW))};
+		if(dl) {
+			func = Sys_GetFactory(dl);
+			if(func) {
+				dlmap.emplace(std::pair<std::string,codecdl>{name,codecdl{dl,func}});
+			} else {
+				error = "missing factory";
+				dlclose(dl);
+			}
+		} else {
+			const char *err{dlerror()};
+			if(err) {
+				error = err;
+			}
+		}
+	} else {
+		func = it->second.func;
+	}
+
+	if(func) {
+		int status;
+		using namespace std::literals::string_literals;
+		std::string ifacename;
+		ifacename += name;
+		IVoiceCodec *codec{reinterpret_cast<IVoiceCodec *>(func(ifacename.data(), &status))};
+		if(codec) {
+			return codec;
+		} else {
+			error = "factory returned null";
+		}
+	}
+
+	return nullptr;
+}
+
+IVoiceCodec *CreateEngineVoiceCodec(const char *name)
+{
+	const char *error;
+	IVoiceCodec *codec{load_voicecodec(name, error)};
+	if(!codec) {
+		smutils->LogError(myself, "Could not load voice codec \"%s\": %s", name, error);
+	}
+	return codec;
+}
+
+// Handles created as VoiceCodec_Celt, engine codecs are opaque
+static std::unordered_set<IVoiceCodec *> celt_codecs;
+
+static cell_t handle_createvoicecodec(IPluginContext *pContext, const cell_t *params, bool ex)
+{
+	using namespace std::literals::string_view_literals;
+
+	char *name_ptr;
+	pContext->LocalToString(params[1], &name_ptr);
+	std::string_view name{name_ptr};
+
+	if(name == "voicesend_celt"sv) {
+		VoiceCodec_Celt *codec = new VoiceCodec_Celt();
+		celt_codecs.insert(codec);
+		return handlesys->CreateHandle(voicecodec_handle, codec, pContext->GetIdentity(), myself->GetIdentity(), NULL);
+	}
+
+	const char *error;
+	IVoiceCodec *codec{load_voicecodec(name, error)};
+	if(codec) {
+		return handlesys->CreateHandle(voicecodec_handle, codec, pContext->GetIdentity(), myself->GetIdentity(), NULL);
+	}
+
+	if(ex) {
+		const int len{static_cast<cell_t>(params[3])};
+		pContext->StringToLocal(params[2], len, error);
+	}
+
+	return 0;
+}
+
+static cell_t CreateVoiceCodec(IPluginContext *pContext, const cell_t *params)
+{
+	return handle_createvoicecodec(pContext, params, false);
+}
+
+static cell_t CreateVoiceCodecEx(IPluginContext *pContext, const cell_t *params)
+{
+	return handle_createvoicecodec(pContext, params, true);
+}
+
+static cell_t CreateCeltCodecEx(IPluginContext *pContext, const cell_t *params)
+{
+	int samplerate = params[1];
+	int framesize = params[2];
+	int packetsize = params[3];
+
+	VoiceCodec_Celt *codec{new VoiceCodec_Celt{}};
+	codec->Init(samplerate, framesize, packetsize);
+	celt_codecs.insert(codec);
+	return handlesys->CreateHandle(voicecodec_handle, codec, pContext->GetIdentity(), myself->GetIdentity(), NULL);
+}
+
+struct asyncrequest
+{
+	Handle_t hndl;
+	IVoiceCodec *codec;
+	IPluginFunction *callback;
+	cell_t data;
+	bool done;
+	int result;
+	std::vector<char> compressed;
+};
+static std::unordered_map<unsigned int, asyncrequest> async_requests;
+
+// Requests of a codec that are queued, compressing or waiting for FetchAsync
+#define VOICE_ASYNC_MAX_PENDING 64
+static std::unordered_map<IVoiceCodec *, int> async_pending;
+
+static void erase_async_request(std::unordered_map<unsigned int, asyncrequest>::iterator it)
+{
+	auto pending{async_pending.find(it->second.codec)};
+	if(pending != async_pending.end() && --pending->second <= 0) {
+		async_pending.erase(pending);
+	}
+	async_requests.erase(it);
+}
+
+static void cancel_async_requests(IVoiceCodec *codec)
+{
+	g_EncoderPool.Cancel(codec);
+	async_pending.erase(codec);
+
+	for(auto it{async_requests.begin()}; it != async_requests.end();) {
+		if(it->second.codec == codec) {
+			it = async_requests.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+// The encoder pool compresses with the codec itself, so nothing else may touch
+// it until its requests are done. Completed ones only wait for FetchAsync.
+static bool has_async_jobs(IVoiceCodec *codec)
+{
+	if(async_pending.find(codec) == async_pending.end()) {
+		return false;
+	}
+
+	for(const auto &[ticket, request] : async_requests) {
+		if(request.codec == codec && !request.done) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static cell_t VoiceCodecInit(IPluginContext *pContext, const cell_t *params)
+{
+	HandleSecurity security(pContext->GetIdentity(), myself->GetIdentity());
+
+	IVoiceCodec *obj = nullptr;
+	HandleError err = handlesys->ReadHandle(params[1], voicecodec_handle, &security, (void **)&obj);
+	if(err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error: %d)", params[1], err);
+	}
+
+	if(has_async_jobs(obj)) {
+		return pContext->ThrowNativeError("VoiceCodec %x is still compressing asynchronously", params[1]);
+	}
+
+	return static_cast<cell_t>(obj->Init(static_cast<int>(params[2])));
+}
+
+// Resampler of a codec SetInputRate put on another rate, and the resampled
+// samples CompressFrames could not encode yet
+struct codecinput
+{
+	VoiceResampler resampler;
+	std::vector<celt_int16> tail;
+};
+static std::unordered_map<IVoiceCodec *, codecinput> codec_inputs;
+static std::vector<celt_int16> codec_input_pcm;
+
+static cell_t VoiceCodecResetState(IPluginContext *pContext, const cell_t *params)
+{
+	HandleSecurity security(pContext->GetIdentity(), myself->GetIdentity());
+
+	IVoiceCodec *obj = nullptr;
+	HandleError err = handlesys->ReadHandle(params[1], voicecodec_handle, &security, (void **)&obj);
+	if(err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error: %d)", params[1], err);
+	}
+
+	// Queued frames were meant for the state being reset
+	cancel_async_requests(obj);
+
+	auto it{codec_inputs.find(obj)};
+	if(it != codec_inputs.end()) {
+		it->second.resampler.Reset();
+		it->second.tail.clear();
+	}
+
+	return static_cast<cell_t>(obj->ResetState());
+}
+
+static void resample_codec_input(IVoiceCodec *codec, const char *&pUncompressed, int &nSamples)
+{
+	auto it{codec_inputs.find(codec)};
+	if(it == codec_inputs.end()) {
+		return;
+	}
+
+	codecinput &input{it->second};
+	if(nSamples <= 0 && input.tail.empty()) {
+		return;
+	}
+
+	codec_input_pcm.assign(input.tail.begin(), input.tail.end());
+	input.tail.clear();
+	if(nSamples > 0) {
+		input.resampler.Process(reinterpret_cast<const celt_int16 *>(pUncompressed), nSamples, codec_input_pcm);
+	}
+	nSamples = static_cast<int>(codec_input_pcm.size());
+	pUncompressed = reinterpret_cast<const char *>(codec_input_pcm.data());
+}
+
+static cell_t VoiceCodecSetInputRate(IPluginContext *pContext, const cell_t *params)
+{
+	HandleSecurity security(pContext->GetIdentity(), myself->GetIdentity());
+
+	IVoiceCodec *obj = nullptr;
+	HandleError err = handlesys->ReadHandle(params[1], voicecodec_handle, &security, (void **)&obj);
+	if(err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error: %d)", params[1], err);
+	}
+
+	const int nInputRate{static_cast<int>(params[2])};
+	int nCodecRate{static_cast<int>(params[3])};
+	if(nCodecRate == 0) {
+		nCodecRate = g_VoiceClients.Default().samplerate;
+	}
+
+	if(nInputRate == 0 || nInputRate == nCodecRate) {
+		codec_inputs.erase(obj);
+		return 1;
+	}
+
+	VoiceResampler resampler;
+	if(!resampler.Init(nInputRate, nCodecRate)) {
+		return 0;
+	}
+
+	codecinput &input{codec_inputs[obj]};
+	input.resampler = std::move(resampler);
+	input.tail.clear();
+	return 1;
+}
+
+static cell_t VoiceCodecCompress(IPluginContext *pContext, const cell_t *params)
+{
+	HandleSecurity security(pContext->GetIdentity(), myself->GetIdentity());
+
+	IVoiceCodec *obj = nullptr;
+	HandleError err = handlesys->ReadHandle(params[1], voicecodec_handle, &security, (void **)&obj);
+	if(err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error: %d)", params[1], err);
+	}
+
+	if(has_async_jobs(obj)) {
+		return pContext->ThrowNativeError("VoiceCodec %x is still compressing asynchronously", params[1]);
+	}
+
+	char *pInput;
+	pContext->LocalToString(params[2], &pInput);
+	int nSamples{static_cast<int>(params[3])};
+
+	char *pCompressed;
+	pContext->LocalToString(params[4], &pCompressed);
+	int maxCompressedBytes{static_cast<int>(params[5])};
+
+	const bool bFinal{static_cast<bool>(params[6])};
+
+	const char *pUncompressed{pInput};
+	resample_codec_input(obj, pUncompressed, nSamples);
+
+	const int ret{obj->Compress(pUncompressed, nSamples, pCompressed, maxCompressedBytes, bFinal)};
+
+	return static_cast<cell_t>(ret);
+}
+
+static std::vector<char> codec_last_frame;
+
+static cell_t VoiceCodecCompressFrames(IPluginContext *pContext, const cell_t *params)
+{
+	HandleSecurity security(pContext->GetIdentity(), myself->GetIdentity());
+
+	IVoiceCodec *obj = nullptr;
+	HandleError err = handlesys->ReadHandle(params[1], voicecodec_handle, &security, (void **)&obj);
+	if(err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error: %d)", params[1], err);
+	}
+
+	if(has_async_jobs(obj)) {
+		return pContext->ThrowNativeError("VoiceCodec %x is still compressing asynchronously", params[1]);
+	}
+
+	char *pInput;
+	pContext->LocalToString(params[2], &pInput);
+	int nSamples{static_cast<int>(params[3])};
+	const int nFrameSize{static_cast<int>(params[4])};
+
+	char *pCompressed;
+	pContext->LocalToString(params[5], &pCompressed);
+	const int maxCompressedBytes{static_cast<int>(params[6])};
+	const int maxFrameBytes{static_cast<int>(params[7])};
+
+	cell_t *offsets;
+	pContext->LocalToPhysAddr(params[8], &offsets);
+	const int maxFrames{static_cast<int>(params[9])};
+
+	const bool bFinal{static_cast<bool>(params[10])};
+
+	if(nSamples < 0 || nFrameSize <= 0 || maxCompressedBytes < 0 || maxFrameBytes <= 0 || maxFrameBytes > 0xFFFF || maxFrames < 0) {
+		return pContext->ThrowNativeError("Invalid sizes %d/%d/%d/%d/%d", nSamples, nFrameSize, maxCompressedBytes, maxFrameBytes, maxFrames);
+	}
+
+	// Any other size would leave samples pending in the codec and write empty frames
+	if(celt_codecs.count(obj) != 0) {
+		const int nCodecFrameSize{static_cast<VoiceCodec_Celt *>(obj)->EncoderSettings().FrameSize};
+		if(nFrameSize != nCodecFrameSize) {
+			return pContext->ThrowNativeError("Frame size %d does not match the codec frame size %d", nFrameSize, nCodecFrameSize);
+		}
+	}
+
+	const char *pUncompressed{pInput};
+	resample_codec_input(obj, pUncompressed, nSamples);
+
+	const int nFrameBytes{nFrameSize * BYTES_PER_SAMPLE};
+
+	int nFrames{0};
+	int nOffset{0};
+	int nSample{0};
+	for(; nSample < nSamples && nFrames < maxFrames; nSample += nFrameSize) {
+		if(nOffset + 2 + maxFrameBytes > maxCompressedBytes) {
+			break;
+		}
+
+		const char *pFrame{pUncompressed + (nSample * BYTES_PER_SAMPLE)};
+		const int nRemaining{nSamples - nSample};
+		if(nRemaining < nFrameSize) {
+			if(!bFinal) {
+				break;
+			}
+
+			// The tail of the last call is padded with silence to a whole frame
+			codec_last_frame.assign(nFrameBytes, 0);
+			memcpy(codec_last_frame.data(), pFrame, nRemaining * BYTES_PER_SAMPLE);
+			pFrame = codec_last_frame.data();
+		}
+
+		const int ret{obj->Compress(pFrame, nFrameSize, pCompressed + nOffset + 2, maxFrameBytes, bFinal && (nRemaining <= nFrameSize))};
+		if(ret < 0) {
+			return static_cast<cell_t>(ret);
+		}
+
+		pCompressed[nOffset] = static_cast<char>(ret & 0xFF);
+		pCompressed[nOffset + 1] = static_cast<char>((ret >> 8) & 0xFF);
+
+		offsets[nFrames++] = static_cast<cell_t>(nOffset);
+		nOffset += 2 + ret;
+	}
+
+	// The caller can not pass resampled samples again, so the codec input keeps them
+	auto input{codec_inputs.find(obj)};
+	if(input != codec_inputs.end() && nSample < nSamples) {
+		const celt_int16 *pRest{reinterpret_cast<const celt_int16 *>(pUncompressed) + nSample};
+		input->second.tail.assign(pRest, pRest + (nSamples - nSample));
+	}
+
+	return static_cast<cell_t>(nFrames);
+}
+
+VoiceEncoderPool &GetEncoderPool()
+{
+	if(!g_EncoderPool.IsRunning()) {
+		g_EncoderPool.Start(voicesend_encoder_threads.GetInt());
+	}
+
+	return g_EncoderPool;
+}
+
+static cell_t VoiceCodecCompressAsync(IPluginContext *pContext, const cell_t *params)
+{
+	HandleSecurity security(pContext->GetIdentity(), myself->GetIdentity());
+
+	IVoiceCodec *obj = nullptr;
+	HandleError err = handlesys->ReadHandle(params[1], voicecodec_handle, &security, (void **)&obj);
+	if(err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error: %d)", params[1], err);
+	}
+
+	char *pInput;
+	pContext->LocalToString(params[2], &pInput);
+	int nSamples{static_cast<int>(params[3])};
+	const int maxCompressedBytes{static_cast<int>(params[4])};
+	const bool bFinal{static_cast<bool>(params[5])};
+
+	if(nSamples < 0 || maxCompressedBytes < 0) {
+		return pContext->ThrowNativeError("Invalid sizes %d/%d", nSamples, maxCompressedBytes);
+	}
+
+	int &pending{async_pending[obj]};
+	if(pending >= VOICE_ASYNC_MAX_PENDING) {
+		return 0;
+	}
+
+	const char *pUncompressed{pInput};
+	resample_codec_input(obj, pUncompressed, nSamples);
+
+	IPluginFunction *callback{pContext->GetFunctionById(static_cast<funcid_t>(params[6]))};
+
+	const unsigned int ticket{GetEncoderPool().Submit(obj, pUncompressed, nSamples, maxCompressedBytes, bFinal)};
+
+	asyncrequest &request{async_requests[ticket]};
+	request.hndl = static_cast<Handle_t>(params[1]);
+	request.codec = obj;
+	request.callback = callback;
+	request.data = params[7];
+	request.done = false;
+	request.result = -1;
+	++pending;
+
+	return static_cast<cell_t>(ticket);
+}
+
+static cell_t VoiceCodecFetchAsync(IPluginContext *pContext, const cell_t *params)
+{
+	HandleSecurity security(pContext->GetIdentity(), myself->GetIdentity());
+
+	IVoiceCodec *obj = nullptr;
+	HandleError err = handlesys->ReadHandle(params[1], voicecodec_handle, &security, (void **)&obj);
+	if(err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error: %d)", params[1], err);
+	}
+
+	auto it{async_requests.find(static_cast<unsigned int>(params[2]))};
+	if(it == async_requests.end() || it->second.codec != obj || it->second.callback) {
+		return -1;
+	}
+
+	asyncrequest &request{it->second};
+	if(!request.done) {
+		return -2;
+	}
+
+	int ret{request.result};
+	if(ret > 0) {
+		const int maxlen{static_cast<int>(params[4])};
+		if(ret > maxlen) {
+			ret = maxlen;
+		}
+
+		char *pCompressed;
+		pContext->LocalToString(params[3], &pCompressed);
+		memcpy(pCompressed, request.compressed.data(), ret);
+	}
+
+	erase_async_request(it);
+
+	return static_cast<cell_t>(ret);
+}
+
+static void deliver_async_requests()
+{
+	for(std::unique_ptr<VoiceEncodeJob> job{g_EncoderPool.PopCompleted()}; job; job = g_EncoderPool.PopCompleted()) {
+		auto it{async_requests.find(job->ticket)};
+		if(it == async_requests.end()) {
+			if(!g_VoicePlayback.OnEncoded(*job)) {
+				g_VoiceClipEncoder.OnEncoded(*job);
+			}
+			continue;
+		}
+
+		asyncrequest &request{it->second};
+		if(!request.callback) {
+			request.done = true;
+			request.result = job->result;
+			request.compressed = std::move(job->compressed);
+			continue;
+		}
+
+		const int len{job->result > 0 ? job->result : 0};
+
+		request.callback->PushCell(request.hndl);
+		request.callback->PushCell(static_cast<cell_t>(job->ticket));
+		request.callback->PushStringEx(job->compressed.data(), len, SM_PARAM_STRING_COPY|SM_PARAM_STRING_BINARY, 0);
+		request.callback->PushCell(job->result);
+		request.callback->PushCell(request.data);
+		request.callback->Execute(nullptr);
+
+		erase_async_request(it);
+	}
+}
+
+static int play_voice_file(IPluginContext *pContext, const listenermask &listeners, cell_t path_param, int from, bool proximity)
+{
+	char *path;
+	pContext->LocalToString(path_param, &path);
+
+	char error[256];
+	const int id{g_VoicePlayback.Play(path, listeners, from, proximity, error, sizeof(error))};
+	if(id == 0) {
+		smutils->LogError(myself, "Could not play \"%s\": %s", path, error);
+	}
+
+	return id;
+}
+
+static cell_t PlayVoiceFile(IPluginContext *pContext, const cell_t *params)
+{
+	const int client{params[1]};
+	if(client < 1 || client > ABSOLUTE_PLAYER_LIMIT) {
+		return pContext->ThrowNativeError("Invalid client index %d", client);
+	}
+
+	listenermask listeners{};
+	listeners.set(client, true);
+
+	return play_voice_file(pContext, listeners, params[2], params[3], static_cast<bool>(params[4]));
+}
+
+static cell_t PlayVoiceFileToClients(IPluginContext *pContext, const cell_t *params)
+{
+	cell_t *clients;
+	pContext->LocalToPhysAddr(params[1], &clients);
+	const int count{params[2]};
+
+	listenermask listeners{};
+	for(int i{0}; i < count; ++i) {
+		if(clients[i] >= 1 && clients[i] <= ABSOLUTE_PLAYER_LIMIT) {
+			listeners.set(clients[i], true);
+		}
+	}
+
+	return play_voice_file(pContext, listeners, params[3], params[4], static_cast<bool>(params[5]));
+}
+
+static cell_t StopVoicePlayback(IPluginContext *pContext, const cell_t *params)
+{
+	return static_cast<cell_t>(g_VoicePlayback.Stop(params[1]));
+}
+
+static cell_t IsVoicePlaybackActive(IPluginContext *pContext, const cell_t *params)
+{
+	return static_cast<cell_t>(g_VoicePlayback.IsActive(params[1]));
+}
+
+static int play_voice_clip(IPluginContext *pContext, const listenermask &listeners, cell_t path_param, int from, bool proximity)
+{
+	char *path;
+	pContext->LocalToString(path_param, &path);
+
+	char error[256];
+	std::shared_ptr<VoiceClip> clip{g_VoiceClips.Load(path, error, sizeof(error))};
+	if(!clip) {
+		smutils->LogError(myself, "Could not play \"%s\": %s", path, error);
+		return 0;
+	}
+
+	std::unique_ptr<VoiceClipPlayback> playback{new VoiceClipPlayback{std::move(clip)}};
+	playback->m_Listeners = listeners;
+	playback->m_nFrom = from;
+	playback->m_bProximity = proximity;
+
+	return g_VoicePlayback.Add(std::move(playback));
+}
+
+static cell_t PlayVoiceClip(IPluginContext *pContext, const cell_t *params)
+{
+	const int client{params[1]};
+	if(client < 1 || client > ABSOLUTE_PLAYER_LIMIT) {
+		return pContext->ThrowNativeError("Invalid client index %d", client);
+	}
+
+	listenermask listeners{};
+	listeners.set(client, true);
+
+	return play_voice_clip(pContext, listeners, params[2], params[3], static_cast<bool>(params[4]));
+}
+
+static cell_t PlayVoiceClipToClients(IPluginContext *pContext, const cell_t *params)
+{
+	cell_t *clients;
+	pContext->LocalToPhysAddr(params[1], &clients);
+	const int count{params[2]};
+
+	listenermask listeners{};
+	for(int i{0}; i < count; ++i) {
+		if(clients[i] >= 1 && clients[i] <= ABSOLUTE_PLAYER_LIMIT) {
+			listeners.set(clients[i], true);
+		}
+	}
+
+	return play_voice_clip(pContext, listeners, params[3], params[4], static_cast<bool>(params[5]));
+}
+
+struct clipencoderequest
+{
+	IPluginFunction *callback;
+	cell_t data;
+};
+static std::unordered_map<int, clipencoderequest> clip_encode_requests;
+
+static cell_t EncodeVoiceClipNative(IPluginContext *pContext, const cell_t *params)
+{
+	char *source;
+	pContext->LocalToString(params[1], &source);
+	char *output;
+	pContext->LocalToString(params[2], &output);
+
+	char error[256];
+	const int id{g_VoiceClipEncoder.Start(source, output, params[3], params[4], params[5], error, sizeof(error))};
+	if(id == 0) {
+		smutils->LogError(myself, "Could not encode \"%s\": %s", source, error);
+		return 0;
+	}
+
+	clipencoderequest &request{clip_encode_requests[id]};
+	request.callback = pContext->GetFunctionById(static_cast<funcid_t>(params[6]));
+	request.data = params[7];
+
+	return 1;
+}
+
+// The encode outlives the plugin that started it, only its callback goes away
+static void drop_clip_encode_callbacks(IPluginRuntime *runtime)
+{
+	for(auto &[id, request] : clip_encode_requests) {
+		if(request.callback && request.callback->GetParentRuntime() == runtime) {
+			request.callback = nullptr;
+		}
+	}
+}
+
+static void on_clip_encoded(int id, const char *output, bool bSuccess, const char *error)
+{
+	if(bSuccess) {
+		// Drop a stale mapping of the previous file
+		g_VoiceClips.Unload(output);
+	} else {
+		smutils->LogError(myself, "Could not encode \"%s\": %s", output, error);
+	}
+
+	auto it{clip_encode_requests.find(id)};
+	if(it == clip_encode_requests.end()) {
+		return;
+	}
+
+	const clipencoderequest request{it->second};
+	clip_encode_requests.erase(it);
+
+	if(request.callback) {
+		request.callback->PushString(output);
+		request.callback->PushCell(static_cast<cell_t>(bSuccess));
+		request.callback->PushCell(request.data);
+		request.callback->Execute(nullptr);
+	}
+}
+
+static int replay_voice_recording(IPluginContext *pContext, const listenermask &listeners, const cell_t *params)
+{
+	char *path;
+	pContext->LocalToString(params[1], &path);
+
+	std::unique_ptr<VoiceReplayPlayback> playback{new VoiceReplayPlayback{}};
+	playback->m_Listeners = listeners;
+	playback->m_nFrom = params[6];
+	playback->m_bProximity = static_cast<bool>(params[7]);
+
+	char error[256];
+	if(!playback->Open(path, params[2], sp_ctof(params[3]), sp_ctof(params[4]), sp_ctof(params[5]), error, sizeof(error))) {
+		smutils->LogError(myself, "Could not replay \"%s\": %s", path, error);
+		return 0;
+	}
+
+	return g_VoicePlayback.Add(std::move(playback));
+}
+
+static cell_t ReplayVoiceRecording(IPluginContext *pContext, const cell_t *params)
+{
+	const int client{params[1]};
+	if(client < 1 || client > ABSOLUTE_PLAYER_LIMIT) {
+		return pContext->ThrowNativeError("Invalid client index %d", client);
+	}
+
+	listenermask listeners{};
+	listeners.set(client, true);
+
+	return replay_voice_recording(pContext, listeners, params + 1);
+}
+
+static cell_t ReplayVoiceRecordingToClients(IPluginContext *pContext, const cell_t *params)
+{
+	cell_t *clients;
+	pContext->LocalToPhysAddr(params[1], &clients);
+	const int count{params[2]};
+
+	listenermask listeners{};
+	for(int i{0}; i < count; ++i) {
+		if(clients[i] >= 1 && clients[i] <= ABSOLUTE_PLAYER_LIMIT) {
+			listeners.set(clients[i], true);
+		}
+	}
+
+	return replay_voice_recording(pContext, listeners, params + 2);
+}
+
+static int create_voice_stream(IPluginContext *pContext, const listenermask &listeners, const cell_t *params)
+{
+	std::unique_ptr<VoiceStreamPlayback> stream{new VoiceStreamPlayback{}};
+	stream->m_Listeners = listeners;
+	stream->m_nFrom = params[1];
+	stream->m_bProximity = static_cast<bool>(params[2]);
+
+	char error[256];
+	if(!stream->Open(sp_ctof(params[3]), error, sizeof(error))) {
+		smutils->LogError(myself, "Could not create a voice stream: %s", error);
+		return 0;
+	}
+
+	return g_VoicePlayback.Add(std::move(stream));
+}
+
+static cell_t CreateVoiceStream(IPluginContext *pContext, const cell_t *params)
+{
+	const int client{params[1]};
+	if(client < 1 || client > ABSOLUTE_PLAYER_LIMIT) {
+		return pContext->ThrowNativeError("Invalid client index %d", client);
+	}
+
+	listenermask listeners{};
+	listeners.set(client, true);
+
+	return create_voice_stream(pContext, listeners, params + 1);
+}
+
+static cell_t CreateVoiceStreamToClients(IPluginContext *pContext, const cell_t *params)
+{
+	cell_t *clients;
+	pContext->LocalToPhysAddr(params[1], &clients);
+	const int count{params[2]};
+
+	listenermask listeners{};
+	for(int i{0}; i < count; ++i) {
+		if(clients[i] >= 1 && clients[i] <= ABSOLUTE_PLAYER_LIMIT) {
+			listeners.set(clients[i], true);
+		}
+	}
+
+	return create_voice_stream(pContext, listeners, params + 2);
+}
+
+static VoiceStreamPlayback *get_voice_stream(int id)
+{
+	VoicePlayback *playback{g_VoicePlayback.Get(id)};
+	return playback ? playback->Stream() : nullptr;
+}
+
+static cell_t PushVoiceStream(IPluginContext *pContext, const cell_t *params)
+{
+	VoiceStreamPlayback *stream{get_voice_stream(params[1])};
+	if(!stream) {
+		return pContext->ThrowNativeError("Invalid voice stream %d", params[1]);
+	}
+
+	char *data;
+	pContext->LocalToString(params[2], &data);
+	const int length{params[3]};
+	if(length < 0) {
+		return pContext->ThrowNativeError("Invalid length %d", length);
+	}
+
+	return static_cast<cell_t>(stream->Push(data, length));
+}
+
+static cell_t FinishVoiceStream(IPluginContext *pContext, const cell_t *params)
+{
+	VoiceStreamPlayback *stream{get_voice_stream(params[1])};
+	if(!stream) {
+		return 0;
+	}
+
+	stream->Finish();
+	return 1;
+}
+
+static cell_t GetVoiceStreamStats(IPluginContext *pContext, const cell_t *params)
+{
+	VoiceStreamPlayback *stream{get_voice_stream(params[1])};
+	if(!stream) {
+		return 0;
+	}
+
+	cell_t *buffered, *concealed, *dropped;
+	pContext->LocalToPhysAddr(params[2], &buffered);
+	pContext->LocalToPhysAddr(params[3], &concealed);
+	pContext->LocalToPhysAddr(params[4], &dropped);
+
+	*buffered = static_cast<cell_t>(stream->Buffered());
+	*concealed = static_cast<cell_t>(stream->Concealed());
+	*dropped = static_cast<cell_t>(stream->Dropped());
+
+	return 1;
+}
+
+static cell_t StartVoiceRecording(IPluginContext *pContext, const cell_t *params)
+{
+	char *path;
+	pContext->LocalToString(params[1], &path);
+
+	char generated[PLATFORM_MAX_PATH];
+	if(path[0] == '\0') {
+		const time_t now{time(nullptr)};
+		char stamp[32];
+		strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", localtime(&now));
+		smutils->Format(generated, sizeof(generated), "addons/sourcemod/data/voicesend/voice_%s", stamp);
+		path = generated;
+	}
+
+	const voicecodecconfig &config{g_VoiceClients.Default()};
+	const size_t nBufferBytes{static_cast<size_t>(voicesend_record_buffer_kb.GetInt()) * 1024};
+	const size_t nSegmentBytes{static_cast<size_t>(voicesend_record_segment_mb.GetInt()) * 1024 * 1024};
+
+	char error[256];
+	if(!g_VoiceRecorder.Start(path, config.codec.c_str(), config.samplerate, nBufferBytes, nSegmentBytes, error, sizeof(error))) {
+		smutils->LogError(myself, "Could not start recording voice to \"%s\": %s", path, error);
+		return 0;
+	}
+
+	return 1;
+}
+
+static cell_t StopVoiceRecording(IPluginContext *pContext, const cell_t *params)
+{
+	const bool bRecording{g_VoiceRecorder.IsRecording()};
+	g_VoiceRecorder.Stop();
+	return static_cast<cell_t>(bRecording);
+}
+
+static cell_t IsVoiceRecording(IPluginContext *pContext, const cell_t *params)
+{
+	return static_cast<cell_t>(g_VoiceRecorder.IsRecording());
+}
+
+static cell_t GetVoiceRecordingPath(IPluginContext *pContext, const cell_t *params)
+{
+	if(!g_VoiceRecorder.IsRecording()) {
+		return 0;
+	}
+
+	pContext->StringToLocal(params[1], params[2], g_VoiceRecorder.Path().c_str());
+	return 1;
+}
+
+static cell_t GetVoiceRecordingDrops(IPluginContext *pContext, const cell_t *params)
+{
+	return static_cast<cell_t>(g_VoiceRecorder.Dropped());
+}
+
+static cell_t PrecacheVoiceClip(IPluginContext *pContext, const cell_t *params)
+{
+	char *path;
+	pContext->LocalToString(params[1], &path);
+
+	char error[256];
+	if(!g_VoiceClips.Load(path, error, sizeof(error))) {
+		smutils->LogError(myself, "Could not load \"%s\": %s", path, error);
+		return 0;
+	}
+
+	return 1;
+}
+
+static cell_t UnloadVoiceClip(IPluginContext *pContext, const cell_t *params)
+{
+	char *path;
+	pContext->LocalToString(params[1], &path);
+
+	return static_cast<cell_t>(g_VoiceClips.Unload(path));
+}
+
+static void on_playback_finished(int id)
+{
+	OnVoicePlaybackFinished->PushCell(id);
+	OnVoicePlaybackFinished->Execute(nullptr);
+}
+
+static cell_t VoiceCodecDecompress(IPluginContext *pContext, const cell_t *params)
+{
+	HandleSecurity security(pContext->GetIdentity(), myself->GetIdentity());
+
+	IVoiceCodec *obj = nullptr;
+	HandleError err = handlesys->ReadHandle(params[1], voicecodec_handle, &security, (void **)&obj);
+	if(err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error: %d)", params[1], err);
+	}
+
+	if(has_async_jobs(obj)) {
+		return pContext->ThrowNativeError("VoiceCodec %x is still compressing asynchronously", params[1]);
+	}
+
+	char *pCompressed;
+	pContext->LocalToString(params[2], &pCompressed);
+	const int compressedBytes{static_cast<int>(params[3])};
+
+	char *pUncompressed;
+	pContext->LocalToString(params[4], &pUncompressed);
+	const int maxUncompressedBytes{static_cast<int>(params[5])};
+
+	const int ret{obj->Decompress(pCompressed, compressedBytes, pUncompressed, maxUncompressedBytes)};
+
+	return static_cast<cell_t>(ret);
+}
+
+static bool get_pcm_samples(IPluginContext *pContext, cell_t param, int &nSamples)
+{
+	nSamples = static_cast<int>(param);
+	if(nSamples < 0) {
+		pContext->ThrowNativeError("Invalid sample count %i", nSamples);
+		return false;
+	}
+
+	return true;
+}
+
+static cell_t VoicePCMGain(IPluginContext *pContext, const cell_t *params)
+{
+	int nSamples;
+	if(!get_pcm_samples(pContext, params[2], nSamples)) {
+		return 0;
+	}
+
+	char *pcm;
+	pContext->LocalToString(params[1], &pcm);
+
+	PCM_ApplyGain(reinterpret_cast<celt_int16 *>(pcm), nSamples, sp_ctof(params[3]));
+	return 0;
+}
+
+static cell_t VoicePCMMix(IPluginContext *pContext, const cell_t *params)
+{
+	int nSamples;
+	if(!get_pcm_samples(pContext, params[3], nSamples)) {
+		return 0;
+	}
+
+	char *dst;
+	pContext->LocalToString(params[1], &dst);
+
+	char *src;
+	pContext->LocalToString(params[2], &src);
+
+	PCM_MixSaturate(reinterpret_cast<celt_int16 *>(dst), reinterpret_cast<const celt_int16 *>(src), nSamples);
+	return 0;
+}
+
+static cell_t VoicePCMPeak(IPluginContext *pContext, const cell_t *params)
+{
+	int nSamples;
+	if(!get_pcm_samples(pContext, params[2], nSamples)) {
+		return 0;
+	}
+
+	char *pcm;
+	pContext->LocalToString(params[1], &pcm);
+
+	return static_cast<cell_t>(PCM_Peak(reinterpret_cast<const celt_int16 *>(pcm), nSamples));
+}
+
+static cell_t VoicePCMRMS(IPluginContext *pContext, const cell_t *params)
+{
+	int nSamples;
+	if(!get_pcm_samples(pContext, params[2], nSamples)) {
+		return 0;
+	}
+
+	char *pcm;
+	pContext->LocalToString(params[1], &pcm);
+
+	return sp_ftoc(PCM_RMS(reinterpret_cast<const celt_int16 *>(pcm), nSamples));
+}
+
+static cell_t VoicePCMToFloat(IPluginContext *pContext, const cell_t *params)
+{
+	int nSamples;
+	if(!get_pcm_samples(pContext, params[3], nSamples)) {
+		return 0;
+	}
+
+	char *pcm;
+	pContext->LocalToString(params[1], &pcm);
+
+	cell_t *out;
+	pContext->LocalToPhysAddr(params[2], &out);
+
+	PCM_ToFloat(reinterpret_cast<const celt_int16 *>(pcm), reinterpret_cast<float *>(out), nSamples);
+	return 0;
+}
+
+static uint32_t pcm_dither_seed{0x12345678};
+
+static cell_t VoicePCMFromFloat(IPluginContext *pContext, const cell_t *params)
+{
+	int nSamples;
+	if(!get_pcm_samples(pContext, params[3], nSamples)) {
+		return 0;
+	}
+
+	cell_t *in;
+	pContext->LocalToPhysAddr(params[1], &in);
+
+	char *pcm;
+	pContext->LocalToString(params[2], &pcm);
+
+	if(params[4]) {
+		PCM_FromFloatDither(reinterpret_cast<const float *>(in), reinterpret_cast<celt_int16 *>(pcm), nSamples, pcm_dither_seed);
+	} else {
+		PCM_FromFloat(reinterpret_cast<const float *>(in), reinterpret_cast<celt_int16 *>(pcm), nSamples);
+	}
+	return 0;
+}
+
+CON_COMMAND(voicesend_stats, "Prints voicesend pipeline counters, \"voicesend_stats reset\" clears them")
+{
+	if(args.ArgC() > 1 && V_stricmp(args.Arg(1), "reset") == 0) {
+		g_VoiceStats.Reset();
+		return;
+	}
+
+	g_VoiceStats.Print();
+	Msg("  detour:   SV_BroadcastVoiceData %s\n", SV_BroadcastVoiceData_detour->IsEnabled() ? "enabled" : "disabled (engine path)");
+}
+
+CON_COMMAND(voicesend_bench_celt, "Benchmarks the CELT encoder presets in the background, usage: voicesend_bench_celt [seconds] [complexity] [kbps] or voicesend_bench_celt stop")
+{
+	if(args.ArgC() > 1 && V_stricmp(args.Arg(1), "stop") == 0) {
+		VoiceBench_Stop();
+		return;
+	}
+
+	const double flSeconds{(args.ArgC() > 1) ? atof(args.Arg(1)) : 5.0};
+	const int nComplexity{(args.ArgC() > 2) ? atoi(args.Arg(2)) : -1};
+	const int nBitRate{(args.ArgC() > 3) ? atoi(args.Arg(3)) : 0};
+
+	if(!VoiceBench_StartCelt(std::clamp(flSeconds, 0.1, 600.0), nComplexity, nBitRate)) {
+		Msg("voicesend_bench_celt is already running, \"voicesend_bench_celt stop\" stops it\n");
+	}
+}
+
+static cell_t GetVoiceStats(IPluginContext *pContext, const cell_t *params)
+{
+	cell_t *stats;
+	pContext->LocalToPhysAddr(params[1], &stats);
+	const int count{std::min(static_cast<int>(params[2]), static_cast<int>(VoiceStat_Count))};
+
+	for(int i{0}; i < count; ++i) {
+		stats[i] = static_cast<cell_t>(g_VoiceStats.Get(static_cast<voicestat>(i)));
+	}
+
+	return static_cast<cell_t>(count);
+}
+
+static cell_t GetVoiceClientStats(IPluginContext *pContext, const cell_t *params)
+{
+	const int client{params[1]};
+	if(client < 1 || client > ABSOLUTE_PLAYER_LIMIT) {
+		return pContext->ThrowNativeError("Invalid client index %d", client);
+	}
+
+	cell_t *stats;
+	pContext->LocalToPhysAddr(params[2], &stats);
+	const int count{std::min(static_cast<int>(params[3]), static_cast<int>(VoiceClientStat_Count))};
+
+	for(int i{0}; i < count; ++i) {
+		stats[i] = static_cast<cell_t>(g_VoiceStats.GetClient(client, static_cast<voiceclientstat>(i)));
+	}
+
+	return static_cast<cell_t>(count);
+}
+
+static cell_t GetVoiceBroadcastThroughput(IPluginContext *pContext, const cell_t *params)
+{
+	cell_t *nsperrecipient;
+	pContext->LocalToPhysAddr(params[1], &nsperrecipient);
+	*nsperrecipient = sp_ftoc(static_cast<float>(g_VoiceStats.NanosecondsPerRecipient()));
+
+	return sp_ftoc(static_cast<float>(g_VoiceStats.PacketsPerSecond()));
+}
+
+static cell_t GetVoiceBroadcastLatency(IPluginContext *pContext, const cell_t *params)
+{
+	cell_t *p50, *p99, *max;
+	pContext->LocalToPhysAddr(params[1], &p50);
+	pContext->LocalToPhysAddr(params[2], &p99);
+	pContext->LocalToPhysAddr(params[3], &max);
+
+	*p50 = sp_ftoc(static_cast<float>(g_VoiceStats.LatencyPercentile(0.5)));
+	*p99 = sp_ftoc(static_cast<float>(g_VoiceStats.LatencyPercentile(0.99)));
+	*max = sp_ftoc(static_cast<float>(g_VoiceStats.LatencyMax()));
+
+	return static_cast<cell_t>(g_VoiceStats.LatencySamples());
+}
+
+static constexpr const sp_nativeinfo_t natives[]{
+	{"SendVoiceData", SendVoiceData},
+	{"SendVoiceDataToClients", SendVoiceDataToClients},
+	{"SendVoiceDataToMask", SendVoiceDataToMask},
+	{"SendVoicePCM", SendVoicePCM},
+	{"SendVoicePCMToClients", SendVoicePCMToClients},
+	{"GetVoiceClientCodec", GetVoiceClientCodec},
+	{"SendVoiceInit", SendVoiceInit},
+	{"SetVoiceBlocked", SetVoiceBlocked},
+	{"PlayVoiceFile", PlayVoiceFile},
+	{"PlayVoiceFileToClients", PlayVoiceFileToClients},
+	{"PlayVoiceClip", PlayVoiceClip},
+	{"PlayVoiceClipToClients", PlayVoiceClipToClients},
+	{"EncodeVoiceClip", EncodeVoiceClipNative},
+	{"PrecacheVoiceClip", PrecacheVoiceClip},
+	{"UnloadVoiceClip", UnloadVoiceClip},
+	{"StartVoiceRecording", StartVoiceRecording},
+	{"StopVoiceRecording", StopVoiceRecording},
+	{"IsVoiceRecording", IsVoiceRecording},
+	{"GetVoiceRecordingPath", GetVoiceRecordingPath},
+	{"GetVoiceRecordingDrops", GetVoiceRecordingDrops},
+	{"ReplayVoiceRecording", ReplayVoiceRecording},
+	{"ReplayVoiceRecordingToClients", ReplayVoiceRecordingToClients},
+	{"CreateVoiceStream", CreateVoiceStream},
+	{"CreateVoiceStreamToClients", CreateVoiceStreamToClients},
+	{"PushVoiceStream", PushVoiceStream},
+	{"FinishVoiceStream", FinishVoiceStream},
+	{"GetVoiceStreamStats", GetVoiceStreamStats},
+	{"GetVoiceStats", GetVoiceStats},
+	{"GetVoiceClientStats", GetVoiceClientStats},
+	{"GetVoiceBroadcastLatency", GetVoiceBroadcastLatency},
+	{"GetVoiceBroadcastThroughput", GetVoiceBroadcastThroughput},
+	{"StopVoicePlayback", StopVoicePlayback},
+	{"IsVoicePlaybackActive", IsVoicePlaybackActive},
+	{"IsVoiceBlocked", IsVoiceBlocked},
+	{"SetVoiceClientBudget", SetVoiceClientBudget},
+	{"GetVoiceClientBudget", GetVoiceClientBudget},
+	{"SetVoiceActivityThresholds", SetVoiceActivityThresholds},
+	{"ResetVoiceActivityThresholds", ResetVoiceActivityThresholds},
+	{"GetVoiceActivity", GetVoiceActivity},
+	{"CreateVoiceCodec", CreateVoiceCodec},
+	{"CreateVoiceCodecEx", CreateVoiceCodecEx},
+	{"CreateCeltCodecEx", CreateCeltCodecEx},
+	{"VoiceCodec.Init", VoiceCodecInit},
+	{"VoiceCodec.Compress", VoiceCodecCompress},
+	{"VoiceCodec.CompressFrames", VoiceCodecCompressFrames},
+	{"VoiceCodec.CompressAsync", VoiceCodecCompressAsync},
+	{"VoiceCodec.FetchAsync", VoiceCodecFetchAsync},
+	{"VoiceCodec.Decompress", VoiceCodecDecompress},
+	{"VoiceCodec.ResetState", VoiceCodecResetState},
+	{"VoiceCodec.SetInputRate", VoiceCodecSetInputRate},
+	{"VoicePCMGain", VoicePCMGain},
+	{"VoicePCMMix", VoicePCMMix},
+	{"VoicePCMPeak", VoicePCMPeak},
+	{"VoicePCMRMS", VoicePCMRMS},
+	{"VoicePCMToFloat", VoicePCMToFloat},
+	{"VoicePCMFromFloat", VoicePCMFromFloat},
+	{nullptr, nullptr}
+};
+
+void Sample::OnHandleDestroy(HandleType_t type, void *object)
+{
+	if(type == voicecodec_handle) {
+		IVoiceCodec *codec{reinterpret_cast<IVoiceCodec *>(object)};
+		cancel_async_requests(codec);
+		codec_inputs.erase(codec);
+		celt_codecs.erase(codec);
+		codec->ResetState();
+		codec->Release();
+	}
+}
+
+void Sample::OnPluginUnloaded(IPlugin *plugin)
+{
+	drop_clip_encode_callbacks(plugin->GetRuntime());
+}
+
+// Whether any client may be sending vaudio_celt voice
+static bool celt_voice_possible()
+{
+	return is_celt_voicecodec(g_VoiceClients.Default()) || g_VoiceClients.HasOverrides();
+}
+
+// Whether anything needs to see or change broadcast voice packets
+static bool broadcast_detour_needed()
+{
+	return voicesend_always_detour.GetBool() ||
+		OnVoiceDataPre->GetFunctionCount() > 0 ||
+		OnVoiceData->GetFunctionCount() > 0 ||
+		OnVoiceDecoded->GetFunctionCount() > 0 ||
+		voice_blocked_count > 0 ||
+		g_VoiceBudget.IsActive() ||
+		(celt_voice_possible() && (voicesend_vad.GetBool() || g_VoiceVAD.HasOverrides())) ||
+		g_VoiceRecorder.IsRecording() ||
+		(voicesend_mix.GetBool() && celt_voice_possible()) ||
+		(voicesend_transcode.GetBool() && g_VoiceClients.HasOverrides());
+}
+
+// Runs between ticks, never while SV_BroadcastVoiceData is on the stack
+static void update_broadcast_detour()
+{
+	const bool needed{broadcast_detour_needed()};
+	if(needed == SV_BroadcastVoiceData_detour->IsEnabled()) {
+		return;
+	}
+
+	if(needed) {
+		SV_BroadcastVoiceData_detour->EnableDetour();
+	} else {
+		SV_BroadcastVoiceData_detour->DisableDetour();
+	}
+}
+
+void OnGameFrame(bool simulating)
+{
+	const double now{Plat_FloatTime()};
+	g_VoiceBudget.RunFrame(now);
+
+	update_broadcast_detour();
+	deliver_async_requests();
+
+	g_VoicePlayback.RunFrame(now, on_playback_finished);
+	g_VoiceClipEncoder.RunFrame(on_clip_encoded);
+	g_VoiceMixer.RunFrame(now);
+	g_VoiceRecorder.ReportErrors();
+	VoiceBench_RunFrame();
+}
+
+bool Sample::SDK_OnLoad(char *error, size_t maxlen, bool late)
+{
+	IGameConfig *gameconf;
+	gameconfs->LoadGameConfigFile("voicesend", &gameconf, error, maxlen);
+
+	CDetourManager::Init(smutils->GetScriptingEngine(), gameconf);
+
+	SV_WriteVoiceCodec_detour = DETOUR_CREATE_STATIC(SV_WriteVoiceCodec, "SV_WriteVoiceCodec");
+	SV_WriteVoiceCodec_detour->EnableDetour();
+
+	// Enabled by OnGameFrame while a plugin or feature needs it
+	SV_BroadcastVoiceData_detour = DETOUR_CREATE_STATIC(SV_BroadcastVoiceData, "SV_BroadcastVoiceData");
 
 	gameconfs->CloseGameConfigFile(gameconf);
 
 	voicecodec_handle = handlesys->CreateType("VoiceCodec", this, 0, nullptr, nullptr, myself->GetIdentity(), nullptr);
 
 	OnVoiceInit = forwards->CreateForward("OnVoiceInit", ET_Event, 3, nullptr, Param_String, Param_Cell, Param_CellByRef);
-	OnVoiceData = forwards->CreateForward("OnVoiceData", ET_Event, 3, nullptr, Param_CellByRef, Param_String, Param_CellByRef);
+	OnVoiceData = forwards->CreateForward("OnVoiceData", ET_Ignore, 5, nullptr, Param_Cell, Param_Cell, Param_String, Param_Cell, Param_CellByRef);
+	OnVoiceDataPre = forwards->CreateForward("OnVoiceDataPre", ET_Hook, 4, nullptr, Param_Cell, Param_String, Param_CellByRef, Param_Array);
+	OnVoiceDecoded = forwards->CreateForward("OnVoiceDecoded", ET_Ignore, 3, nullptr, Param_Cell, Param_String, Param_Cell);
+	OnVoicePlaybackFinished = forwards->CreateForward("OnVoicePlaybackFinished", ET_Ignore, 1, nullptr, Param_Cell);
 
+	PCM_InitKernels();
+	g_VoiceStats.Init();
 	VoiceCodec_Celt::InitGlobalSettings();
+	VoiceCodec_Celt::WarmCache();
+
+	{
+		const char *pCodec{sv_voicecodec->GetString()};
+		int nSampleRate{Voice_GetDefaultSampleRate(pCodec)};
+		clamp_samplerate(nSampleRate);
+		g_VoiceClients.SetDefault(pCodec, resolve_samplerate(pCodec, nSampleRate), Plat_FloatTime());
+	}
+
+	const VoiceCodec_Celt::CEncoderSettings &settings{VoiceCodec_Celt::TheEncoderSettings()};
+	sender_pcm.resize(((VOICE_MAX_DATA_BYTES / settings.PacketSize) + 1) * settings.FrameSize);
+
 	smutils->AddGameFrameHook(::OnGameFrame);
+	playerhelpers->AddClientListener(this);
+	plsys->AddPluginsListener(this);
 
 	sharesys->AddNatives(myself, natives);
 	sharesys->RegisterLibrary(myself, "voicesend");
@@ -440,12 +2169,32 @@ bool Sample::SDK_OnLoad(char *error, size_t maxlen, bool late)
 void Sample::SDK_OnUnload()
 {
 	smutils->RemoveGameFrameHook(::OnGameFrame);
+	playerhelpers->RemoveClientListener(this);
+	plsys->RemovePluginsListener(this);
+	g_VoiceRecorder.Stop();
+	VoiceBench_Stop();
+	g_VoicePlayback.Clear();
+	g_VoiceClips.Clear();
+	g_VoiceClipEncoder.Clear();
+	clip_encode_requests.clear();
+	g_VoiceMixer.Clear();
+	g_VoiceTranscoder.Clear();
+	g_EncoderPool.Stop();
+	async_requests.clear();
+	async_pending.clear();
+	codec_inputs.clear();
+	celt_codecs.clear();
 	for(auto &[name,dl] : dlmap) {
 		Sys_UnloadModule(dl.dl);
 	}
 	forwards->ReleaseForward(OnVoiceInit);
 	forwards->ReleaseForward(OnVoiceData);
+	forwards->ReleaseForward(OnVoiceDataPre);
+	forwards->ReleaseForward(OnVoiceDecoded);
+	forwards->ReleaseForward(OnVoicePlaybackFinished);
+	free_sender_decoders();
 	handlesys->RemoveType(voicecodec_handle, myself->GetIdentity());
+	VoiceCodec_Celt::ShutdownCache();
 	SV_WriteVoiceCodec_detour->Destroy();
 	SV_BroadcastVoiceData_detour->Destroy();
 }
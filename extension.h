@@ -38,17 +38,97 @@
  */
 
 #include "smsdk_ext.h"
+#include <const.h>
 #include "voicecodec_celt.h"
+#include "voicebudget.h"
+
+class IClient;
+class VoiceEncoderPool;
+
+// Largest voice payload the engine will hand to SV_BroadcastVoiceData
+#define VOICE_MAX_DATA_BYTES 4096
+
+// VOICESEND_ORIGINALSENDER in voicesend.inc, replays from the slot that recorded a packet
+#define VOICE_ORIGINAL_SENDER -501
+
+#define VOICE_LISTENER_CELLS ((ABSOLUTE_PLAYER_LIMIT + 1 + 31) / 32)
+
+/**
+ * @brief Bitset of client indexes, laid out like the plugin side listener arrays.
+ */
+struct listenermask
+{
+	cell_t cells[VOICE_LISTENER_CELLS];
+
+	inline bool get(int client) const
+	{ return (cells[client / 32] & static_cast<cell_t>(1u << (client % 32))) != 0; }
+	inline void set(int client, bool value)
+	{
+		if(value) {
+			cells[client / 32] |= static_cast<cell_t>(1u << (client % 32));
+		} else {
+			cells[client / 32] &= ~static_cast<cell_t>(1u << (client % 32));
+		}
+	}
+
+	// Clears the lowest client index in the mask and returns it, -1 once empty.
+	inline int pop()
+	{
+		for(int i{0}; i < VOICE_LISTENER_CELLS; ++i) {
+			const uint32_t bits{static_cast<uint32_t>(cells[i])};
+			if(bits != 0) {
+				cells[i] = static_cast<cell_t>(bits & (bits - 1));
+				return (i * 32) + __builtin_ctz(bits);
+			}
+		}
+		return -1;
+	}
+};
+
+/**
+ * @brief Sends one voice payload to every connected client in listeners, serializing it once.
+ *
+ * @param priority	Priority against the listener's voice budget.
+ * @return			Number of clients the data was sent to.
+ */
+int SendVoiceDataToListeners(const listenermask &listeners, const char *data, int nBytes, int from, bool proximity, voicepriority priority = VoicePriority_Plugin);
+
+/**
+ * @brief Creates a codec from an engine voice codec library (e.g. vaudio_speex), loading it on first use.
+ *
+ * @return			The codec, or nullptr if it could not be loaded.
+ */
+IVoiceCodec *CreateEngineVoiceCodec(const char *name);
+
+/**
+ * @brief Returns the encoder thread pool, starting it on first use.
+ */
+VoiceEncoderPool &GetEncoderPool();
+
+/**
+ * @brief Decodes a vaudio_celt packet with the sender's persistent decoder.
+ *
+ * @param pClient	Client that sent the packet.
+ * @param settings	CELT settings of the voice_init the client got.
+ * @param data		Compressed voice payload.
+ * @param nBytes	Size of the payload in bytes.
+ * @param nSamples	Number of decoded samples.
+ * @return			Decoded 16-bit mono PCM valid until the next call, or nullptr on failure.
+ */
+const celt_int16 *DecodeSenderVoice(IClient *pClient, const VoiceCodec_Celt::CEncoderSettings &settings, const char *data, int nBytes, int &nSamples);
 
 /**
  * @brief Sample implementation of the SDK Extension.
  * Note: Uncomment one of the pre-defined virtual functions in order to use it.
  */
-class Sample : public SDKExtension, public IHandleTypeDispatch, public IConCommandBaseAccessor
+class Sample : public SDKExtension, public IHandleTypeDispatch, public IConCommandBaseAccessor, public IClientListener, public IPluginsListener
 {
 public:
 	virtual bool RegisterConCommandBase(ConCommandBase *pVar);
 	virtual void OnHandleDestroy(HandleType_t type, void *object);
+	virtual void OnClientPutInServer(int client);
+	virtual void OnClientDisconnected(int client);
+	virtual void OnPluginUnloaded(IPlugin *plugin);
 
 	/**
 	 * @brief This is called after the initial loading sequence has been processed.
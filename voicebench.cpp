@@ -0,0 +1,270 @@
+#include "voicebench.h"
+#include "voicecodec_celt.h"
+#include <tier0/dbg.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdarg>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct celtpreset
+{
+	const char *name;
+	celt_int32 SampleRate_Hz;
+	celt_int32 FrameSize;
+	celt_int32 PacketSize;
+};
+
+// vaudio_celt, vaudio_celt_high and the Init(quality) table
+static const celtpreset celt_presets[]{
+	{"celt_high/q0", 44100, 256, 120},
+	{"q1", 22050, 120, 60},
+	{"q2", 22050, 256, 60},
+	{"celt/q3", 22050, 512, 64},
+};
+
+static const int celt_bitrates[]{24, 32, 48, 64, 96};
+
+// Largest frame CELT encodes
+#define BENCH_MAX_PACKET_BYTES 1275
+
+static std::thread bench_thread;
+static std::atomic<bool> bench_stop{false};
+static std::atomic<bool> bench_done{false};
+
+// Lines the worker printed, Msg is only called from the game thread
+static std::mutex bench_lines_mutex;
+static std::vector<std::string> bench_lines;
+
+static void bench_print(const char *fmt, ...)
+{
+	char buffer[256];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(buffer, sizeof(buffer), fmt, args);
+	va_end(args);
+
+	std::lock_guard<std::mutex> lock{bench_lines_mutex};
+	bench_lines.emplace_back(buffer);
+}
+
+// Packets are capped at PacketSize bytes, so a bitrate is only reached
+// with the packet size it allows per frame.
+static int bench_packet_size(const celtpreset &preset, int bitrate)
+{
+	const double nBytes{(bitrate * 1000.0 / 8.0) * preset.FrameSize / preset.SampleRate_Hz};
+	return std::clamp(static_cast<int>(std::lround(nBytes)), 1, BENCH_MAX_PACKET_BYTES);
+}
+
+static int bench_bitrate(const celtpreset &preset, int nPacketSize)
+{
+	return static_cast<int>(std::lround((nPacketSize * 8.0 / 1000.0) * preset.SampleRate_Hz / preset.FrameSize));
+}
+
+static float bench_noise(uint32_t &seed)
+{
+	seed = (seed * 1664525u) + 1013904223u;
+	return (static_cast<float>(seed >> 8) / 8388608.0f) - 1.0f;
+}
+
+// Glottal pulse train with a gliding pitch through three moving formant
+// resonators, cut into syllables with short pauses in between.
+static void bench_speech(std::vector<celt_int16> &pcm, int rate)
+{
+	struct resonator { float y1, y2; } formants[3]{};
+	uint32_t seed{0x5eed};
+	float phase{0.0f};
+
+	for(size_t i{0}; i < pcm.size(); ++i) {
+		const float t{static_cast<float>(i) / static_cast<float>(rate)};
+		const float f0{150.0f + (50.0f * std::sin(2.0f * static_cast<float>(M_PI) * 0.7f * t))};
+
+		phase += f0 / static_cast<float>(rate);
+		float x{0.0f};
+		if(phase >= 1.0f) {
+			phase -= 1.0f;
+			x = 1.0f;
+		}
+		x += 0.02f * bench_noise(seed);
+
+		const float centers[3]{
+			500.0f + (300.0f * std::sin(2.0f * static_cast<float>(M_PI) * 1.3f * t)),
+			1500.0f + (500.0f * std::sin(2.0f * static_cast<float>(M_PI) * 0.9f * t)),
+			2500.0f,
+		};
+
+		float y{0.0f};
+		for(int f{0}; f < 3; ++f) {
+			const float r{0.97f};
+			const float c{2.0f * r * std::cos(2.0f * static_cast<float>(M_PI) * centers[f] / static_cast<float>(rate))};
+			const float out{x + (c * formants[f].y1) - (r * r * formants[f].y2)};
+			formants[f].y2 = formants[f].y1;
+			formants[f].y1 = out;
+			y += out;
+		}
+
+		const float syllable{std::fmod(t * 4.0f, 1.0f)};
+		const float envelope{(syllable < 0.75f) ? std::sin(static_cast<float>(M_PI) * syllable / 0.75f) : 0.0f};
+		const float pause{(std::fmod(t, 3.0f) < 2.4f) ? 1.0f : 0.0f};
+
+		const float sample{y * envelope * pause * 600.0f};
+		pcm[i] = static_cast<celt_int16>(std::fmax(-32768.0f, std::fmin(32767.0f, sample)));
+	}
+}
+
+// Decaying chords with a few harmonics per note, changing every half second.
+static void bench_music(std::vector<celt_int16> &pcm, int rate)
+{
+	static const float chords[4][3]{
+		{261.63f, 329.63f, 392.00f},
+		{220.00f, 261.63f, 329.63f},
+		{174.61f, 220.00f, 261.63f},
+		{196.00f, 246.94f, 293.66f},
+	};
+
+	for(size_t i{0}; i < pcm.size(); ++i) {
+		const float t{static_cast<float>(i) / static_cast<float>(rate)};
+		const int beat{static_cast<int>(t * 2.0f)};
+		const float envelope{std::exp(-3.0f * std::fmod(t, 0.5f))};
+
+		float y{0.0f};
+		for(float note : chords[beat % 4]) {
+			for(int h{1}; h <= 4; ++h) {
+				y += std::sin(2.0f * static_cast<float>(M_PI) * note * static_cast<float>(h) * t) / static_cast<float>(h);
+			}
+		}
+
+		pcm[i] = static_cast<celt_int16>(y * envelope * 3000.0f);
+	}
+}
+
+static void bench_celt(double flSeconds, int nComplexity, int nBitRate_Kbps)
+{
+	using clock = std::chrono::steady_clock;
+
+	bench_print("%-13s %-6s %5s %4s %5s %6s %10s %8s %11s\n", "preset", "corpus", "rate", "cplx", "kbps", "packet", "us/frame", "rtf", "bytes/frame");
+
+	std::vector<celt_int16> corpus;
+	std::vector<unsigned char> packet;
+
+	for(const celtpreset &preset : celt_presets) {
+		const int nFrames{static_cast<int>(std::ceil(flSeconds * preset.SampleRate_Hz / preset.FrameSize))};
+		corpus.resize(static_cast<size_t>(nFrames) * preset.FrameSize);
+
+		// The preset as shipped, then the bitrate axis
+		std::vector<int> packetsizes;
+		if(nBitRate_Kbps <= 0) {
+			packetsizes.push_back(preset.PacketSize);
+		}
+		for(int bitrate : celt_bitrates) {
+			if(nBitRate_Kbps <= 0 || bitrate == nBitRate_Kbps) {
+				packetsizes.push_back(bench_packet_size(preset, bitrate));
+			}
+		}
+		if(nBitRate_Kbps > 0 && packetsizes.empty()) {
+			packetsizes.push_back(bench_packet_size(preset, nBitRate_Kbps));
+		}
+
+		for(int c{0}; c < 2; ++c) {
+			const char *pCorpus{(c == 0) ? "speech" : "music"};
+			if(c == 0) {
+				bench_speech(corpus, preset.SampleRate_Hz);
+			} else {
+				bench_music(corpus, preset.SampleRate_Hz);
+			}
+
+			for(int nPacketSize : packetsizes) {
+				const int bitrate{bench_bitrate(preset, nPacketSize)};
+				packet.resize(static_cast<size_t>(nPacketSize));
+
+				VoiceCodec_Celt codec;
+				if(!codec.Init(preset.SampleRate_Hz, preset.FrameSize, nPacketSize)) {
+					bench_print("%-13s could not create the encoder\n", preset.name);
+					return;
+				}
+
+				for(int complexity{0}; complexity <= 10; ++complexity) {
+					if(nComplexity >= 0 && complexity != nComplexity) {
+						continue;
+					}
+
+					codec.ResetState();
+					codec.SetComplexity(complexity);
+					codec.SetBitRate(bitrate);
+
+					size_t nBytes{0};
+					const clock::time_point start{clock::now()};
+					for(int f{0}; f < nFrames; ++f) {
+						if(bench_stop.load(std::memory_order_relaxed)) {
+							bench_print("voicesend_bench_celt stopped\n");
+							return;
+						}
+
+						const int ret{codec.Compress(corpus.data() + (static_cast<size_t>(f) * preset.FrameSize), preset.FrameSize, packet.data(), nPacketSize)};
+						if(ret > 0) {
+							nBytes += static_cast<size_t>(ret);
+						}
+					}
+					const double flElapsed{std::chrono::duration<double>{clock::now() - start}.count()};
+
+					bench_print("%-13s %-6s %5d %4d %5d %6d %10.2f %8.4f %11.1f\n",
+						preset.name, pCorpus, preset.SampleRate_Hz, complexity, bitrate, nPacketSize,
+						(flElapsed * 1e6) / nFrames,
+						flElapsed / (static_cast<double>(nFrames) * preset.FrameSize / preset.SampleRate_Hz),
+						static_cast<double>(nBytes) / nFrames);
+				}
+			}
+		}
+	}
+
+	bench_print("voicesend_bench_celt done\n");
+}
+
+bool VoiceBench_StartCelt(double flSeconds, int nComplexity, int nBitRate_Kbps)
+{
+	if(bench_thread.joinable()) {
+		if(!bench_done.load(std::memory_order_acquire)) {
+			return false;
+		}
+		bench_thread.join();
+	}
+
+	bench_stop.store(false, std::memory_order_relaxed);
+	bench_done.store(false, std::memory_order_relaxed);
+	bench_thread = std::thread{[flSeconds, nComplexity, nBitRate_Kbps]() {
+		bench_celt(flSeconds, nComplexity, nBitRate_Kbps);
+		bench_done.store(true, std::memory_order_release);
+	}};
+	return true;
+}
+
+void VoiceBench_RunFrame()
+{
+	std::vector<std::string> lines;
+	{
+		std::lock_guard<std::mutex> lock{bench_lines_mutex};
+		if(bench_lines.empty()) {
+			return;
+		}
+		lines.swap(bench_lines);
+	}
+
+	for(const std::string &line : lines) {
+		Msg("%s", line.c_str());
+	}
+}
+
+void VoiceBench_Stop()
+{
+	if(!bench_thread.joinable()) {
+		return;
+	}
+
+	bench_stop.store(true, std::memory_order_relaxed);
+	bench_thread.join();
+	VoiceBench_RunFrame();
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+// Encodes a synthetic speech and music corpus through VoiceCodec_Celt for
+// every CELT preset the extension knows, over each complexity and bitrate,
+// and prints microseconds per frame, real time factor and bytes per frame.
+// The preset's own packet size is measured first, then every bitrate with
+// the packet size that bitrate allows per frame.
+// nComplexity and nBitRate_Kbps restrict the sweep when >= 0 and > 0.
+// Runs on a worker thread, return false if a bench is already running.
+bool VoiceBench_StartCelt(double flSeconds, int nComplexity, int nBitRate_Kbps);
+
+// Prints what the worker measured so far, game thread only.
+void VoiceBench_RunFrame();
+
+// Stops the worker after the frame it is encoding and waits for it.
+void VoiceBench_Stop();
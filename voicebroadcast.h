@@ -0,0 +1,157 @@
+#pragma once
+
+#include "extension.h"
+#include "netmessages.h"
+#include "voicehearing.h"
+#include "voicestats.h"
+
+// Routing and serialization of one SV_BroadcastVoiceData packet. Templated on
+// the engine types so voicesend_bench_broadcast runs the exact same code
+// against a mock server, the extension instantiates it with IServer and IClient.
+
+struct voicedatablob
+{
+	bool built;
+	bf_write buf;
+	unsigned char data[VOICE_MAX_DATA_BYTES + 16];
+};
+
+// One serialized message per variant of a packet, [proximity][has data].
+struct voicedatablobs
+{
+	voicedatablob blobs[2][2];
+
+	void Reset()
+	{
+		for(auto &row : blobs) {
+			for(voicedatablob &blob : row) {
+				blob.built = false;
+			}
+		}
+	}
+
+	voicedatablob *Get(const SVC_VoiceData &voiceData)
+	{ return &blobs[voiceData.m_bProximity ? 1 : 0][voiceData.m_nLength > 0 ? 1 : 0]; }
+};
+
+template<class TClient>
+bool VoiceBroadcast_CanSendBlob(TClient *pDestClient)
+{
+	if(pDestClient->IsFakeClient() || pDestClient->IsHLTV()) {
+		return false;
+	}
+#if defined( REPLAY_ENABLED )
+	if(pDestClient->IsReplay()) {
+		return false;
+	}
+#endif
+	return pDestClient->GetNetChannel() != nullptr;
+}
+
+static_assert(VoiceStat_DropBudgetPlugin + VoicePriority_Voice == VoiceStat_DropBudgetVoice && VoiceStat_DropBudgetPlugin + VoicePriority_Proximity == VoiceStat_DropBudgetProximity);
+
+// Sends voiceData to pDestClient, serialized into blob once and reused when given.
+// Return false if the listener's voice budget dropped the message.
+template<class TClient>
+bool VoiceBroadcast_Send(TClient *pDestClient, SVC_VoiceData &voiceData, voicedatablob *blob, voicepriority priority)
+{
+	const int nBytes{voiceData.m_nLength / 8};
+	const int listener{pDestClient->GetPlayerSlot()+1};
+
+	if(!g_VoiceBudget.Consume(listener, nBytes, priority)) {
+		g_VoiceStats.Add(static_cast<voicestat>(VoiceStat_DropBudgetPlugin + priority));
+		g_VoiceStats.AddClient(listener, VoiceClientStat_Drops);
+		return false;
+	}
+
+	g_VoiceStats.Add(VoiceStat_MessagesSent);
+	g_VoiceStats.Add(VoiceStat_BytesSent, nBytes);
+	if(listener >= 1 && listener <= ABSOLUTE_PLAYER_LIMIT) {
+		g_VoiceStats.AddClient(listener, VoiceClientStat_MessagesSent);
+		g_VoiceStats.AddClient(listener, VoiceClientStat_BytesSent, nBytes);
+	}
+
+	if(!blob || !VoiceBroadcast_CanSendBlob(pDestClient)) {
+		pDestClient->SendNetMsg(voiceData);
+		return true;
+	}
+
+	if(!blob->built) {
+		blob->buf.StartWriting(blob->data, sizeof(blob->data));
+		if(!voiceData.WriteToBuffer(blob->buf)) {
+			pDestClient->SendNetMsg(voiceData);
+			return true;
+		}
+		blob->built = true;
+	}
+
+	pDestClient->GetNetChannel()->SendData(blob->buf, false);
+	return true;
+}
+
+// Sends voiceData (m_nFromClient, m_DataOut and m_xuid set) from sender to
+// every active client in listeners that hears it, and an empty message to
+// the sender if it does not hear itself. Everyone else is counted as a drop.
+// hook(client, bHears, proximity) runs for each recipient before the send,
+// may change proximity and returns false to skip the client. blobs is null
+// to serialize the message for every recipient.
+template<class TServer, class THook>
+void VoiceBroadcast_FanOut(TServer *server, int sender, SVC_VoiceData &voiceData, int nBytes, const listenermask &listeners, voicedatablobs *blobs, THook &&hook)
+{
+	const voicehearingrow &row{g_VoiceHearing.Row(server, server->GetTick(), sender)};
+	const listenermask &slots{g_VoiceHearing.Slots()};
+	const listenermask &active{g_VoiceHearing.Active()};
+
+	if(blobs) {
+		blobs->Reset();
+	}
+
+	// Sort every slot into blocked, not hearing or recipient with word wide masks
+	listenermask blocked, deaf, recipients;
+	for(int i{0}; i < VOICE_LISTENER_CELLS; ++i) {
+		const cell_t candidates{listeners.cells[i] & active.cells[i]};
+		blocked.cells[i] = slots.cells[i] & ~listeners.cells[i];
+		recipients.cells[i] = candidates & row.hearing.cells[i];
+		deaf.cells[i] = candidates & ~row.hearing.cells[i];
+	}
+
+	// The sender always gets a message, empty if it does not hear itself
+	if(deaf.get(sender)) {
+		deaf.set(sender, false);
+		recipients.set(sender, true);
+	}
+
+	for(int client{blocked.pop()}; client != -1; client = blocked.pop()) {
+		g_VoiceStats.Add(VoiceStat_DropBlocked);
+		g_VoiceStats.AddClient(client, VoiceClientStat_Drops);
+	}
+
+	for(int client{deaf.pop()}; client != -1; client = deaf.pop()) {
+		g_VoiceStats.Add(VoiceStat_DropNotHearing);
+		g_VoiceStats.AddClient(client, VoiceClientStat_Drops);
+	}
+
+	for(int client{recipients.pop()}; client != -1; client = recipients.pop())
+	{
+		const bool bHearsPlayer{row.hearing.get(client)};
+		cell_t proximity{row.proximity.get(client)};
+
+		if(!hook(client, bHearsPlayer, proximity)) {
+			continue;
+		}
+
+		voiceData.m_bProximity = proximity;
+
+		if(!bHearsPlayer) {
+			voiceData.m_nLength = 0;
+		} else {
+			voiceData.m_nLength = nBytes * 8;
+		}
+
+		voicedatablob *blob{blobs ? blobs->Get(voiceData) : nullptr};
+
+		if(VoiceBroadcast_Send(server->GetClient(client-1), voiceData, blob, voiceData.m_bProximity ? VoicePriority_Proximity : VoicePriority_Voice)) {
+			g_VoiceStats.Add(VoiceStat_BroadcastRecipients);
+		}
+	}
+}
@@ -0,0 +1,326 @@
+// Headless bench of the SV_BroadcastVoiceData fan-out. Runs VoiceBroadcast_FanOut,
+// the hearing matrix, the voice budget and SVC_VoiceData serialization against a
+// mock server whose net channels write into a bf_write sink, so routing changes
+// can be measured without a game server or clients.
+//
+// voicesend_bench_broadcast [-clients n] [-speakers n] [-matrix all|team|proximity]
+//                           [-density f] [-bytes n] [-ticks n] [-budget rate] [-bots n]
+// Without -clients every preset is swept.
+
+#include "voicebroadcast.h"
+#include <tier1/convar.h>
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+ConVar *sv_use_steam_voice{nullptr};
+ConVar voicesend_budget_rate{"voicesend_budget_rate", "0"};
+ConVar voicesend_budget_burst{"voicesend_budget_burst", "4096"};
+
+#define BENCH_SINK_BYTES 65536
+#define BENCH_TICK_INTERVAL 0.015
+
+// Every message of every channel lands in one sink, rewound once it fills up.
+static unsigned char bench_sink_data[BENCH_SINK_BYTES];
+static bf_write bench_sink{bench_sink_data, sizeof(bench_sink_data)};
+static uint64_t bench_sink_bytes{0};
+
+static void bench_sink_reserve(int nBytes)
+{
+	if(bench_sink.GetNumBytesLeft() < nBytes) {
+		bench_sink.Reset();
+	}
+}
+
+class MockNetChannel
+{
+public:
+	bool SendData(bf_write &msg, bool bReliable = true)
+	{
+		bench_sink_reserve(msg.GetNumBytesWritten());
+		bench_sink.WriteBits(msg.GetBasePointer(), msg.GetNumBitsWritten());
+		bench_sink_bytes += msg.GetNumBytesWritten();
+		return true;
+	}
+};
+
+class MockClient
+{
+public:
+	int GetPlayerSlot() const { return m_nSlot; }
+	bool IsActive() const { return true; }
+	bool IsFakeClient() const { return m_bFake; }
+	bool IsHLTV() const { return false; }
+	bool IsReplay() const { return false; }
+	MockNetChannel *GetNetChannel() { return m_bFake ? nullptr : &m_NetChannel; }
+
+	bool IsHearingClient(int index) const { return m_Hearing.get(index+1); }
+	bool IsProximityHearingClient(int index) const { return m_Proximity.get(index+1); }
+
+	bool SendNetMsg(INetMessage &msg, bool bForceReliable = false)
+	{
+		if(m_bFake) {
+			return true;
+		}
+
+		bench_sink_reserve(VOICE_MAX_DATA_BYTES + 16);
+		const int nStart{bench_sink.GetNumBytesWritten()};
+		msg.WriteToBuffer(bench_sink);
+		bench_sink_bytes += bench_sink.GetNumBytesWritten() - nStart;
+		return true;
+	}
+
+	int m_nSlot{0};
+	bool m_bFake{false};
+	listenermask m_Hearing{};
+	listenermask m_Proximity{};
+
+private:
+	MockNetChannel m_NetChannel;
+};
+
+class MockServer
+{
+public:
+	int GetClientCount() const { return static_cast<int>(m_Clients.size()); }
+	MockClient *GetClient(int index) { return &m_Clients[index]; }
+	int GetTick() const { return m_nTick; }
+
+	std::vector<MockClient> m_Clients;
+	int m_nTick{0};
+};
+
+enum benchmatrix
+{
+	BenchMatrix_All, // alltalk, everyone hears everyone
+	BenchMatrix_Team, // two teams that only hear their own
+	BenchMatrix_Proximity, // density of the server hears each speaker as proximity voice
+	BenchMatrix_Count
+};
+
+static const char *const bench_matrix_names[BenchMatrix_Count]{"all", "team", "proximity"};
+
+struct benchconfig
+{
+	int clients{32};
+	int speakers{4};
+	int bots{0};
+	benchmatrix matrix{BenchMatrix_All};
+	float density{0.25f};
+	int bytes{64};
+	int ticks{20000};
+	int budget{0};
+};
+
+static void build_server(MockServer &server, const benchconfig &config)
+{
+	std::mt19937 rng{1};
+	std::uniform_real_distribution<float> roll{0.0f, 1.0f};
+
+	server.m_Clients.assign(config.clients, MockClient{});
+	for(int i{0}; i < config.clients; ++i) {
+		MockClient &listener{server.m_Clients[i]};
+		listener.m_nSlot = i;
+		listener.m_bFake = (i >= config.clients - config.bots);
+
+		for(int sender{1}; sender <= config.clients; ++sender) {
+			bool bHears{true};
+			bool bProximity{false};
+			switch(config.matrix) {
+				case BenchMatrix_All: {
+					break;
+				}
+				case BenchMatrix_Team: {
+					bHears = ((sender-1) % 2) == (i % 2);
+					break;
+				}
+				case BenchMatrix_Proximity: {
+					bHears = (sender == i+1) || roll(rng) < config.density;
+					bProximity = bHears;
+					break;
+				}
+				default: {
+					break;
+				}
+			}
+			listener.m_Hearing.set(sender, bHears);
+			listener.m_Proximity.set(sender, bProximity);
+		}
+	}
+}
+
+struct benchresult
+{
+	double packetsPerSecond;
+	double nsPerRecipient;
+	uint64_t recipients;
+	uint64_t bytes;
+};
+
+static benchresult run_bench(const benchconfig &config, bool bPreserialize)
+{
+	MockServer server;
+	build_server(server, config);
+
+	listenermask listeners{};
+	for(int client{1}; client <= config.clients; ++client) {
+		listeners.set(client, true);
+	}
+
+	std::vector<char> data(config.bytes);
+	for(int i{0}; i < config.bytes; ++i) {
+		data[i] = static_cast<char>(i * 37);
+	}
+
+	voicesend_budget_rate.SetValue(config.budget);
+	for(int client{1}; client <= config.clients; ++client) {
+		g_VoiceBudget.Reset(client);
+	}
+	g_VoiceHearing.Invalidate();
+	g_VoiceStats.Reset();
+	bench_sink.Reset();
+	bench_sink_bytes = 0;
+
+	voicedatablobs blobs;
+	const int speakers{std::min(config.speakers, config.clients)};
+
+	const auto start{std::chrono::steady_clock::now()};
+	for(int tick{0}; tick < config.ticks; ++tick) {
+		server.m_nTick = tick;
+		g_VoiceBudget.RunFrame(tick * BENCH_TICK_INTERVAL);
+
+		for(int sender{1}; sender <= speakers; ++sender) {
+			SVC_VoiceData voiceData;
+			voiceData.m_nFromClient = sender-1;
+			voiceData.m_nLength = config.bytes * 8;
+			voiceData.m_DataOut = data.data();
+			voiceData.m_xuid = 0;
+
+			g_VoiceStats.Add(VoiceStat_PacketsIn);
+			VoiceBroadcast_FanOut(&server, sender, voiceData, config.bytes, listeners, bPreserialize ? &blobs : nullptr,
+				[](int client, bool bHearsPlayer, cell_t &proximity) { return true; });
+		}
+	}
+	const double ns{static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count())};
+
+	benchresult result{};
+	const uint64_t packets{g_VoiceStats.Get(VoiceStat_PacketsIn)};
+	result.recipients = g_VoiceStats.Get(VoiceStat_BroadcastRecipients);
+	result.bytes = bench_sink_bytes;
+	result.packetsPerSecond = (ns > 0.0) ? (packets / (ns / 1e9)) : 0.0;
+	result.nsPerRecipient = (result.recipients > 0) ? (ns / result.recipients) : 0.0;
+	return result;
+}
+
+static void print_header()
+{
+	printf("%7s %8s %4s %-9s %-13s %12s %12s %13s %12s\n",
+		"clients", "speakers", "bots", "matrix", "path", "packets/s", "ns/recipient", "recipients", "bytes");
+}
+
+static void print_run(const benchconfig &config)
+{
+	for(int serialize{1}; serialize >= 0; --serialize) {
+		const benchresult result{run_bench(config, serialize != 0)};
+		printf("%7d %8d %4d %-9s %-13s %12.0f %12.1f %13" PRIu64 " %12" PRIu64 "\n",
+			config.clients, std::min(config.speakers, config.clients), config.bots, bench_matrix_names[config.matrix],
+			serialize ? "preserialized" : "per-recipient",
+			result.packetsPerSecond, result.nsPerRecipient,
+			result.recipients, result.bytes);
+	}
+}
+
+static bool parse_matrix(const char *name, benchmatrix &matrix)
+{
+	for(int i{0}; i < BenchMatrix_Count; ++i) {
+		if(strcmp(name, bench_matrix_names[i]) == 0) {
+			matrix = static_cast<benchmatrix>(i);
+			return true;
+		}
+	}
+	return false;
+}
+
+int main(int argc, char **argv)
+{
+	benchconfig config;
+	bool bSweep{true};
+
+	for(int i{1}; i < argc; ++i) {
+		const char *arg{argv[i]};
+		const char *value{(i + 1 < argc) ? argv[i+1] : nullptr};
+		if(!value) {
+			fprintf(stderr, "Missing value for %s\n", arg);
+			return 1;
+		}
+		++i;
+
+		if(strcmp(arg, "-clients") == 0) {
+			config.clients = atoi(value);
+			bSweep = false;
+		} else if(strcmp(arg, "-speakers") == 0) {
+			config.speakers = atoi(value);
+		} else if(strcmp(arg, "-bots") == 0) {
+			config.bots = atoi(value);
+		} else if(strcmp(arg, "-matrix") == 0) {
+			if(!parse_matrix(value, config.matrix)) {
+				fprintf(stderr, "Unknown matrix %s\n", value);
+				return 1;
+			}
+		} else if(strcmp(arg, "-density") == 0) {
+			config.density = static_cast<float>(atof(value));
+		} else if(strcmp(arg, "-bytes") == 0) {
+			config.bytes = atoi(value);
+		} else if(strcmp(arg, "-ticks") == 0) {
+			config.ticks = atoi(value);
+		} else if(strcmp(arg, "-budget") == 0) {
+			config.budget = atoi(value);
+		} else {
+			fprintf(stderr, "Unknown option %s\n", arg);
+			return 1;
+		}
+	}
+
+	if(config.clients < 1 || config.clients > ABSOLUTE_PLAYER_LIMIT) {
+		fprintf(stderr, "-clients must be between 1 and %d\n", ABSOLUTE_PLAYER_LIMIT);
+		return 1;
+	}
+	if(config.bytes < 1 || config.bytes > VOICE_MAX_DATA_BYTES) {
+		fprintf(stderr, "-bytes must be between 1 and %d\n", VOICE_MAX_DATA_BYTES);
+		return 1;
+	}
+	if(config.speakers < 1 || config.ticks < 1 || config.bots < 0 || config.bots > config.clients) {
+		fprintf(stderr, "Invalid -speakers, -ticks or -bots\n");
+		return 1;
+	}
+
+	g_VoiceStats.Init();
+	print_header();
+
+	if(!bSweep) {
+		print_run(config);
+		return 0;
+	}
+
+	static const int sweep_clients[]{24, 32, 64, 100};
+	static const int sweep_speakers[]{1, 4, 16};
+	for(int clients : sweep_clients) {
+		for(int speakers : sweep_speakers) {
+			for(int matrix{0}; matrix < BenchMatrix_Count; ++matrix) {
+				benchconfig run{config};
+				run.clients = clients;
+				run.speakers = speakers;
+				run.matrix = static_cast<benchmatrix>(matrix);
+				run.bots = std::min(config.bots, clients);
+				print_run(run);
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,84 @@
+#include "voicebudget.h"
+#include <tier1/convar.h>
+#include <algorithm>
+
+extern ConVar voicesend_budget_rate;
+extern ConVar voicesend_budget_burst;
+
+VoiceBandwidthBudget g_VoiceBudget;
+
+// Share of the burst a priority has to leave in the bucket
+static const double budget_reserve[VoicePriority_Count]{
+	0.5, // VoicePriority_Plugin
+	0.25, // VoicePriority_Voice
+	0.0, // VoicePriority_Proximity
+};
+
+int VoiceBandwidthBudget::Rate(int client) const
+{
+	const int rate{m_Clients[client].rate};
+	return (rate != 0) ? rate : voicesend_budget_rate.GetInt();
+}
+
+int VoiceBandwidthBudget::Burst(int client) const
+{
+	const int burst{m_Clients[client].burst};
+	return (burst > 0) ? burst : voicesend_budget_burst.GetInt();
+}
+
+bool VoiceBandwidthBudget::IsActive() const
+{
+	return voicesend_budget_rate.GetInt() > 0 || m_nOverrides > 0;
+}
+
+bool VoiceBandwidthBudget::Consume(int client, int nBytes, voicepriority priority)
+{
+	if(client < 1 || client > ABSOLUTE_PLAYER_LIMIT || nBytes <= 0) {
+		return true;
+	}
+
+	const int rate{Rate(client)};
+	if(rate <= 0) {
+		return true;
+	}
+
+	const double burst{static_cast<double>(std::max(Burst(client), nBytes))};
+
+	bucket &b{m_Clients[client]};
+	if(b.tokens < 0.0) {
+		b.tokens = burst;
+	} else {
+		b.tokens = std::min(burst, b.tokens + ((m_flNow - b.last) * rate));
+	}
+	b.last = m_flNow;
+
+	// Messages bigger than the share of the burst above the reserve still go out of a full bucket
+	const double reserve{std::min(burst * budget_reserve[priority], burst - nBytes)};
+	if(b.tokens - nBytes < reserve) {
+		return false;
+	}
+
+	b.tokens -= nBytes;
+	return true;
+}
+
+void VoiceBandwidthBudget::Set(int client, int rate, int burst)
+{
+	bucket &b{m_Clients[client]};
+
+	if(b.rate > 0) {
+		--m_nOverrides;
+	}
+	if(rate > 0) {
+		++m_nOverrides;
+	}
+
+	b.rate = rate;
+	b.burst = std::max(burst, 0);
+	b.tokens = -1.0;
+}
+
+void VoiceBandwidthBudget::Reset(int client)
+{
+	Set(client, 0, 0);
+}
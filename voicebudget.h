@@ -0,0 +1,54 @@
+#pragma once
+
+#include <const.h>
+
+// Order in which voice is dropped for a listener that is over budget,
+// plugin voice goes first and proximity voice last.
+enum voicepriority
+{
+	VoicePriority_Plugin,
+	VoicePriority_Voice,
+	VoicePriority_Proximity,
+	VoicePriority_Count
+};
+
+// Per listener token bucket over the bytes of voice sent to it. Tokens
+// refill at the client's rate up to its burst, and every priority keeps a
+// share of the burst out of reach of the ones below it, so as a listener
+// runs dry plugin voice is dropped first, then non-proximity voice, then
+// proximity voice. Rates and bursts are in bytes, 0 uses the convars.
+class VoiceBandwidthBudget
+{
+public:
+	// Refills are computed against the time of the last RunFrame.
+	void RunFrame(double now) { m_flNow = now; }
+
+	// Return false if the packet has to be dropped, otherwise charges nBytes.
+	bool Consume(int client, int nBytes, voicepriority priority);
+
+	// A negative rate sends to the client without any budget.
+	void Set(int client, int rate, int burst);
+	void Reset(int client);
+
+	int Rate(int client) const;
+	int Burst(int client) const;
+	double Tokens(int client) const { return m_Clients[client].tokens; }
+
+	// Whether any client can currently be limited.
+	bool IsActive() const;
+
+private:
+	struct bucket
+	{
+		int rate{0};
+		int burst{0};
+		double tokens{-1.0}; // Negative until the first packet fills the bucket
+		double last{0.0};
+	};
+
+	double m_flNow{0.0};
+	int m_nOverrides{0};
+	bucket m_Clients[ABSOLUTE_PLAYER_LIMIT + 1];
+};
+
+extern VoiceBandwidthBudget g_VoiceBudget;
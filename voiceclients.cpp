@@ -0,0 +1,86 @@
+#include "voiceclients.h"
+
+VoiceClientRegistry g_VoiceClients;
+
+void VoiceClientRegistry::CountOverrides()
+{
+	m_nOverrides = 0;
+	for(int client{1}; client <= ABSOLUTE_PLAYER_LIMIT; ++client) {
+		if(m_bOverride[client] || (m_bBound[client] && m_Defaults[client] != m_Default)) {
+			++m_nOverrides;
+		}
+	}
+}
+
+void VoiceClientRegistry::SetDefault(const char *codec, int samplerate, double time)
+{
+	const bool bChanged{m_Default.codec != codec || m_Default.samplerate != samplerate};
+
+	m_Default.codec = codec;
+	m_Default.samplerate = samplerate;
+	m_flDefaultTime = time;
+
+	if(bChanged) {
+		CountOverrides();
+	}
+}
+
+void VoiceClientRegistry::BindDefault(int client)
+{
+	if(client < 1 || client > ABSOLUTE_PLAYER_LIMIT)
+		return;
+
+	m_Defaults[client] = m_Default;
+	m_flDefaultTimes[client] = m_flDefaultTime;
+	m_bBound[client] = true;
+	CountOverrides();
+}
+
+void VoiceClientRegistry::Set(int client, const char *codec, int samplerate, double time)
+{
+	if(client < 1 || client > ABSOLUTE_PLAYER_LIMIT)
+		return;
+
+	m_bOverride[client] = true;
+	m_Clients[client].codec = codec;
+	m_Clients[client].samplerate = samplerate;
+	m_flTime[client] = time;
+	CountOverrides();
+}
+
+void VoiceClientRegistry::Reset(int client)
+{
+	if(client < 1 || client > ABSOLUTE_PLAYER_LIMIT)
+		return;
+
+	m_bOverride[client] = false;
+	m_bBound[client] = false;
+	CountOverrides();
+}
+
+const voicecodecconfig &VoiceClientRegistry::Get(int client) const
+{
+	if(HasOverride(client))
+		return m_Clients[client];
+
+	if(client >= 1 && client <= ABSOLUTE_PLAYER_LIMIT && m_bBound[client])
+		return m_Defaults[client];
+
+	return m_Default;
+}
+
+double VoiceClientRegistry::InitTime(int client) const
+{
+	if(HasOverride(client))
+		return m_flTime[client];
+
+	if(client >= 1 && client <= ABSOLUTE_PLAYER_LIMIT && m_bBound[client])
+		return m_flDefaultTimes[client];
+
+	return m_flDefaultTime;
+}
+
+bool VoiceClientRegistry::HasOverride(int client) const
+{
+	return client >= 1 && client <= ABSOLUTE_PLAYER_LIMIT && m_bOverride[client];
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string>
+#include <const.h>
+
+// Voice codec and sample rate a client was told to use by voice_init.
+struct voicecodecconfig
+{
+	std::string codec;
+	int samplerate{0};
+
+	bool operator==(const voicecodecconfig &other) const
+	{ return samplerate == other.samplerate && codec == other.codec; }
+	bool operator!=(const voicecodecconfig &other) const
+	{ return !(*this == other); }
+};
+
+// Remembers the voice_init every client got and when. Clients without one
+// of their own use the server default SV_WriteVoiceCodec last wrote for them,
+// which stays with the client when a later one writes another default.
+// Times are Plat_FloatTime.
+class VoiceClientRegistry
+{
+public:
+	void SetDefault(const char *codec, int samplerate, double time);
+	// Keeps the default last written for client, call once its voice_init went out.
+	void BindDefault(int client);
+	void Set(int client, const char *codec, int samplerate, double time);
+	void Reset(int client);
+
+	const voicecodecconfig &Get(int client) const;
+	const voicecodecconfig &Default() const { return m_Default; }
+	double InitTime(int client) const;
+	bool HasOverride(int client) const;
+	// Whether any client may be on something other than Default().
+	bool HasOverrides() const { return m_nOverrides > 0; }
+
+private:
+	void CountOverrides();
+
+	voicecodecconfig m_Default;
+	double m_flDefaultTime{0.0};
+	voicecodecconfig m_Clients[ABSOLUTE_PLAYER_LIMIT + 1];
+	double m_flTime[ABSOLUTE_PLAYER_LIMIT + 1]{};
+	bool m_bOverride[ABSOLUTE_PLAYER_LIMIT + 1]{};
+	voicecodecconfig m_Defaults[ABSOLUTE_PLAYER_LIMIT + 1];
+	double m_flDefaultTimes[ABSOLUTE_PLAYER_LIMIT + 1]{};
+	bool m_bBound[ABSOLUTE_PLAYER_LIMIT + 1]{};
+	int m_nOverrides{0};
+};
+
+extern VoiceClientRegistry g_VoiceClients;
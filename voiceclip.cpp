@@ -0,0 +1,399 @@
+#include "voiceclip.h"
+#include "voiceencoder.h"
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Frames of a clip queued on the encoder pool at once
+#define CLIP_ENCODE_LOOKAHEAD_FRAMES 64
+
+VoiceClipCache g_VoiceClips;
+VoiceClipEncoder g_VoiceClipEncoder;
+
+VoiceClip::~VoiceClip()
+{
+	if(m_pBase)
+		munmap(m_pBase, m_nSize);
+}
+
+bool VoiceClip::Map(const char *fullpath, char *error, size_t maxlen)
+{
+	const int fd{open(fullpath, O_RDONLY)};
+	if(fd == -1) {
+		smutils->Format(error, maxlen, "could not open \"%s\"", fullpath);
+		return false;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) == -1 || static_cast<size_t>(st.st_size) < sizeof(voiceclipheader)) {
+		smutils->Format(error, maxlen, "\"%s\" is not a voice clip", fullpath);
+		close(fd);
+		return false;
+	}
+
+	void *base{mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0)};
+	close(fd);
+
+	if(base == MAP_FAILED) {
+		smutils->Format(error, maxlen, "could not map \"%s\"", fullpath);
+		return false;
+	}
+
+	m_pBase = static_cast<unsigned char *>(base);
+	m_nSize = static_cast<size_t>(st.st_size);
+
+	const voiceclipheader &header{Header()};
+	if(memcmp(header.magic, VOICECLIP_MAGIC, 4) != 0 || header.version != VOICECLIP_VERSION) {
+		smutils->Format(error, maxlen, "\"%s\" is not a version %d voice clip", fullpath, VOICECLIP_VERSION);
+		return false;
+	}
+
+	if(header.samplerate == 0 || header.framesize == 0 || header.packetsize == 0 || header.packetsize > VOICE_MAX_DATA_BYTES) {
+		smutils->Format(error, maxlen, "\"%s\" has invalid codec settings %u/%u/%u", fullpath, header.samplerate, header.framesize, header.packetsize);
+		return false;
+	}
+
+	// Playback trusts framecount and the lengths, so walk them once here
+	const unsigned char *pFrames{Frames()};
+	const size_t nSize{FramesSize()};
+	size_t nOffset{0};
+	for(uint32_t i{0}; i < header.framecount; ++i) {
+		uint16_t len;
+		if(nOffset + sizeof(len) > nSize) {
+			smutils->Format(error, maxlen, "\"%s\" is truncated at frame %u of %u", fullpath, i, header.framecount);
+			return false;
+		}
+
+		memcpy(&len, pFrames + nOffset, sizeof(len));
+		nOffset += sizeof(len);
+
+		if(len == 0 || len > header.packetsize || nOffset + len > nSize) {
+			smutils->Format(error, maxlen, "\"%s\" has an invalid frame %u", fullpath, i);
+			return false;
+		}
+
+		nOffset += len;
+	}
+
+	madvise(m_pBase, m_nSize, MADV_WILLNEED);
+
+	return true;
+}
+
+VoiceClipEncode::VoiceClipEncode()
+{
+	m_pSource = nullptr;
+	m_pOutput = nullptr;
+	m_nRemainingBytes = -1;
+	m_bEof = false;
+	m_pCodec = nullptr;
+	m_nInFlight = 0;
+	m_Header = voiceclipheader{};
+}
+
+VoiceClipEncode::~VoiceClipEncode()
+{
+	if(m_pCodec) {
+		g_EncoderPool.Cancel(m_pCodec);
+		m_pCodec->Release();
+	}
+
+	if(m_pSource)
+		fclose(m_pSource);
+
+	// Still open means the encode did not finish
+	if(m_pOutput) {
+		fclose(m_pOutput);
+		remove(m_TempPath.c_str());
+	}
+}
+
+bool VoiceClipEncode::Open(const char *source, const char *output, int nSampleRate, int nFrameSize, int nPacketSize, char *error, size_t maxlen)
+{
+	m_pCodec = new VoiceCodec_Celt{};
+	if(!m_pCodec->Init(nSampleRate, nFrameSize, nPacketSize)) {
+		smutils->Format(error, maxlen, "could not create the CELT encoder");
+		return false;
+	}
+
+	const VoiceCodec_Celt::CEncoderSettings &settings{m_pCodec->EncoderSettings()};
+
+	char sourcepath[PLATFORM_MAX_PATH];
+	smutils->BuildPath(Path_Game, sourcepath, sizeof(sourcepath), "%s", source);
+
+	char outputpath[PLATFORM_MAX_PATH];
+	smutils->BuildPath(Path_Game, outputpath, sizeof(outputpath), "%s", output);
+
+	m_Output = output;
+	m_OutputPath = outputpath;
+	m_TempPath = m_OutputPath + ".tmp";
+
+	m_pSource = fopen(sourcepath, "rb");
+	if(!m_pSource) {
+		smutils->Format(error, maxlen, "could not open \"%s\"", sourcepath);
+		return false;
+	}
+
+	if(!ReadWavHeader(m_pSource, settings.SampleRate_Hz, m_nRemainingBytes, error, maxlen)) {
+		return false;
+	}
+
+	m_pOutput = fopen(m_TempPath.c_str(), "wb");
+	if(!m_pOutput) {
+		smutils->Format(error, maxlen, "could not create \"%s\"", m_TempPath.c_str());
+		return false;
+	}
+
+	memcpy(m_Header.magic, VOICECLIP_MAGIC, 4);
+	m_Header.version = VOICECLIP_VERSION;
+	m_Header.reserved = 0;
+	m_Header.samplerate = static_cast<uint32_t>(settings.SampleRate_Hz);
+	m_Header.framesize = static_cast<uint32_t>(settings.FrameSize);
+	m_Header.packetsize = static_cast<uint32_t>(settings.PacketSize);
+	m_Header.framecount = 0;
+	fwrite(&m_Header, sizeof(m_Header), 1, m_pOutput);
+
+	m_Frame.resize(settings.FrameSize * BYTES_PER_SAMPLE);
+
+	Submit();
+
+	return true;
+}
+
+void VoiceClipEncode::Submit()
+{
+	const VoiceCodec_Celt::CEncoderSettings &settings{m_pCodec->EncoderSettings()};
+
+	while(!m_bEof && m_nInFlight < CLIP_ENCODE_LOOKAHEAD_FRAMES) {
+		size_t want{m_Frame.size()};
+		if(m_nRemainingBytes >= 0 && static_cast<size_t>(m_nRemainingBytes) < want) {
+			want = static_cast<size_t>(m_nRemainingBytes);
+		}
+
+		const size_t got{fread(m_Frame.data(), 1, want, m_pSource)};
+		if(m_nRemainingBytes >= 0) {
+			m_nRemainingBytes -= static_cast<long>(got);
+		}
+
+		if(got < m_Frame.size() || m_nRemainingBytes == 0) {
+			m_bEof = true;
+		}
+
+		if(got == 0) {
+			break;
+		}
+
+		memset(m_Frame.data() + got, 0, m_Frame.size() - got);
+
+		GetEncoderPool().Submit(m_pCodec, m_Frame.data(), settings.FrameSize, settings.PacketSize, m_bEof);
+		++m_nInFlight;
+	}
+}
+
+void VoiceClipEncode::OnEncoded(const VoiceEncodeJob &job)
+{
+	--m_nInFlight;
+
+	if(job.result <= 0) {
+		return;
+	}
+
+	// Jobs of one codec complete in submission order
+	const uint16_t len{static_cast<uint16_t>(job.result)};
+	fwrite(&len, sizeof(len), 1, m_pOutput);
+	fwrite(job.compressed.data(), 1, len, m_pOutput);
+	++m_Header.framecount;
+}
+
+bool VoiceClipEncode::RunFrame(bool &bSuccess, char *error, size_t maxlen)
+{
+	Submit();
+
+	if(!m_bEof || m_nInFlight > 0) {
+		return true;
+	}
+
+	fseek(m_pOutput, 0, SEEK_SET);
+	fwrite(&m_Header, sizeof(m_Header), 1, m_pOutput);
+
+	const bool bWriteError{ferror(m_pOutput) != 0};
+	fclose(m_pOutput);
+	m_pOutput = nullptr;
+
+	if(bWriteError) {
+		smutils->Format(error, maxlen, "could not write \"%s\"", m_TempPath.c_str());
+		remove(m_TempPath.c_str());
+		bSuccess = false;
+		return false;
+	}
+
+	if(rename(m_TempPath.c_str(), m_OutputPath.c_str()) != 0) {
+		smutils->Format(error, maxlen, "could not rename \"%s\" to \"%s\"", m_TempPath.c_str(), m_OutputPath.c_str());
+		remove(m_TempPath.c_str());
+		bSuccess = false;
+		return false;
+	}
+
+	bSuccess = true;
+	return false;
+}
+
+int VoiceClipEncoder::Start(const char *source, const char *output, int nSampleRate, int nFrameSize, int nPacketSize, char *error, size_t maxlen)
+{
+	std::unique_ptr<VoiceClipEncode> encode{new VoiceClipEncode{}};
+	if(!encode->Open(source, output, nSampleRate, nFrameSize, nPacketSize, error, maxlen)) {
+		return 0;
+	}
+
+	const int id{m_nNextId++};
+	if(m_nNextId <= 0) {
+		m_nNextId = 1;
+	}
+
+	m_ByCodec[encode->Codec()] = encode.get();
+	m_Encodes[id] = std::move(encode);
+
+	return id;
+}
+
+void VoiceClipEncoder::Clear()
+{
+	m_ByCodec.clear();
+	m_Encodes.clear();
+}
+
+bool VoiceClipEncoder::OnEncoded(const VoiceEncodeJob &job)
+{
+	auto it{m_ByCodec.find(job.codec)};
+	if(it == m_ByCodec.end()) {
+		return false;
+	}
+
+	it->second->OnEncoded(job);
+	return true;
+}
+
+void VoiceClipEncoder::RunFrame(void (*finished)(int id, const char *output, bool bSuccess, const char *error))
+{
+	for(auto it{m_Encodes.begin()}; it != m_Encodes.end();) {
+		char error[256]{};
+		bool bSuccess{false};
+		if(it->second->RunFrame(bSuccess, error, sizeof(error))) {
+			++it;
+			continue;
+		}
+
+		// The callback may start another encode
+		const int id{it->first};
+		std::unique_ptr<VoiceClipEncode> encode{std::move(it->second)};
+		m_ByCodec.erase(encode->Codec());
+		it = m_Encodes.erase(it);
+
+		finished(id, encode->Output().c_str(), bSuccess, error);
+	}
+}
+
+VoiceClipPlayback::VoiceClipPlayback(std::shared_ptr<VoiceClip> clip)
+	: m_Clip{std::move(clip)}
+{
+	const voiceclipheader &header{m_Clip->Header()};
+	m_flFrameTime = (double)header.framesize / (double)header.samplerate;
+	m_nOffset = 0;
+	m_nFrame = 0;
+	m_flStart = -1.0;
+	m_nSent = 0;
+	m_Packet.reserve(VOICE_MAX_DATA_BYTES);
+}
+
+bool VoiceClipPlayback::RunFrame(double now)
+{
+	if(m_flStart < 0.0) {
+		m_flStart = now;
+	}
+
+	const voiceclipheader &header{m_Clip->Header()};
+	const unsigned char *pFrames{m_Clip->Frames()};
+
+	const int due{static_cast<int>((now - m_flStart) / m_flFrameTime) + 1 - m_nSent};
+	const int count{std::min<int>({due, static_cast<int>(header.framecount - m_nFrame), VOICE_MAX_DATA_BYTES / static_cast<int>(header.packetsize)})};
+
+	if(count <= 0) {
+		return m_nFrame < header.framecount;
+	}
+
+	// Map validated every length. A single frame goes out straight from the
+	// mapping, several are copied together into one message.
+	m_Packet.clear();
+	const char *pData{nullptr};
+	int nBytes{0};
+	for(int i{0}; i < count; ++i) {
+		uint16_t len;
+		memcpy(&len, pFrames + m_nOffset, sizeof(len));
+
+		const char *pFrame{reinterpret_cast<const char *>(pFrames + m_nOffset + sizeof(uint16_t))};
+		if(count == 1) {
+			pData = pFrame;
+			nBytes = len;
+		} else {
+			m_Packet.insert(m_Packet.end(), pFrame, pFrame + len);
+		}
+
+		m_nOffset += sizeof(uint16_t) + len;
+		++m_nFrame;
+	}
+
+	if(count > 1) {
+		pData = m_Packet.data();
+		nBytes = static_cast<int>(m_Packet.size());
+	}
+
+	SendVoiceDataToListeners(m_Listeners, pData, nBytes, m_nFrom, m_bProximity);
+	m_nSent += count;
+
+	return m_nFrame < header.framecount;
+}
+
+std::shared_ptr<VoiceClip> VoiceClipCache::Load(const char *path, char *error, size_t maxlen)
+{
+	auto it{m_Clips.find(path)};
+	if(it != m_Clips.end()) {
+		return it->second;
+	}
+
+	char fullpath[PLATFORM_MAX_PATH];
+	smutils->BuildPath(Path_Game, fullpath, sizeof(fullpath), "%s", path);
+
+	std::shared_ptr<VoiceClip> clip{new VoiceClip{}};
+	if(!clip->Map(fullpath, error, maxlen)) {
+		return nullptr;
+	}
+
+	// Clients decode with the server codec settings, anything else would be noise
+	const voiceclipheader &header{clip->Header()};
+	const VoiceCodec_Celt::CEncoderSettings &settings{VoiceCodec_Celt::TheEncoderSettings()};
+	if(static_cast<celt_int32>(header.samplerate) != settings.SampleRate_Hz ||
+		static_cast<celt_int32>(header.framesize) != settings.FrameSize ||
+		static_cast<celt_int32>(header.packetsize) != settings.PacketSize) {
+		smutils->Format(error, maxlen, "clip was encoded for %u/%u/%u but the voice codec uses %d/%d/%d",
+			header.samplerate, header.framesize, header.packetsize,
+			settings.SampleRate_Hz, settings.FrameSize, settings.PacketSize);
+		return nullptr;
+	}
+
+	m_Clips.emplace(path, clip);
+
+	return clip;
+}
+
+bool VoiceClipCache::Unload(const char *path)
+{
+	return m_Clips.erase(path) > 0;
+}
+
+void VoiceClipCache::Clear()
+{
+	m_Clips.clear();
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "voiceplayback.h"
+
+#define VOICECLIP_MAGIC "VSCL"
+#define VOICECLIP_VERSION 1
+
+// On-disk header of a pre-encoded clip. It is followed by framecount CELT
+// frames, each prefixed with its length as a little-endian uint16.
+struct voiceclipheader
+{
+	char magic[4];
+	uint16_t version;
+	uint16_t reserved;
+	uint32_t samplerate;
+	uint32_t framesize;
+	uint32_t packetsize;
+	uint32_t framecount;
+};
+
+// A read-only memory mapping of a clip file.
+class VoiceClip
+{
+public:
+	~VoiceClip();
+
+	bool Map(const char *fullpath, char *error, size_t maxlen);
+
+	const voiceclipheader &Header() const { return *reinterpret_cast<const voiceclipheader *>(m_pBase); }
+	const unsigned char *Frames() const { return m_pBase + sizeof(voiceclipheader); }
+	size_t FramesSize() const { return m_nSize - sizeof(voiceclipheader); }
+
+private:
+	unsigned char *m_pBase{nullptr};
+	size_t m_nSize{0};
+};
+
+// Encodes a WAV or raw 16-bit mono PCM file into a clip on the encoder pool,
+// appending frames to a temporary file as they come back and renaming it once
+// the last one is written. Zero settings use the server defaults.
+class VoiceClipEncode
+{
+public:
+	VoiceClipEncode();
+	~VoiceClipEncode();
+
+	bool Open(const char *source, const char *output, int nSampleRate, int nFrameSize, int nPacketSize, char *error, size_t maxlen);
+
+	void OnEncoded(const VoiceEncodeJob &job);
+
+	// Return false once done, bSuccess tells whether the clip was written.
+	bool RunFrame(bool &bSuccess, char *error, size_t maxlen);
+
+	IVoiceCodec *Codec() const { return m_pCodec; }
+	const std::string &Output() const { return m_Output; }
+
+private:
+	void Submit();
+
+	FILE *m_pSource;
+	FILE *m_pOutput;
+	long m_nRemainingBytes; // -1 for raw files, which are read until EOF
+	bool m_bEof;
+	VoiceCodec_Celt *m_pCodec;
+	int m_nInFlight;
+	voiceclipheader m_Header;
+	std::vector<char> m_Frame;
+	std::string m_Output;
+	std::string m_OutputPath;
+	std::string m_TempPath;
+};
+
+class VoiceClipEncoder
+{
+public:
+	// Return the encode id or 0 on failure.
+	int Start(const char *source, const char *output, int nSampleRate, int nFrameSize, int nPacketSize, char *error, size_t maxlen);
+	void Clear();
+
+	// Return true if the job belonged to an encode.
+	bool OnEncoded(const VoiceEncodeJob &job);
+
+	// Calls finished for every encode that ended this frame, error is empty on success.
+	void RunFrame(void (*finished)(int id, const char *output, bool bSuccess, const char *error));
+
+private:
+	std::unordered_map<int, std::unique_ptr<VoiceClipEncode>> m_Encodes;
+	std::unordered_map<IVoiceCodec *, VoiceClipEncode *> m_ByCodec;
+	int m_nNextId{1};
+};
+
+// Walks the frames of a mapped clip, sending every frame that is due in one message.
+class VoiceClipPlayback : public VoicePlayback
+{
+public:
+	VoiceClipPlayback(std::shared_ptr<VoiceClip> clip);
+
+	virtual bool RunFrame(double now) override;
+
+private:
+	std::shared_ptr<VoiceClip> m_Clip;
+	size_t m_nOffset;
+	unsigned int m_nFrame;
+	double m_flFrameTime;
+	double m_flStart;
+	int m_nSent;
+	std::vector<char> m_Packet;
+};
+
+class VoiceClipCache
+{
+public:
+	// Maps the clip at a game relative path, or returns the existing mapping.
+	std::shared_ptr<VoiceClip> Load(const char *path, char *error, size_t maxlen);
+	bool Unload(const char *path);
+	void Clear();
+
+private:
+	std::unordered_map<std::string, std::shared_ptr<VoiceClip>> m_Clips;
+};
+
+extern VoiceClipCache g_VoiceClips;
+extern VoiceClipEncoder g_VoiceClipEncoder;
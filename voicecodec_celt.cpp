@@ -1,9 +1,78 @@
 #include "voicecodec_celt.h"
+#include "voicepcm.h"
 #include "smsdk_ext.h"
 #include <tier1/convar.h>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
 
 static VoiceCodec_Celt::CEncoderSettings globalEncoderSettings;
 
+// Idle encoders and decoders kept per mode, the rest are destroyed
+#define CELT_POOL_MAX 16
+
+struct celtmodeentry
+{
+	CELTMode *mode{nullptr};
+	int refs{0};
+	bool warm{false}; // Built by WarmCache, kept until ShutdownCache
+	std::vector<CELTEncoder *> encoders;
+	std::vector<CELTDecoder *> decoders;
+};
+
+// Pointers to entries stay valid while their refs are held, entries that are
+// not warm are erased with the last codec that releases them
+static std::map<std::pair<celt_int32, celt_int32>, celtmodeentry> celt_modes;
+static std::mutex celt_modes_mutex;
+
+static celtmodeentry *acquire_celt_mode(celt_int32 SampleRate_Hz, celt_int32 FrameSize, int &theError)
+{
+	std::lock_guard<std::mutex> lock{celt_modes_mutex};
+
+	const auto key{std::make_pair(SampleRate_Hz, FrameSize)};
+	celtmodeentry &entry{celt_modes[key]};
+	if(!entry.mode) {
+		entry.mode = celt_mode_create(SampleRate_Hz, FrameSize, &theError);
+		if(!entry.mode) {
+			celt_modes.erase(key);
+			return nullptr;
+		}
+	}
+
+	++entry.refs;
+	return &entry;
+}
+
+static CELTEncoder *take_celt_encoder(celtmodeentry *entry, int &theError)
+{
+	{
+		std::lock_guard<std::mutex> lock{celt_modes_mutex};
+		if(!entry->encoders.empty()) {
+			CELTEncoder *pEncoder{entry->encoders.back()};
+			entry->encoders.pop_back();
+			return pEncoder;
+		}
+	}
+
+	return celt_encoder_create_custom(entry->mode, 1, &theError);
+}
+
+static CELTDecoder *take_celt_decoder(celtmodeentry *entry, int &theError)
+{
+	{
+		std::lock_guard<std::mutex> lock{celt_modes_mutex};
+		if(!entry->decoders.empty()) {
+			CELTDecoder *pDecoder{entry->decoders.back()};
+			entry->decoders.pop_back();
+			return pDecoder;
+		}
+	}
+
+	return celt_decoder_create_custom(entry->mode, 1, &theError);
+}
+
 extern ConVar *sv_voicecodec;
 
 void VoiceCodec_Celt::InitGlobalSettings()
@@ -40,6 +109,31 @@ void VoiceCodec_Celt::InitGlobalSettings()
 	globalEncoderSettings.FrameTime = (double)globalEncoderSettings.FrameSize / (double)globalEncoderSettings.SampleRate_Hz;
 }
 
+bool VoiceCodec_Celt::GetCodecSettings(const char *pCodec, int nSampleRate, CEncoderSettings &settings)
+{
+	settings = globalEncoderSettings;
+
+	if(strcmp(pCodec, "vaudio_celt") == 0) {
+		settings.SampleRate_Hz = 22050;
+		settings.FrameSize = 512;
+		settings.PacketSize = 64;
+	} else if(strcmp(pCodec, "vaudio_celt_high") == 0) {
+		settings.SampleRate_Hz = 44100;
+		settings.FrameSize = 256;
+		settings.PacketSize = 120;
+	} else {
+		return false;
+	}
+
+	if(nSampleRate != 0) {
+		settings.SampleRate_Hz = nSampleRate;
+	}
+
+	settings.FrameTime = (double)settings.FrameSize / (double)settings.SampleRate_Hz;
+
+	return true;
+}
+
 bool VoiceCodec_Celt::Init( int quality )
 {
 	celt_int32 SampleRate_Hz = 0;
@@ -51,22 +145,22 @@ bool VoiceCodec_Celt::Init( int quality )
 			SampleRate_Hz = 44100;
 			FrameSize = 256;
 			PacketSize = 120;
-		}
+		} break;
 		case 1: {
 			SampleRate_Hz = 22050;
 			FrameSize = 120;
 			PacketSize = 60;
-		}
+		} break;
 		case 2: {
 			SampleRate_Hz = 22050;
 			FrameSize = 256;
 			PacketSize = 60;
-		}
+		} break;
 		case 3: {
 			SampleRate_Hz = 22050;
 			FrameSize = 512;
 			PacketSize = 64;
-		}
+		} break;
 	}
 
 	return Init(SampleRate_Hz, FrameSize, PacketSize);
@@ -77,14 +171,96 @@ const VoiceCodec_Celt::CEncoderSettings &VoiceCodec_Celt::TheEncoderSettings()
 	return globalEncoderSettings;
 }
 
+void VoiceCodec_Celt::WarmCache()
+{
+	static const celt_int32 presets[][2]{
+		{44100, 256},
+		{22050, 120},
+		{22050, 256},
+		{22050, 512},
+	};
+
+	std::vector<celtmodeentry *> entries;
+	int theError;
+
+	for(const celt_int32 (&preset)[2] : presets) {
+		celtmodeentry *entry{acquire_celt_mode(preset[0], preset[1], theError)};
+		if(entry) {
+			entries.push_back(entry);
+		}
+	}
+
+	// The server preset also gets a few states ready for the first codecs
+	std::vector<CELTEncoder *> encoders;
+	std::vector<CELTDecoder *> decoders;
+
+	celtmodeentry *entry{acquire_celt_mode(globalEncoderSettings.SampleRate_Hz, globalEncoderSettings.FrameSize, theError)};
+	if(entry) {
+		entries.push_back(entry);
+
+		for(int i{0}; i < 4; ++i) {
+			CELTEncoder *pEncoder{celt_encoder_create_custom(entry->mode, 1, &theError)};
+			if(pEncoder) {
+				encoders.push_back(pEncoder);
+			}
+			CELTDecoder *pDecoder{celt_decoder_create_custom(entry->mode, 1, &theError)};
+			if(pDecoder) {
+				decoders.push_back(pDecoder);
+			}
+		}
+	}
+
+	std::lock_guard<std::mutex> lock{celt_modes_mutex};
+	if(entry) {
+		entry->encoders.insert(entry->encoders.end(), encoders.begin(), encoders.end());
+		entry->decoders.insert(entry->decoders.end(), decoders.begin(), decoders.end());
+	}
+	for(celtmodeentry *pEntry : entries) {
+		pEntry->warm = true;
+		--pEntry->refs;
+	}
+}
+
+void VoiceCodec_Celt::ShutdownCache()
+{
+	std::lock_guard<std::mutex> lock{celt_modes_mutex};
+
+	for(auto it{celt_modes.begin()}; it != celt_modes.end();) {
+		celtmodeentry &entry{it->second};
+
+		for(CELTEncoder *pEncoder : entry.encoders)
+			celt_encoder_destroy(pEncoder);
+		entry.encoders.clear();
+
+		for(CELTDecoder *pDecoder : entry.decoders)
+			celt_decoder_destroy(pDecoder);
+		entry.decoders.clear();
+
+		// A codec that outlived the extension still points at its mode
+		if(entry.refs > 0) {
+			++it;
+			continue;
+		}
+
+		if(entry.mode)
+			celt_mode_destroy(entry.mode);
+		it = celt_modes.erase(it);
+	}
+}
+
 VoiceCodec_Celt::VoiceCodec_Celt()
 {
+	m_pModeEntry = NULL;
 	m_pMode = NULL;
 	m_pCodec = NULL;
+	m_pDecoder = NULL;
 }
 
 bool VoiceCodec_Celt::Init(celt_int32 SampleRate_Hz, celt_int32 FrameSize, celt_int32 PacketSize)
 {
+	ReleaseState();
+	m_Pending.clear();
+
 	m_EncoderSettings = globalEncoderSettings;
 
 	if(SampleRate_Hz != 0) {
@@ -99,15 +275,19 @@ bool VoiceCodec_Celt::Init(celt_int32 SampleRate_Hz, celt_int32 FrameSize, celt_
 
 	m_EncoderSettings.FrameTime = (double)m_EncoderSettings.FrameSize / (double)m_EncoderSettings.SampleRate_Hz;
 
+	m_Float.resize(m_EncoderSettings.FrameSize);
+
 	int theError;
-	m_pMode = celt_mode_create(m_EncoderSettings.SampleRate_Hz, m_EncoderSettings.FrameSize, &theError);
-	if(!m_pMode)
+	m_pModeEntry = acquire_celt_mode(m_EncoderSettings.SampleRate_Hz, m_EncoderSettings.FrameSize, theError);
+	if(!m_pModeEntry)
 	{
 		smutils->LogError(myself, "celt_mode_create error: %d", theError);
 		return false;
 	}
 
-	m_pCodec = celt_encoder_create_custom(m_pMode, 1, &theError);
+	m_pMode = m_pModeEntry->mode;
+
+	m_pCodec = take_celt_encoder(m_pModeEntry, theError);
 	if(!m_pCodec)
 	{
 		smutils->LogError(myself, "celt_encoder_create_custom error: %d", theError);
@@ -118,16 +298,96 @@ bool VoiceCodec_Celt::Init(celt_int32 SampleRate_Hz, celt_int32 FrameSize, celt_
 	celt_encoder_ctl(m_pCodec, CELT_SET_BITRATE(m_EncoderSettings.TargetBitRate_Kbps * 1000));
 	celt_encoder_ctl(m_pCodec, CELT_SET_COMPLEXITY(m_EncoderSettings.Complexity));
 
+	m_pDecoder = take_celt_decoder(m_pModeEntry, theError);
+	if(!m_pDecoder)
+	{
+		smutils->LogError(myself, "celt_decoder_create_custom error: %d", theError);
+		return false;
+	}
+
+	celt_decoder_ctl(m_pDecoder, CELT_RESET_STATE_REQUEST, NULL);
+
 	return true;
 }
 
 VoiceCodec_Celt::~VoiceCodec_Celt()
 {
+	ReleaseState();
+}
+
+void VoiceCodec_Celt::ReleaseState()
+{
+	if(!m_pModeEntry)
+		return;
+
+	// Reset outside the lock, the pool only hands out clean states
+	if(m_pCodec)
+		celt_encoder_ctl(m_pCodec, CELT_RESET_STATE_REQUEST, NULL);
+
+	if(m_pDecoder)
+		celt_decoder_ctl(m_pDecoder, CELT_RESET_STATE_REQUEST, NULL);
+
+	// A mode nothing holds anymore is freed unless WarmCache built it
+	CELTMode *pMode{NULL};
+	std::vector<CELTEncoder *> encoders;
+	std::vector<CELTDecoder *> decoders;
+
+	{
+		std::lock_guard<std::mutex> lock{celt_modes_mutex};
+
+		if(--m_pModeEntry->refs == 0 && !m_pModeEntry->warm) {
+			pMode = m_pModeEntry->mode;
+			encoders.swap(m_pModeEntry->encoders);
+			decoders.swap(m_pModeEntry->decoders);
+			celt_modes.erase(std::make_pair(m_EncoderSettings.SampleRate_Hz, m_EncoderSettings.FrameSize));
+		} else {
+			if(m_pCodec && m_pModeEntry->encoders.size() < CELT_POOL_MAX) {
+				m_pModeEntry->encoders.push_back(m_pCodec);
+				m_pCodec = NULL;
+			}
+
+			if(m_pDecoder && m_pModeEntry->decoders.size() < CELT_POOL_MAX) {
+				m_pModeEntry->decoders.push_back(m_pDecoder);
+				m_pDecoder = NULL;
+			}
+		}
+	}
+
 	if(m_pCodec)
 		celt_encoder_destroy(m_pCodec);
 
-	if(m_pMode)
-		celt_mode_destroy(m_pMode);
+	if(m_pDecoder)
+		celt_decoder_destroy(m_pDecoder);
+
+	for(CELTEncoder *pEncoder : encoders)
+		celt_encoder_destroy(pEncoder);
+
+	for(CELTDecoder *pDecoder : decoders)
+		celt_decoder_destroy(pDecoder);
+
+	if(pMode)
+		celt_mode_destroy(pMode);
+
+	m_pModeEntry = NULL;
+	m_pMode = NULL;
+	m_pCodec = NULL;
+	m_pDecoder = NULL;
+}
+
+void VoiceCodec_Celt::SetComplexity(celt_int32 Complexity)
+{
+	m_EncoderSettings.Complexity = Complexity;
+
+	if(m_pCodec)
+		celt_encoder_ctl(m_pCodec, CELT_SET_COMPLEXITY(Complexity));
+}
+
+void VoiceCodec_Celt::SetBitRate(celt_int32 TargetBitRate_Kbps)
+{
+	m_EncoderSettings.TargetBitRate_Kbps = TargetBitRate_Kbps;
+
+	if(m_pCodec)
+		celt_encoder_ctl(m_pCodec, CELT_SET_BITRATE(TargetBitRate_Kbps * 1000));
 }
 
 void VoiceCodec_Celt::Release()
@@ -137,21 +397,143 @@ void VoiceCodec_Celt::Release()
 
 bool VoiceCodec_Celt::ResetState()
 {
-	celt_encoder_ctl(m_pCodec, CELT_RESET_STATE_REQUEST, NULL);
+	m_Pending.clear();
+
+	if(m_pCodec)
+		celt_encoder_ctl(m_pCodec, CELT_RESET_STATE_REQUEST, NULL);
+
+	if(m_pDecoder)
+		celt_decoder_ctl(m_pDecoder, CELT_RESET_STATE_REQUEST, NULL);
+
 	return true;
 }
 
 int	VoiceCodec_Celt::Compress(celt_int16 *pUncompressed, int nSamples, unsigned char *pCompressed, int maxCompressedBytes)
 {
-	return celt_encode(m_pCodec, pUncompressed, nSamples, pCompressed, maxCompressedBytes);
+	if(!m_pCodec)
+		return -1;
+
+	if(static_cast<int>(m_Float.size()) < nSamples)
+		m_Float.resize(nSamples);
+
+	PCM_ToFloat(pUncompressed, m_Float.data(), nSamples);
+	return celt_encode_float(m_pCodec, m_Float.data(), nSamples, pCompressed, maxCompressedBytes);
+}
+
+int VoiceCodec_Celt::EncodeFrame(const celt_int16 *pFrame, char *pCompressed, int maxCompressedBytes)
+{
+	PCM_ToFloat(pFrame, m_Float.data(), m_EncoderSettings.FrameSize);
+	return celt_encode_float(m_pCodec, m_Float.data(), m_EncoderSettings.FrameSize, (unsigned char *)pCompressed, std::min(m_EncoderSettings.PacketSize, maxCompressedBytes));
 }
 
 int	VoiceCodec_Celt::Compress(const char *pUncompressed, int nSamples, char *pCompressed, int maxCompressedBytes, bool bFinal)
 {
-	return celt_encode(m_pCodec, (celt_int16 *)pUncompressed, nSamples, (unsigned char *)pCompressed, maxCompressedBytes);
+	if(!m_pCodec)
+		return -1;
+
+	const int nFrameSize{m_EncoderSettings.FrameSize};
+	const int nPacketSize{m_EncoderSettings.PacketSize};
+
+	const celt_int16 *pInput{(const celt_int16 *)pUncompressed};
+	int nInput{std::max(nSamples, 0)};
+
+	int nBytes{0};
+
+	// A smaller buffer than PacketSize still gets a single frame, as celt_encode always did
+	auto room = [&]() { return (nBytes + nPacketSize) <= maxCompressedBytes || (nBytes == 0 && maxCompressedBytes > 0); };
+
+	// Complete the frame left over from the last call, whole frames of the input are then encoded in place
+	if(!m_Pending.empty()) {
+		const int nTake{std::min(nInput, std::max(nFrameSize - static_cast<int>(m_Pending.size()), 0))};
+		m_Pending.insert(m_Pending.end(), pInput, pInput + nTake);
+		pInput += nTake;
+		nInput -= nTake;
+
+		int nOffset{0};
+		while((static_cast<int>(m_Pending.size()) - nOffset) >= nFrameSize && room()) {
+			const int ret{EncodeFrame(m_Pending.data() + nOffset, pCompressed + nBytes, maxCompressedBytes - nBytes)};
+			if(ret < 0)
+				return ret;
+
+			nBytes += ret;
+			nOffset += nFrameSize;
+		}
+
+		m_Pending.erase(m_Pending.begin(), m_Pending.begin() + nOffset);
+	}
+
+	if(m_Pending.empty()) {
+		while(nInput >= nFrameSize && room()) {
+			const int ret{EncodeFrame(pInput, pCompressed + nBytes, maxCompressedBytes - nBytes)};
+			if(ret < 0)
+				return ret;
+
+			nBytes += ret;
+			pInput += nFrameSize;
+			nInput -= nFrameSize;
+		}
+	}
+
+	m_Pending.insert(m_Pending.end(), pInput, pInput + nInput);
+
+	// The user stopped talking, pad the last partial frame with silence
+	if(bFinal && !m_Pending.empty() && static_cast<int>(m_Pending.size()) < nFrameSize && room()) {
+		m_Pending.resize(nFrameSize, 0);
+
+		const int ret{EncodeFrame(m_Pending.data(), pCompressed + nBytes, maxCompressedBytes - nBytes)};
+		m_Pending.clear();
+		if(ret < 0)
+			return ret;
+
+		nBytes += ret;
+	}
+
+	return nBytes;
+}
+
+int	VoiceCodec_Celt::Decompress(const unsigned char *pCompressed, int compressedBytes, celt_int16 *pUncompressed, int maxSamples)
+{
+	if(!m_pDecoder)
+		return -1;
+
+	const int nPacketSize{m_EncoderSettings.PacketSize};
+	const int nFrameSize{m_EncoderSettings.FrameSize};
+
+	int nSamples{0};
+
+	for(int nOffset{0}; nOffset + nPacketSize <= compressedBytes; nOffset += nPacketSize) {
+		if(nSamples + nFrameSize > maxSamples)
+			break;
+
+		const int ret{celt_decode_float(m_pDecoder, pCompressed + nOffset, nPacketSize, m_Float.data(), nFrameSize)};
+		if(ret < 0)
+			return ret;
+
+		PCM_FromFloat(m_Float.data(), pUncompressed + nSamples, nFrameSize);
+		nSamples += nFrameSize;
+	}
+
+	return nSamples;
+}
+
+int	VoiceCodec_Celt::Conceal(celt_int16 *pUncompressed, int maxSamples)
+{
+	if(!m_pDecoder)
+		return -1;
+
+	const int nFrameSize{m_EncoderSettings.FrameSize};
+	if(nFrameSize > maxSamples)
+		return 0;
+
+	const int ret{celt_decode_float(m_pDecoder, NULL, 0, m_Float.data(), nFrameSize)};
+	if(ret < 0)
+		return ret;
+
+	PCM_FromFloat(m_Float.data(), pUncompressed, nFrameSize);
+	return nFrameSize;
 }
 
 int	VoiceCodec_Celt::Decompress(const char *pCompressed, int compressedBytes, char *pUncompressed, int maxUncompressedBytes)
 {
-	return -1;
+	return Decompress((const unsigned char *)pCompressed, compressedBytes, (celt_int16 *)pUncompressed, maxUncompressedBytes / BYTES_PER_SAMPLE);
 }
@@ -2,6 +2,9 @@
 
 #include "ivoicecodec.h"
 #include "celt_header.h"
+#include <vector>
+
+struct celtmodeentry;
 
 class VoiceCodec_Celt : public IVoiceCodec
 {
@@ -17,6 +20,9 @@ public:
 
 
 	// Compress the voice data.
+	// Any number of samples can be passed, whole frames are encoded into at most
+	// PacketSize bytes each for as long as maxCompressedBytes has room and the
+	// rest is kept for the next call.
 	// pUncompressed		-	16-bit signed mono voice data.
 	// maxCompressedBytes	-	The length of the pCompressed buffer. Don't exceed this.
 	// bFinal        		-	Set to true on the last call to Compress (the user stopped talking).
@@ -43,12 +49,48 @@ public:
 
 	static void InitGlobalSettings();
 
+	// Fills in the settings the engine uses for a vaudio_celt codec name.
+	// Return false if pCodec is not a CELT codec.
+	static bool GetCodecSettings(const char *pCodec, int nSampleRate, CEncoderSettings &settings);
+
 	static const CEncoderSettings &TheEncoderSettings();
 
+	// CELT modes are shared by every codec with the same sample rate and
+	// frame size, and released encoders and decoders are kept reset for
+	// the next Init. WarmCache builds the common presets ahead of time and
+	// they stay until ShutdownCache, other modes are freed with the last
+	// codec using them.
+	static void WarmCache();
+	static void ShutdownCache();
+
 	int	Compress(celt_int16 *pUncompressed, int nSamples, unsigned char *pCompressed, int maxCompressedBytes);
 
+	// Decodes a run of PacketSize sized CELT frames into FrameSize samples each.
+	// Return the number of samples written to pUncompressed.
+	int	Decompress(const unsigned char *pCompressed, int compressedBytes, celt_int16 *pUncompressed, int maxSamples);
+
+	// Decodes one FrameSize frame of packet loss concealment.
+	// Return the number of samples written to pUncompressed.
+	int	Conceal(celt_int16 *pUncompressed, int maxSamples);
+
+	const CEncoderSettings &EncoderSettings() const { return m_EncoderSettings; }
+
+	// Override the global encoder settings after Init.
+	void SetComplexity(celt_int32 Complexity);
+	void SetBitRate(celt_int32 TargetBitRate_Kbps);
+
 private:
+	void ReleaseState();
+	int EncodeFrame(const celt_int16 *pFrame, char *pCompressed, int maxCompressedBytes);
+
+	celtmodeentry *m_pModeEntry;
 	CELTMode *m_pMode;
 	CELTEncoder *m_pCodec;
+	CELTDecoder *m_pDecoder;
 	CEncoderSettings m_EncoderSettings;
+	// Samples that did not make a whole frame yet
+	std::vector<celt_int16> m_Pending;
+	// Frame converted by the PCM kernels, libcelt is built for float and
+	// would otherwise convert in its own scalar loop
+	std::vector<float> m_Float;
 };
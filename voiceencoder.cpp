@@ -0,0 +1,137 @@
+#include "voiceencoder.h"
+#include "voicestats.h"
+#include <algorithm>
+#include <cstdint>
+
+VoiceEncoderPool g_EncoderPool;
+
+VoiceEncoderPool::~VoiceEncoderPool()
+{
+	Stop();
+}
+
+void VoiceEncoderPool::Start(int nThreads)
+{
+	if(IsRunning())
+		return;
+
+	m_bStopping = false;
+
+	for(int i{0}; i < nThreads; ++i) {
+		m_Workers.emplace_back(new Worker{});
+	}
+
+	for(auto &worker : m_Workers) {
+		worker->thread = std::thread{&VoiceEncoderPool::WorkerMain, this, worker.get()};
+	}
+}
+
+void VoiceEncoderPool::Stop()
+{
+	if(!IsRunning())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock{m_Mutex};
+		m_bStopping = true;
+	}
+
+	for(auto &worker : m_Workers) {
+		worker->cv.notify_one();
+	}
+
+	for(auto &worker : m_Workers) {
+		worker->thread.join();
+	}
+
+	m_Workers.clear();
+	m_Completed.clear();
+}
+
+VoiceEncoderPool::Worker *VoiceEncoderPool::WorkerFor(IVoiceCodec *codec)
+{
+	const uintptr_t key{reinterpret_cast<uintptr_t>(codec) >> 4};
+	return m_Workers[key % m_Workers.size()].get();
+}
+
+unsigned int VoiceEncoderPool::Submit(IVoiceCodec *codec, const char *pUncompressed, int nSamples, int maxCompressedBytes, bool bFinal)
+{
+	std::unique_ptr<VoiceEncodeJob> job{new VoiceEncodeJob{}};
+	job->codec = codec;
+	job->uncompressed.assign(pUncompressed, pUncompressed + (nSamples * BYTES_PER_SAMPLE));
+	job->nSamples = nSamples;
+	job->compressed.resize(maxCompressedBytes);
+	job->bFinal = bFinal;
+	job->result = -1;
+
+	Worker *worker{WorkerFor(codec)};
+
+	unsigned int ticket;
+	{
+		std::lock_guard<std::mutex> lock{m_Mutex};
+		ticket = m_nNextTicket++;
+		if(m_nNextTicket == 0) {
+			m_nNextTicket = 1;
+		}
+		job->ticket = ticket;
+		worker->queue.emplace_back(std::move(job));
+	}
+
+	worker->cv.notify_one();
+
+	return ticket;
+}
+
+void VoiceEncoderPool::Cancel(IVoiceCodec *codec)
+{
+	if(!IsRunning())
+		return;
+
+	Worker *worker{WorkerFor(codec)};
+
+	std::unique_lock<std::mutex> lock{m_Mutex};
+
+	auto is_codec{[codec](const std::unique_ptr<VoiceEncodeJob> &job) { return job->codec == codec; }};
+	worker->queue.erase(std::remove_if(worker->queue.begin(), worker->queue.end(), is_codec), worker->queue.end());
+
+	m_IdleCv.wait(lock, [worker,codec]() { return worker->current != codec; });
+
+	m_Completed.erase(std::remove_if(m_Completed.begin(), m_Completed.end(), is_codec), m_Completed.end());
+}
+
+std::unique_ptr<VoiceEncodeJob> VoiceEncoderPool::PopCompleted()
+{
+	std::lock_guard<std::mutex> lock{m_Mutex};
+	if(m_Completed.empty()) {
+		return nullptr;
+	}
+
+	std::unique_ptr<VoiceEncodeJob> job{std::move(m_Completed.front())};
+	m_Completed.pop_front();
+	return job;
+}
+
+void VoiceEncoderPool::WorkerMain(Worker *worker)
+{
+	std::unique_lock<std::mutex> lock{m_Mutex};
+
+	for(;;) {
+		worker->cv.wait(lock, [this,worker]() { return m_bStopping || !worker->queue.empty(); });
+		if(m_bStopping) {
+			break;
+		}
+
+		std::unique_ptr<VoiceEncodeJob> job{std::move(worker->queue.front())};
+		worker->queue.pop_front();
+		worker->current = job->codec;
+
+		lock.unlock();
+		job->result = job->codec->Compress(job->uncompressed.data(), job->nSamples, job->compressed.data(), static_cast<int>(job->compressed.size()), job->bFinal);
+		g_VoiceStats.Add(VoiceStat_FramesEncoded);
+		lock.lock();
+
+		worker->current = nullptr;
+		m_Completed.emplace_back(std::move(job));
+		m_IdleCv.notify_all();
+	}
+}
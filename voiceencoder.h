@@ -0,0 +1,64 @@
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include "ivoicecodec.h"
+
+// A frame queued for compression on a worker thread.
+struct VoiceEncodeJob
+{
+	unsigned int ticket;
+	IVoiceCodec *codec;
+	std::vector<char> uncompressed;
+	int nSamples;
+	std::vector<char> compressed;
+	bool bFinal;
+	int result;
+};
+
+// Fixed pool of encoder threads. Each codec is pinned to a single worker so
+// its frames are always compressed in submission order.
+class VoiceEncoderPool
+{
+public:
+	~VoiceEncoderPool();
+
+	void Start(int nThreads);
+	void Stop();
+	bool IsRunning() const { return !m_Workers.empty(); }
+
+	// Game thread only. Copies the input and returns a ticket for the job.
+	unsigned int Submit(IVoiceCodec *codec, const char *pUncompressed, int nSamples, int maxCompressedBytes, bool bFinal);
+
+	// Game thread only. Drops queued and completed jobs of codec and waits
+	// for one that is currently being compressed.
+	void Cancel(IVoiceCodec *codec);
+
+	// Game thread only. Pops the next finished job.
+	std::unique_ptr<VoiceEncodeJob> PopCompleted();
+
+private:
+	struct Worker
+	{
+		std::thread thread;
+		std::condition_variable cv;
+		std::deque<std::unique_ptr<VoiceEncodeJob>> queue;
+		IVoiceCodec *current{nullptr};
+	};
+
+	void WorkerMain(Worker *worker);
+	Worker *WorkerFor(IVoiceCodec *codec);
+
+	std::mutex m_Mutex;
+	std::condition_variable m_IdleCv;
+	std::vector<std::unique_ptr<Worker>> m_Workers;
+	std::deque<std::unique_ptr<VoiceEncodeJob>> m_Completed;
+	unsigned int m_nNextTicket{1};
+	bool m_bStopping{false};
+};
+
+extern VoiceEncoderPool g_EncoderPool;
@@ -0,0 +1,3 @@
+#include "voicehearing.h"
+
+VoiceHearingMatrix g_VoiceHearing;
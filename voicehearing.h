@@ -0,0 +1,78 @@
+#pragma once
+
+#include "extension.h"
+#include <algorithm>
+
+struct voicehearingrow
+{
+	listenermask hearing; // Active clients that hear the sender
+	listenermask proximity; // Active clients that hear the sender as proximity voice
+};
+
+// Who is active and who hears whom, snapshotted at most once per server
+// tick. The slot and active masks are taken on the first packet of a tick,
+// a sender's row on its first packet, so the broadcast fan-out scans bits
+// instead of asking every IClient about every packet. Hearing changes made
+// by the game during a tick apply from the next one.
+class VoiceHearingMatrix
+{
+public:
+	// Return the row of sender (a client index) for tick, building what is missing.
+	// TServer is IServer in the extension and the mock server in the bench.
+	template<class TServer>
+	const voicehearingrow &Row(TServer *server, int tick, int sender);
+
+	// Client indexes below GetClientCount, and the active ones, as of the last Row.
+	const listenermask &Slots() const { return m_Slots; }
+	const listenermask &Active() const { return m_Active; }
+
+	// Drops the snapshot, the next Row rebuilds it.
+	void Invalidate() { m_nTick = -1; }
+
+private:
+	int m_nTick{-1};
+	listenermask m_Slots{};
+	listenermask m_Active{};
+	listenermask m_Built{};
+	voicehearingrow m_Rows[ABSOLUTE_PLAYER_LIMIT + 1]{};
+};
+
+template<class TServer>
+const voicehearingrow &VoiceHearingMatrix::Row(TServer *server, int tick, int sender)
+{
+	if(tick != m_nTick) {
+		m_nTick = tick;
+		m_Slots = listenermask{};
+		m_Active = listenermask{};
+		m_Built = listenermask{};
+
+		const int nClients{std::min(server->GetClientCount(), ABSOLUTE_PLAYER_LIMIT)};
+		for(int i{0}; i < nClients; ++i) {
+			m_Slots.set(i+1, true);
+			if(server->GetClient(i)->IsActive()) {
+				m_Active.set(i+1, true);
+			}
+		}
+	}
+
+	voicehearingrow &row{m_Rows[sender]};
+	if(!m_Built.get(sender)) {
+		m_Built.set(sender, true);
+		row = voicehearingrow{};
+
+		listenermask active{m_Active};
+		for(int client{active.pop()}; client != -1; client = active.pop()) {
+			auto *pClient{server->GetClient(client-1)};
+			if(pClient->IsHearingClient(sender-1)) {
+				row.hearing.set(client, true);
+			}
+			if(pClient->IsProximityHearingClient(sender-1)) {
+				row.proximity.set(client, true);
+			}
+		}
+	}
+
+	return row;
+}
+
+extern VoiceHearingMatrix g_VoiceHearing;
@@ -0,0 +1,251 @@
+#include "voicemixer.h"
+#include "voicepcm.h"
+#include <algorithm>
+#include <cstring>
+
+// Most PCM a sender may queue before the oldest samples are dropped
+#define MIXER_MAX_QUEUED_FRAMES 8
+// Seconds a group encoder is kept after its speaker set was last heard
+#define MIXER_GROUP_TIMEOUT 2.0
+// Seconds the mix waits on a sender that is short of a frame before its tail is flushed
+#define MIXER_JITTER_TIME 0.1
+// Encoders of expired groups kept for the next ones
+#define MIXER_SPARE_CODECS 8
+// Highest m_nFromClient, it is sent as a byte
+#define MIXER_MAX_SLOT 254
+
+VoiceMixer g_VoiceMixer;
+
+bool VoiceMixer::speakerset::operator==(const speakerset &other) const
+{
+	return memcmp(mask.cells, other.mask.cells, sizeof(mask.cells)) == 0;
+}
+
+size_t VoiceMixer::speakersethash::operator()(const speakerset &set) const
+{
+	size_t hash{0};
+	for(cell_t cell : set.mask.cells) {
+		hash = (hash * 31) ^ static_cast<size_t>(static_cast<uint32_t>(cell));
+	}
+	return hash;
+}
+
+VoiceMixer::~VoiceMixer()
+{
+	Clear();
+}
+
+bool VoiceMixer::CreateGroup(group &g, int nMaxClients)
+{
+	for(int slot{nMaxClients}; slot <= MIXER_MAX_SLOT; ++slot) {
+		if(!m_Slots.get(slot)) {
+			g.from = slot;
+			break;
+		}
+	}
+
+	if(g.from == -1) {
+		return false;
+	}
+
+	// Encoders of expired groups are reused, new ones take a state from the CELT mode cache
+	if(!m_Spare.empty()) {
+		g.codec = m_Spare.back();
+		m_Spare.pop_back();
+	} else {
+		g.codec = new VoiceCodec_Celt{};
+		if(!g.codec->Init(0, 0, 0)) {
+			g.codec->Release();
+			g.codec = nullptr;
+			g.from = -1;
+			return false;
+		}
+	}
+
+	m_Slots.set(g.from, true);
+	return true;
+}
+
+void VoiceMixer::ReleaseGroup(group &g)
+{
+	if(g.from != -1) {
+		m_Slots.set(g.from, false);
+		g.from = -1;
+	}
+
+	if(!g.codec) {
+		return;
+	}
+
+	if(m_Spare.size() < MIXER_SPARE_CODECS) {
+		g.codec->ResetState();
+		m_Spare.emplace_back(g.codec);
+	} else {
+		g.codec->Release();
+	}
+	g.codec = nullptr;
+}
+
+void VoiceMixer::Clear()
+{
+	for(auto &it : m_Groups) {
+		ReleaseGroup(it.second);
+	}
+	m_Groups.clear();
+
+	for(VoiceCodec_Celt *codec : m_Spare) {
+		codec->Release();
+	}
+	m_Spare.clear();
+
+	for(sender &s : m_Senders) {
+		s.fifo.clear();
+	}
+	m_Active = listenermask{};
+}
+
+void VoiceMixer::ResetSender(int nSender)
+{
+	sender &s{m_Senders[nSender]};
+	s.fifo.clear();
+	s.hearing = listenermask{};
+	s.lastvoice = 0.0;
+	m_Active.set(nSender, false);
+}
+
+void VoiceMixer::AddVoice(int nSender, const celt_int16 *pcm, int nSamples, const listenermask &hearing, double now)
+{
+	const int nFrameSize{VoiceCodec_Celt::TheEncoderSettings().FrameSize};
+
+	sender &s{m_Senders[nSender]};
+	s.fifo.insert(s.fifo.end(), pcm, pcm + nSamples);
+
+	const size_t nMaxSamples{static_cast<size_t>(nFrameSize) * MIXER_MAX_QUEUED_FRAMES};
+	if(s.fifo.size() > nMaxSamples) {
+		s.fifo.erase(s.fifo.begin(), s.fifo.end() - nMaxSamples);
+	}
+
+	s.hearing = hearing;
+	s.lastvoice = now;
+	m_Active.set(nSender, true);
+}
+
+void VoiceMixer::RunFrame(double now)
+{
+	const VoiceCodec_Celt::CEncoderSettings &settings{VoiceCodec_Celt::TheEncoderSettings()};
+	const int nFrameSize{settings.FrameSize};
+	const int nMaxClients{playerhelpers->GetMaxClients()};
+
+	// Only frames every talking sender has are mixed, padding a sender that is
+	// merely late with silence would put gaps in its voice. Senders that have
+	// been quiet for MIXER_JITTER_TIME stopped talking and only hold their tail.
+	int nFrames{-1};
+	int nTail{0};
+	for(int i{1}; i <= ABSOLUTE_PLAYER_LIMIT; ++i) {
+		if(!m_Active.get(i)) {
+			continue;
+		}
+
+		const sender &s{m_Senders[i]};
+		const int nQueued{static_cast<int>(s.fifo.size())};
+		if((now - s.lastvoice) <= MIXER_JITTER_TIME) {
+			nFrames = (nFrames == -1) ? (nQueued / nFrameSize) : std::min(nFrames, nQueued / nFrameSize);
+		} else {
+			nTail = std::max(nTail, (nQueued + nFrameSize - 1) / nFrameSize);
+		}
+	}
+	if(nFrames == -1) {
+		nFrames = nTail;
+	}
+	nFrames = std::min(nFrames, VOICE_MAX_DATA_BYTES / settings.PacketSize);
+
+	if(nFrames > 0) {
+		for(auto &it : m_Groups) {
+			it.second.listeners = listenermask{};
+		}
+
+		// Group listeners by the exact set of speakers they hear
+		for(int listener{1}; listener <= nMaxClients; ++listener) {
+			speakerset set{};
+			bool bAny{false};
+			for(int i{1}; i <= ABSOLUTE_PLAYER_LIMIT; ++i) {
+				if(m_Active.get(i) && m_Senders[i].hearing.get(listener)) {
+					set.mask.set(i, true);
+					bAny = true;
+				}
+			}
+
+			if(!bAny) {
+				continue;
+			}
+
+			group &g{m_Groups[set]};
+			if(!g.codec && !CreateGroup(g, nMaxClients)) {
+				m_Groups.erase(set);
+				continue;
+			}
+			g.listeners.set(listener, true);
+			g.lastused = now;
+		}
+
+		const int nSamples{nFrames * nFrameSize};
+		m_Mix.resize(nSamples);
+		m_Frames.resize(nSamples);
+		m_Packet.resize(nFrames * settings.PacketSize);
+
+		for(auto &it : m_Groups) {
+			const speakerset &set{it.first};
+			group &g{it.second};
+			if(g.lastused != now) {
+				continue;
+			}
+
+			// Clipping once after summing keeps the mix independent of speaker order
+			std::fill(m_Mix.begin(), m_Mix.end(), 0);
+
+			for(int i{1}; i <= ABSOLUTE_PLAYER_LIMIT; ++i) {
+				if(!set.mask.get(i)) {
+					continue;
+				}
+
+				const std::vector<celt_int16> &fifo{m_Senders[i].fifo};
+				PCM_Accumulate(m_Mix.data(), fifo.data(), std::min(nSamples, static_cast<int>(fifo.size())));
+			}
+
+			PCM_Saturate(m_Mix.data(), m_Frames.data(), nSamples);
+
+			int nBytes{0};
+			for(int f{0}; f < nFrames; ++f) {
+				const int ret{g.codec->Compress(m_Frames.data() + (f * nFrameSize), nFrameSize, reinterpret_cast<unsigned char *>(m_Packet.data()) + nBytes, settings.PacketSize)};
+				if(ret > 0) {
+					nBytes += ret;
+				}
+			}
+
+			if(nBytes > 0) {
+				SendVoiceDataToListeners(g.listeners, m_Packet.data(), nBytes, g.from, false, VoicePriority_Voice);
+			}
+		}
+
+		for(int i{1}; i <= ABSOLUTE_PLAYER_LIMIT; ++i) {
+			if(!m_Active.get(i)) {
+				continue;
+			}
+
+			std::vector<celt_int16> &fifo{m_Senders[i].fifo};
+			fifo.erase(fifo.begin(), fifo.begin() + std::min(static_cast<size_t>(nFrames * nFrameSize), fifo.size()));
+			if(fifo.empty()) {
+				m_Active.set(i, false);
+			}
+		}
+	}
+
+	for(auto it{m_Groups.begin()}; it != m_Groups.end();) {
+		if((now - it->second.lastused) > MIXER_GROUP_TIMEOUT) {
+			ReleaseGroup(it->second);
+			it = m_Groups.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
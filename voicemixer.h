@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+#include "extension.h"
+
+// Mixes decoded vaudio_celt senders per group of listeners that hear the same
+// set of speakers and re-encodes each group once per frame, so every listener
+// gets at most one voice message per frame however many people talk.
+// Groups send from a slot past maxclients that no player owns, so a mix is
+// never attributed to one of its speakers and every group keeps its own
+// decoder on the clients.
+class VoiceMixer
+{
+public:
+	~VoiceMixer();
+
+	// Queues decoded PCM of a sender for the listeners that hear it.
+	void AddVoice(int sender, const celt_int16 *pcm, int nSamples, const listenermask &hearing, double now);
+
+	// Mixes, encodes and sends everything queued since the last call.
+	void RunFrame(double now);
+
+	// Drops what a sender has queued, its slot may be reused by another player.
+	void ResetSender(int sender);
+
+	void Clear();
+
+private:
+	struct speakerset
+	{
+		listenermask mask;
+
+		bool operator==(const speakerset &other) const;
+	};
+
+	struct speakersethash
+	{
+		size_t operator()(const speakerset &set) const;
+	};
+
+	struct group
+	{
+		VoiceCodec_Celt *codec{nullptr};
+		int from{-1};
+		listenermask listeners;
+		double lastused{0.0};
+	};
+
+	struct sender
+	{
+		std::vector<celt_int16> fifo;
+		listenermask hearing;
+		double lastvoice{0.0};
+	};
+
+	bool CreateGroup(group &g, int nMaxClients);
+	void ReleaseGroup(group &g);
+
+	sender m_Senders[ABSOLUTE_PLAYER_LIMIT + 1];
+	listenermask m_Active{};
+	listenermask m_Slots{}; // Synthetic sender slots taken by groups
+	std::vector<VoiceCodec_Celt *> m_Spare;
+	std::unordered_map<speakerset, group, speakersethash> m_Groups;
+	std::vector<int32_t> m_Mix;
+	std::vector<celt_int16> m_Frames;
+	std::vector<char> m_Packet;
+};
+
+extern VoiceMixer g_VoiceMixer;
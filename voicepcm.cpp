@@ -0,0 +1,458 @@
+#include "voicepcm.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(__i386__) || defined(__x86_64__)
+#define PCM_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+struct pcmkernels
+{
+	const char *name;
+	void (*gain)(celt_int16 *, int, float);
+	void (*mix)(celt_int16 *, const celt_int16 *, int);
+	void (*accumulate)(int32_t *, const celt_int16 *, int);
+	void (*saturate)(const int32_t *, celt_int16 *, int);
+	int (*peak)(const celt_int16 *, int);
+	uint64_t (*sumsquares)(const celt_int16 *, int);
+	float (*dot)(const float *, const float *, int);
+	void (*tofloat)(const celt_int16 *, float *, int);
+	void (*fromfloat)(const float *, celt_int16 *, int);
+};
+
+static inline celt_int16 saturate16(int value)
+{
+	return static_cast<celt_int16>(std::clamp(value, -32768, 32767));
+}
+
+static inline celt_int16 saturate16f(float value)
+{
+	return static_cast<celt_int16>(std::lrint(std::clamp(value, -32768.0f, 32767.0f)));
+}
+
+static void gain_scalar(celt_int16 *pcm, int n, float gain)
+{
+	for(int i{0}; i < n; ++i) {
+		pcm[i] = saturate16f(pcm[i] * gain);
+	}
+}
+
+static void mix_scalar(celt_int16 *dst, const celt_int16 *src, int n)
+{
+	for(int i{0}; i < n; ++i) {
+		dst[i] = saturate16(dst[i] + src[i]);
+	}
+}
+
+static void accumulate_scalar(int32_t *acc, const celt_int16 *src, int n)
+{
+	for(int i{0}; i < n; ++i) {
+		acc[i] += src[i];
+	}
+}
+
+static void saturate_scalar(const int32_t *acc, celt_int16 *pcm, int n)
+{
+	for(int i{0}; i < n; ++i) {
+		pcm[i] = saturate16(acc[i]);
+	}
+}
+
+static int peak_scalar(const celt_int16 *pcm, int n)
+{
+	int peak{0};
+	for(int i{0}; i < n; ++i) {
+		peak = std::max(peak, std::min(std::abs(static_cast<int>(pcm[i])), 32767));
+	}
+	return peak;
+}
+
+static uint64_t sumsquares_scalar(const celt_int16 *pcm, int n)
+{
+	uint64_t sum{0};
+	for(int i{0}; i < n; ++i) {
+		sum += static_cast<uint64_t>(static_cast<int>(pcm[i]) * static_cast<int>(pcm[i]));
+	}
+	return sum;
+}
+
+static float dot_scalar(const float *a, const float *b, int n)
+{
+	float sum{0.0f};
+	for(int i{0}; i < n; ++i) {
+		sum += a[i] * b[i];
+	}
+	return sum;
+}
+
+static void tofloat_scalar(const celt_int16 *pcm, float *out, int n)
+{
+	for(int i{0}; i < n; ++i) {
+		out[i] = pcm[i] * (1.0f / 32768.0f);
+	}
+}
+
+static void fromfloat_scalar(const float *in, celt_int16 *pcm, int n)
+{
+	for(int i{0}; i < n; ++i) {
+		pcm[i] = saturate16f(in[i] * 32768.0f);
+	}
+}
+
+#if defined(PCM_HAVE_X86)
+__attribute__((target("sse2")))
+static void gain_sse2(celt_int16 *pcm, int n, float gain)
+{
+	const __m128 g{_mm_set1_ps(gain)};
+	// cvtps overflows to INT_MIN for large products, clamp before converting
+	const __m128 lowest{_mm_set1_ps(-32768.0f)};
+	const __m128 highest{_mm_set1_ps(32767.0f)};
+	int i{0};
+	for(; i + 8 <= n; i += 8) {
+		const __m128i x{_mm_loadu_si128(reinterpret_cast<const __m128i *>(pcm + i))};
+		const __m128i lo{_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16)};
+		const __m128i hi{_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16)};
+		const __m128i a{_mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_cvtepi32_ps(lo), g), lowest), highest))};
+		const __m128i b{_mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_cvtepi32_ps(hi), g), lowest), highest))};
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(pcm + i), _mm_packs_epi32(a, b));
+	}
+	gain_scalar(pcm + i, n - i, gain);
+}
+
+__attribute__((target("sse2")))
+static void mix_sse2(celt_int16 *dst, const celt_int16 *src, int n)
+{
+	int i{0};
+	for(; i + 8 <= n; i += 8) {
+		const __m128i a{_mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + i))};
+		const __m128i b{_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i))};
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_adds_epi16(a, b));
+	}
+	mix_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void accumulate_sse2(int32_t *acc, const celt_int16 *src, int n)
+{
+	int i{0};
+	for(; i + 8 <= n; i += 8) {
+		const __m128i x{_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i))};
+		const __m128i lo{_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16)};
+		const __m128i hi{_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16)};
+		__m128i *pAcc{reinterpret_cast<__m128i *>(acc + i)};
+		_mm_storeu_si128(pAcc, _mm_add_epi32(_mm_loadu_si128(pAcc), lo));
+		_mm_storeu_si128(pAcc + 1, _mm_add_epi32(_mm_loadu_si128(pAcc + 1), hi));
+	}
+	accumulate_scalar(acc + i, src + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void saturate_sse2(const int32_t *acc, celt_int16 *pcm, int n)
+{
+	int i{0};
+	for(; i + 8 <= n; i += 8) {
+		const __m128i a{_mm_loadu_si128(reinterpret_cast<const __m128i *>(acc + i))};
+		const __m128i b{_mm_loadu_si128(reinterpret_cast<const __m128i *>(acc + i + 4))};
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(pcm + i), _mm_packs_epi32(a, b));
+	}
+	saturate_scalar(acc + i, pcm + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static int peak_sse2(const celt_int16 *pcm, int n)
+{
+	const __m128i zero{_mm_setzero_si128()};
+	__m128i peak{zero};
+	int i{0};
+	for(; i + 8 <= n; i += 8) {
+		const __m128i x{_mm_loadu_si128(reinterpret_cast<const __m128i *>(pcm + i))};
+		peak = _mm_max_epi16(peak, _mm_max_epi16(x, _mm_subs_epi16(zero, x)));
+	}
+	peak = _mm_max_epi16(peak, _mm_srli_si128(peak, 8));
+	peak = _mm_max_epi16(peak, _mm_srli_si128(peak, 4));
+	peak = _mm_max_epi16(peak, _mm_srli_si128(peak, 2));
+	const int vector{static_cast<celt_int16>(_mm_cvtsi128_si32(peak))};
+	return std::max(vector, peak_scalar(pcm + i, n - i));
+}
+
+__attribute__((target("sse2")))
+static uint64_t sumsquares_sse2(const celt_int16 *pcm, int n)
+{
+	const __m128i zero{_mm_setzero_si128()};
+	__m128i sum{zero};
+	int i{0};
+	for(; i + 8 <= n; i += 8) {
+		const __m128i x{_mm_loadu_si128(reinterpret_cast<const __m128i *>(pcm + i))};
+		// Pair sums are at most 2^31, so they fit unsigned 32-bit lanes
+		const __m128i sq{_mm_madd_epi16(x, x)};
+		sum = _mm_add_epi64(sum, _mm_unpacklo_epi32(sq, zero));
+		sum = _mm_add_epi64(sum, _mm_unpackhi_epi32(sq, zero));
+	}
+	alignas(16) uint64_t lanes[2];
+	_mm_store_si128(reinterpret_cast<__m128i *>(lanes), sum);
+	return lanes[0] + lanes[1] + sumsquares_scalar(pcm + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static float dot_sse2(const float *a, const float *b, int n)
+{
+	__m128 sum{_mm_setzero_ps()};
+	int i{0};
+	for(; i + 4 <= n; i += 4) {
+		sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+	}
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+	return _mm_cvtss_f32(sum) + dot_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void tofloat_sse2(const celt_int16 *pcm, float *out, int n)
+{
+	const __m128 scale{_mm_set1_ps(1.0f / 32768.0f)};
+	int i{0};
+	for(; i + 8 <= n; i += 8) {
+		const __m128i x{_mm_loadu_si128(reinterpret_cast<const __m128i *>(pcm + i))};
+		const __m128i lo{_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16)};
+		const __m128i hi{_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16)};
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+		_mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+	}
+	tofloat_scalar(pcm + i, out + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void fromfloat_sse2(const float *in, celt_int16 *pcm, int n)
+{
+	const __m128 scale{_mm_set1_ps(32768.0f)};
+	const __m128 lowest{_mm_set1_ps(-32768.0f)};
+	const __m128 highest{_mm_set1_ps(32767.0f)};
+	int i{0};
+	for(; i + 8 <= n; i += 8) {
+		const __m128 a{_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(in + i), scale), lowest), highest)};
+		const __m128 b{_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(in + i + 4), scale), lowest), highest)};
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(pcm + i), _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+	}
+	fromfloat_scalar(in + i, pcm + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void gain_avx2(celt_int16 *pcm, int n, float gain)
+{
+	const __m256 g{_mm256_set1_ps(gain)};
+	const __m256 lowest{_mm256_set1_ps(-32768.0f)};
+	const __m256 highest{_mm256_set1_ps(32767.0f)};
+	int i{0};
+	for(; i + 16 <= n; i += 16) {
+		const __m256i lo{_mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(pcm + i)))};
+		const __m256i hi{_mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(pcm + i + 8)))};
+		const __m256i a{_mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(lo), g), lowest), highest))};
+		const __m256i b{_mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(hi), g), lowest), highest))};
+		// packs works per 128-bit lane, put the quarters back in order
+		const __m256i packed{_mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8)};
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(pcm + i), packed);
+	}
+	gain_sse2(pcm + i, n - i, gain);
+}
+
+__attribute__((target("avx2")))
+static void mix_avx2(celt_int16 *dst, const celt_int16 *src, int n)
+{
+	int i{0};
+	for(; i + 16 <= n; i += 16) {
+		const __m256i a{_mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + i))};
+		const __m256i b{_mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i))};
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_adds_epi16(a, b));
+	}
+	mix_sse2(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void accumulate_avx2(int32_t *acc, const celt_int16 *src, int n)
+{
+	int i{0};
+	for(; i + 8 <= n; i += 8) {
+		const __m256i x{_mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i)))};
+		__m256i *pAcc{reinterpret_cast<__m256i *>(acc + i)};
+		_mm256_storeu_si256(pAcc, _mm256_add_epi32(_mm256_loadu_si256(pAcc), x));
+	}
+	accumulate_scalar(acc + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void saturate_avx2(const int32_t *acc, celt_int16 *pcm, int n)
+{
+	int i{0};
+	for(; i + 16 <= n; i += 16) {
+		const __m256i a{_mm256_loadu_si256(reinterpret_cast<const __m256i *>(acc + i))};
+		const __m256i b{_mm256_loadu_si256(reinterpret_cast<const __m256i *>(acc + i + 8))};
+		const __m256i packed{_mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8)};
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(pcm + i), packed);
+	}
+	saturate_sse2(acc + i, pcm + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static int peak_avx2(const celt_int16 *pcm, int n)
+{
+	const __m256i zero{_mm256_setzero_si256()};
+	__m256i peak{zero};
+	int i{0};
+	for(; i + 16 <= n; i += 16) {
+		const __m256i x{_mm256_loadu_si256(reinterpret_cast<const __m256i *>(pcm + i))};
+		peak = _mm256_max_epi16(peak, _mm256_max_epi16(x, _mm256_subs_epi16(zero, x)));
+	}
+	__m128i p{_mm_max_epi16(_mm256_castsi256_si128(peak), _mm256_extracti128_si256(peak, 1))};
+	p = _mm_max_epi16(p, _mm_srli_si128(p, 8));
+	p = _mm_max_epi16(p, _mm_srli_si128(p, 4));
+	p = _mm_max_epi16(p, _mm_srli_si128(p, 2));
+	const int vector{static_cast<celt_int16>(_mm_cvtsi128_si32(p))};
+	return std::max(vector, peak_sse2(pcm + i, n - i));
+}
+
+__attribute__((target("avx2")))
+static uint64_t sumsquares_avx2(const celt_int16 *pcm, int n)
+{
+	__m256i sum{_mm256_setzero_si256()};
+	int i{0};
+	for(; i + 16 <= n; i += 16) {
+		const __m256i x{_mm256_loadu_si256(reinterpret_cast<const __m256i *>(pcm + i))};
+		const __m256i sq{_mm256_madd_epi16(x, x)};
+		sum = _mm256_add_epi64(sum, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(sq)));
+		sum = _mm256_add_epi64(sum, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(sq, 1)));
+	}
+	alignas(32) uint64_t lanes[4];
+	_mm256_store_si256(reinterpret_cast<__m256i *>(lanes), sum);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sumsquares_sse2(pcm + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static float dot_avx2(const float *a, const float *b, int n)
+{
+	__m256 sum{_mm256_setzero_ps()};
+	int i{0};
+	for(; i + 8 <= n; i += 8) {
+		sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+	}
+	__m128 s{_mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1))};
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s) + dot_sse2(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void tofloat_avx2(const celt_int16 *pcm, float *out, int n)
+{
+	const __m256 scale{_mm256_set1_ps(1.0f / 32768.0f)};
+	int i{0};
+	for(; i + 8 <= n; i += 8) {
+		const __m256i x{_mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(pcm + i)))};
+		_mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+	}
+	tofloat_scalar(pcm + i, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void fromfloat_avx2(const float *in, celt_int16 *pcm, int n)
+{
+	const __m256 scale{_mm256_set1_ps(32768.0f)};
+	const __m256 lowest{_mm256_set1_ps(-32768.0f)};
+	const __m256 highest{_mm256_set1_ps(32767.0f)};
+	int i{0};
+	for(; i + 16 <= n; i += 16) {
+		const __m256 a{_mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(in + i), scale), lowest), highest)};
+		const __m256 b{_mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(in + i + 8), scale), lowest), highest)};
+		const __m256i packed{_mm256_permute4x64_epi64(_mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b)), 0xD8)};
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(pcm + i), packed);
+	}
+	fromfloat_sse2(in + i, pcm + i, n - i);
+}
+#endif
+
+static const pcmkernels kernels_scalar{"scalar", gain_scalar, mix_scalar, accumulate_scalar, saturate_scalar, peak_scalar, sumsquares_scalar, dot_scalar, tofloat_scalar, fromfloat_scalar};
+#if defined(PCM_HAVE_X86)
+static const pcmkernels kernels_sse2{"sse2", gain_sse2, mix_sse2, accumulate_sse2, saturate_sse2, peak_sse2, sumsquares_sse2, dot_sse2, tofloat_sse2, fromfloat_sse2};
+static const pcmkernels kernels_avx2{"avx2", gain_avx2, mix_avx2, accumulate_avx2, saturate_avx2, peak_avx2, sumsquares_avx2, dot_avx2, tofloat_avx2, fromfloat_avx2};
+#endif
+
+static const pcmkernels *kernels{&kernels_scalar};
+
+void PCM_InitKernels()
+{
+#if defined(PCM_HAVE_X86)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		kernels = &kernels_avx2;
+	} else if(__builtin_cpu_supports("sse2")) {
+		kernels = &kernels_sse2;
+	} else {
+		kernels = &kernels_scalar;
+	}
+#endif
+}
+
+const char *PCM_KernelsName()
+{
+	return kernels->name;
+}
+
+void PCM_ApplyGain(celt_int16 *pcm, int nSamples, float gain)
+{
+	kernels->gain(pcm, nSamples, gain);
+}
+
+void PCM_MixSaturate(celt_int16 *dst, const celt_int16 *src, int nSamples)
+{
+	kernels->mix(dst, src, nSamples);
+}
+
+void PCM_Accumulate(int32_t *acc, const celt_int16 *src, int nSamples)
+{
+	kernels->accumulate(acc, src, nSamples);
+}
+
+void PCM_Saturate(const int32_t *acc, celt_int16 *pcm, int nSamples)
+{
+	kernels->saturate(acc, pcm, nSamples);
+}
+
+int PCM_Peak(const celt_int16 *pcm, int nSamples)
+{
+	return kernels->peak(pcm, nSamples);
+}
+
+float PCM_RMS(const celt_int16 *pcm, int nSamples)
+{
+	if(nSamples <= 0)
+		return 0.0f;
+
+	return static_cast<float>(std::sqrt(static_cast<double>(kernels->sumsquares(pcm, nSamples)) / nSamples));
+}
+
+float PCM_DotProduct(const float *a, const float *b, int n)
+{
+	return kernels->dot(a, b, n);
+}
+
+void PCM_ToFloat(const celt_int16 *pcm, float *out, int nSamples)
+{
+	kernels->tofloat(pcm, out, nSamples);
+}
+
+void PCM_FromFloat(const float *in, celt_int16 *pcm, int nSamples)
+{
+	kernels->fromfloat(in, pcm, nSamples);
+}
+
+void PCM_FromFloatDither(const float *in, celt_int16 *pcm, int nSamples, uint32_t &seed)
+{
+	// Sum of two uniform values in [-0.5, 0.5) LSB gives triangular noise
+	for(int i{0}; i < nSamples; ++i) {
+		seed = (seed * 1664525u) + 1013904223u;
+		const float a{(seed >> 8) * (1.0f / 16777216.0f)};
+		seed = (seed * 1664525u) + 1013904223u;
+		const float b{(seed >> 8) * (1.0f / 16777216.0f)};
+		pcm[i] = saturate16f((in[i] * 32768.0f) + (a - b));
+	}
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include "celt_types.h"
+
+// PCM kernels over 16-bit signed mono samples. Each kernel has scalar, SSE2
+// and AVX2 versions, picked once at load by PCM_InitKernels from the CPU.
+
+// Picks the fastest kernels the CPU supports.
+void PCM_InitKernels();
+
+// Name of the instruction set the kernels were picked for.
+const char *PCM_KernelsName();
+
+// pcm = saturate(pcm * gain)
+void PCM_ApplyGain(celt_int16 *pcm, int nSamples, float gain);
+
+// dst = saturate(dst + src)
+void PCM_MixSaturate(celt_int16 *dst, const celt_int16 *src, int nSamples);
+
+// acc += src, for mixing more than two sources without clipping in between.
+void PCM_Accumulate(int32_t *acc, const celt_int16 *src, int nSamples);
+
+// pcm = saturate(acc)
+void PCM_Saturate(const int32_t *acc, celt_int16 *pcm, int nSamples);
+
+// Largest absolute sample value, -32768 counts as 32767.
+int PCM_Peak(const celt_int16 *pcm, int nSamples);
+
+// Root mean square of the samples, in sample units.
+float PCM_RMS(const celt_int16 *pcm, int nSamples);
+
+// Sum of a[i] * b[i].
+float PCM_DotProduct(const float *a, const float *b, int n);
+
+// Converts to floats in [-1, 1).
+void PCM_ToFloat(const celt_int16 *pcm, float *out, int nSamples);
+
+// Converts floats in [-1, 1) back to samples, clipping anything outside.
+void PCM_FromFloat(const float *in, celt_int16 *pcm, int nSamples);
+
+// Same as PCM_FromFloat with triangular dither, seed is updated in place.
+void PCM_FromFloatDither(const float *in, celt_int16 *pcm, int nSamples, uint32_t &seed);
@@ -0,0 +1,301 @@
+#include "voiceplayback.h"
+#include "voiceencoder.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+// Frames kept queued or encoded ahead of the send position
+#define PLAYBACK_LOOKAHEAD_FRAMES 16
+#define PLAYBACK_READ_BUFFER (64 * 1024)
+
+VoicePlaybackManager g_VoicePlayback;
+
+VoiceFilePlayback::VoiceFilePlayback()
+{
+	m_pFile = nullptr;
+	m_nRemainingBytes = -1;
+	m_bEof = false;
+	m_pCodec = nullptr;
+	m_nInFlight = 0;
+	m_flStart = -1.0;
+	m_nSent = 0;
+}
+
+VoiceFilePlayback::~VoiceFilePlayback()
+{
+	if(m_pCodec) {
+		g_EncoderPool.Cancel(m_pCodec);
+		m_pCodec->Release();
+	}
+
+	if(m_pFile)
+		fclose(m_pFile);
+}
+
+bool ReadWavHeader(FILE *pFile, int nSampleRate, long &nDataBytes, char *error, size_t maxlen)
+{
+	char riff[12];
+	if(fread(riff, 1, sizeof(riff), pFile) != sizeof(riff) || memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0) {
+		rewind(pFile);
+		nDataBytes = -1;
+		return true;
+	}
+
+	bool bFormat{false};
+
+	for(;;) {
+		char id[4];
+		uint32_t size;
+		if(fread(id, 1, sizeof(id), pFile) != sizeof(id) || fread(&size, 1, sizeof(size), pFile) != sizeof(size)) {
+			smutils->Format(error, maxlen, "missing data chunk");
+			return false;
+		}
+
+		if(memcmp(id, "fmt ", 4) == 0) {
+			uint16_t format, channels, align, bits;
+			uint32_t rate, byterate;
+			if(size < 16 ||
+				fread(&format, 1, sizeof(format), pFile) != sizeof(format) ||
+				fread(&channels, 1, sizeof(channels), pFile) != sizeof(channels) ||
+				fread(&rate, 1, sizeof(rate), pFile) != sizeof(rate) ||
+				fread(&byterate, 1, sizeof(byterate), pFile) != sizeof(byterate) ||
+				fread(&align, 1, sizeof(align), pFile) != sizeof(align) ||
+				fread(&bits, 1, sizeof(bits), pFile) != sizeof(bits)) {
+				smutils->Format(error, maxlen, "truncated fmt chunk");
+				return false;
+			}
+
+			if(format != 1 || channels != 1 || bits != 16) {
+				smutils->Format(error, maxlen, "only 16-bit mono PCM is supported");
+				return false;
+			}
+
+			if(static_cast<int>(rate) != nSampleRate) {
+				smutils->Format(error, maxlen, "sample rate %u does not match the voice codec rate %d", rate, nSampleRate);
+				return false;
+			}
+
+			bFormat = true;
+			fseek(pFile, (size - 16) + (size & 1), SEEK_CUR);
+		} else if(memcmp(id, "data", 4) == 0) {
+			if(!bFormat) {
+				smutils->Format(error, maxlen, "data chunk before fmt chunk");
+				return false;
+			}
+
+			nDataBytes = static_cast<long>(size);
+			return true;
+		} else {
+			fseek(pFile, size + (size & 1), SEEK_CUR);
+		}
+	}
+}
+
+bool VoiceFilePlayback::Open(const char *path, char *error, size_t maxlen)
+{
+	char fullpath[PLATFORM_MAX_PATH];
+	smutils->BuildPath(Path_Game, fullpath, sizeof(fullpath), "%s", path);
+
+	m_pFile = fopen(fullpath, "rb");
+	if(!m_pFile) {
+		smutils->Format(error, maxlen, "could not open \"%s\"", fullpath);
+		return false;
+	}
+
+	setvbuf(m_pFile, nullptr, _IOFBF, PLAYBACK_READ_BUFFER);
+
+	if(!ReadWavHeader(m_pFile, VoiceCodec_Celt::TheEncoderSettings().SampleRate_Hz, m_nRemainingBytes, error, maxlen)) {
+		return false;
+	}
+
+	m_pCodec = new VoiceCodec_Celt{};
+	if(!m_pCodec->Init(0, 0, 0)) {
+		smutils->Format(error, maxlen, "could not create the CELT encoder");
+		return false;
+	}
+
+	const VoiceCodec_Celt::CEncoderSettings &settings{m_pCodec->EncoderSettings()};
+	m_Frame.resize(settings.FrameSize * BYTES_PER_SAMPLE);
+	m_Packet.reserve(VOICE_MAX_DATA_BYTES);
+
+	Submit();
+
+	return true;
+}
+
+void VoiceFilePlayback::Submit()
+{
+	const VoiceCodec_Celt::CEncoderSettings &settings{m_pCodec->EncoderSettings()};
+
+	while(!m_bEof && (m_nInFlight + static_cast<int>(m_Encoded.size())) < PLAYBACK_LOOKAHEAD_FRAMES) {
+		size_t want{m_Frame.size()};
+		if(m_nRemainingBytes >= 0 && static_cast<size_t>(m_nRemainingBytes) < want) {
+			want = static_cast<size_t>(m_nRemainingBytes);
+		}
+
+		const size_t got{fread(m_Frame.data(), 1, want, m_pFile)};
+		if(m_nRemainingBytes >= 0) {
+			m_nRemainingBytes -= static_cast<long>(got);
+		}
+
+		if(got < m_Frame.size() || m_nRemainingBytes == 0) {
+			m_bEof = true;
+		}
+
+		if(got == 0) {
+			break;
+		}
+
+		memset(m_Frame.data() + got, 0, m_Frame.size() - got);
+
+		GetEncoderPool().Submit(m_pCodec, m_Frame.data(), settings.FrameSize, settings.PacketSize, m_bEof);
+		++m_nInFlight;
+	}
+}
+
+void VoiceFilePlayback::OnEncoded(const VoiceEncodeJob &job)
+{
+	--m_nInFlight;
+
+	if(job.result > 0) {
+		m_Encoded.emplace_back(job.compressed.begin(), job.compressed.begin() + job.result);
+	}
+}
+
+bool VoiceFilePlayback::RunFrame(double now)
+{
+	Submit();
+
+	if(m_flStart < 0.0) {
+		if(m_Encoded.empty()) {
+			return !m_bEof || m_nInFlight > 0;
+		}
+		m_flStart = now;
+	}
+
+	const VoiceCodec_Celt::CEncoderSettings &settings{m_pCodec->EncoderSettings()};
+
+	const int due{static_cast<int>((now - m_flStart) / settings.FrameTime) + 1 - m_nSent};
+	const int count{std::min<int>({due, static_cast<int>(m_Encoded.size()), VOICE_MAX_DATA_BYTES / settings.PacketSize})};
+
+	if(count > 0) {
+		m_Packet.clear();
+		for(int i{0}; i < count; ++i) {
+			const std::vector<char> &frame{m_Encoded.front()};
+			m_Packet.insert(m_Packet.end(), frame.begin(), frame.end());
+			m_Encoded.pop_front();
+		}
+
+		SendVoiceDataToListeners(m_Listeners, m_Packet.data(), static_cast<int>(m_Packet.size()), m_nFrom, m_bProximity);
+		m_nSent += count;
+	}
+
+	// The encoder fell behind, delay the clock instead of bursting later
+	if(count < due && m_Encoded.empty() && (!m_bEof || m_nInFlight > 0)) {
+		m_flStart += (due - std::max(count, 0)) * settings.FrameTime;
+	}
+
+	return !m_bEof || m_nInFlight > 0 || !m_Encoded.empty();
+}
+
+int VoicePlaybackManager::Play(const char *path, const listenermask &listeners, int from, bool proximity, char *error, size_t maxlen)
+{
+	std::unique_ptr<VoiceFilePlayback> playback{new VoiceFilePlayback{}};
+	playback->m_Listeners = listeners;
+	playback->m_nFrom = from;
+	playback->m_bProximity = proximity;
+
+	if(!playback->Open(path, error, maxlen)) {
+		return 0;
+	}
+
+	return Add(std::move(playback));
+}
+
+int VoicePlaybackManager::Add(std::unique_ptr<VoicePlayback> playback)
+{
+	const int id{m_nNextId++};
+	if(m_nNextId <= 0) {
+		m_nNextId = 1;
+	}
+
+	if(playback->Codec()) {
+		m_ByCodec[playback->Codec()] = playback.get();
+	}
+	m_Playbacks[id] = std::move(playback);
+
+	return id;
+}
+
+bool VoicePlaybackManager::Stop(int id)
+{
+	auto it{m_Playbacks.find(id)};
+	if(it == m_Playbacks.end()) {
+		return false;
+	}
+
+	if(it->second->Codec()) {
+		m_ByCodec.erase(it->second->Codec());
+	}
+	m_Playbacks.erase(it);
+	return true;
+}
+
+bool VoicePlaybackManager::IsActive(int id) const
+{
+	return m_Playbacks.find(id) != m_Playbacks.end();
+}
+
+VoicePlayback *VoicePlaybackManager::Get(int id) const
+{
+	auto it{m_Playbacks.find(id)};
+	if(it == m_Playbacks.end()) {
+		return nullptr;
+	}
+
+	return it->second.get();
+}
+
+void VoicePlaybackManager::Clear()
+{
+	m_ByCodec.clear();
+	m_Playbacks.clear();
+}
+
+bool VoicePlaybackManager::OnEncoded(const VoiceEncodeJob &job)
+{
+	auto it{m_ByCodec.find(job.codec)};
+	if(it == m_ByCodec.end()) {
+		return false;
+	}
+
+	it->second->OnEncoded(job);
+	return true;
+}
+
+void VoicePlaybackManager::RunFrame(double now, void (*finished)(int id))
+{
+	if(m_Playbacks.empty()) {
+		return;
+	}
+
+	m_Finished.clear();
+
+	for(auto it{m_Playbacks.begin()}; it != m_Playbacks.end();) {
+		if(it->second->RunFrame(now)) {
+			++it;
+			continue;
+		}
+
+		m_Finished.emplace_back(it->first);
+		if(it->second->Codec()) {
+			m_ByCodec.erase(it->second->Codec());
+		}
+		it = m_Playbacks.erase(it);
+	}
+
+	// Plugins may start or stop playbacks from the callback
+	for(int id : m_Finished) {
+		finished(id);
+	}
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "extension.h"
+
+struct VoiceEncodeJob;
+class VoiceStreamPlayback;
+
+// Reads the header of a RIFF/WAVE file and leaves pFile at the start of the
+// samples. Files without a RIFF header are rewound and treated as raw PCM.
+// nDataBytes is -1 for raw files.
+bool ReadWavHeader(FILE *pFile, int nSampleRate, long &nDataBytes, char *error, size_t maxlen);
+
+// Something that sends voice to a set of listeners paced in real time.
+class VoicePlayback
+{
+public:
+	virtual ~VoicePlayback() {}
+
+	// Return false once everything has been sent.
+	virtual bool RunFrame(double now)=0;
+
+	// Codec whose encoder pool jobs belong to this playback, if any.
+	virtual IVoiceCodec *Codec() const { return nullptr; }
+
+	virtual void OnEncoded(const VoiceEncodeJob &job) {}
+
+	// Non null if this is a stream plugins push frames to.
+	virtual VoiceStreamPlayback *Stream() { return nullptr; }
+
+	listenermask m_Listeners;
+	int m_nFrom{0};
+	bool m_bProximity{false};
+};
+
+// Streams a WAV or raw 16-bit mono PCM file to a set of listeners, encoding
+// a few frames ahead on the encoder pool and sending them paced to FrameTime.
+class VoiceFilePlayback : public VoicePlayback
+{
+public:
+	VoiceFilePlayback();
+	~VoiceFilePlayback();
+
+	bool Open(const char *path, char *error, size_t maxlen);
+
+	virtual void OnEncoded(const VoiceEncodeJob &job) override;
+	virtual bool RunFrame(double now) override;
+	virtual IVoiceCodec *Codec() const override { return m_pCodec; }
+
+private:
+	void Submit();
+
+	FILE *m_pFile;
+	long m_nRemainingBytes; // -1 for raw files, which are read until EOF
+	bool m_bEof;
+	VoiceCodec_Celt *m_pCodec;
+	int m_nInFlight;
+	std::deque<std::vector<char>> m_Encoded;
+	std::vector<char> m_Frame;
+	std::vector<char> m_Packet;
+	double m_flStart;
+	int m_nSent;
+};
+
+class VoicePlaybackManager
+{
+public:
+	// Return the playback id or 0 on failure.
+	int Play(const char *path, const listenermask &listeners, int from, bool proximity, char *error, size_t maxlen);
+
+	// Takes ownership of an already opened playback and returns its id.
+	int Add(std::unique_ptr<VoicePlayback> playback);
+	bool Stop(int id);
+	bool IsActive(int id) const;
+	VoicePlayback *Get(int id) const;
+	void Clear();
+
+	// Return true if the job belonged to a playback.
+	bool OnEncoded(const VoiceEncodeJob &job);
+
+	// Calls finished with the id of every playback that ended this frame.
+	void RunFrame(double now, void (*finished)(int id));
+
+private:
+	std::unordered_map<int, std::unique_ptr<VoicePlayback>> m_Playbacks;
+	std::unordered_map<IVoiceCodec *, VoicePlayback *> m_ByCodec;
+	std::vector<int> m_Finished;
+	int m_nNextId{1};
+};
+
+extern VoicePlaybackManager g_VoicePlayback;
@@ -0,0 +1,350 @@
+#include "voicerecord.h"
+#include "voicestats.h"
+#include "smsdk_ext.h"
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstdarg>
+#include <cstring>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+// Wake the writer early once this much is buffered
+#define RECORD_FLUSH_BYTES (64 * 1024)
+#define RECORD_FLUSH_INTERVAL std::chrono::milliseconds{100}
+
+VoiceRecorder g_VoiceRecorder;
+
+static size_t round_pow2(size_t n)
+{
+	size_t pow2{1};
+	while(pow2 < n) {
+		pow2 <<= 1;
+	}
+	return pow2;
+}
+
+static bool write_all(int fd, const void *data, size_t nBytes)
+{
+	const char *ptr{static_cast<const char *>(data)};
+	while(nBytes > 0) {
+		const ssize_t ret{write(fd, ptr, nBytes)};
+		if(ret < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		ptr += ret;
+		nBytes -= static_cast<size_t>(ret);
+	}
+	return true;
+}
+
+VoiceRecorder::~VoiceRecorder()
+{
+	Stop();
+}
+
+bool VoiceRecorder::Start(const char *path, const char *codec, int samplerate, size_t nBufferBytes, size_t nSegmentBytes, char *error, size_t maxlen)
+{
+	if(IsRecording()) {
+		smutils->Format(error, maxlen, "already recording to \"%s\"", m_Path.c_str());
+		return false;
+	}
+
+	char fullpath[PLATFORM_MAX_PATH];
+	smutils->BuildPath(Path_Game, fullpath, sizeof(fullpath), "%s", path);
+
+	std::error_code ec;
+	std::filesystem::create_directories(std::filesystem::path{fullpath}.parent_path(), ec);
+	if(ec) {
+		smutils->Format(error, maxlen, "could not create the directory of \"%s\": %s", fullpath, ec.message().c_str());
+		return false;
+	}
+
+	m_FullPath = fullpath;
+	m_Path = path;
+	m_nSegmentBytes = std::max<size_t>(nSegmentBytes, 1024 * 1024);
+
+	memset(&m_Header, 0, sizeof(m_Header));
+	memcpy(m_Header.magic, VOICERECORD_MAGIC, 4);
+	m_Header.version = VOICERECORD_VERSION;
+	m_Header.segment = 0;
+	m_Header.samplerate = static_cast<uint32_t>(samplerate);
+	m_Header.starttime = std::chrono::duration<double>{std::chrono::system_clock::now().time_since_epoch()}.count();
+	strncpy(m_Header.codec, codec, sizeof(m_Header.codec) - 1);
+
+	if(!OpenSegment()) {
+		smutils->Format(error, maxlen, "%s", m_szError);
+		return false;
+	}
+
+	m_Ring.assign(round_pow2(std::max<size_t>(nBufferBytes, RECORD_FLUSH_BYTES * 2)), 0);
+	m_nMask = m_Ring.size() - 1;
+	m_nHead.store(0, std::memory_order_relaxed);
+	m_nTail.store(0, std::memory_order_relaxed);
+	m_nDropped.store(0, std::memory_order_relaxed);
+	m_bFailed.store(false, std::memory_order_relaxed);
+	m_bReported = false;
+	m_bStopping = false;
+
+	m_Thread = std::thread{&VoiceRecorder::WriterMain, this};
+
+	return true;
+}
+
+void VoiceRecorder::Stop()
+{
+	if(!IsRecording())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock{m_Mutex};
+		m_bStopping = true;
+	}
+
+	m_Cv.notify_one();
+	m_Thread.join();
+
+	ReportErrors();
+
+	m_Ring.clear();
+	m_Ring.shrink_to_fit();
+}
+
+void VoiceRecorder::CopyIn(size_t nPos, const void *src, size_t nBytes)
+{
+	const size_t nStart{nPos & m_nMask};
+	const size_t nFirst{std::min(nBytes, m_Ring.size() - nStart)};
+	memcpy(m_Ring.data() + nStart, src, nFirst);
+	memcpy(m_Ring.data(), static_cast<const char *>(src) + nFirst, nBytes - nFirst);
+}
+
+void VoiceRecorder::CopyOut(size_t nPos, void *dst, size_t nBytes) const
+{
+	const size_t nStart{nPos & m_nMask};
+	const size_t nFirst{std::min(nBytes, m_Ring.size() - nStart)};
+	memcpy(dst, m_Ring.data() + nStart, nFirst);
+	memcpy(static_cast<char *>(dst) + nFirst, m_Ring.data(), nBytes - nFirst);
+}
+
+void VoiceRecorder::Record(int sender, uint64_t xuid, int tick, const char *data, int nBytes)
+{
+	if(nBytes < 0) {
+		return;
+	}
+
+	const size_t nTotal{sizeof(voicerecordpacket) + static_cast<size_t>(nBytes)};
+	const size_t nHead{m_nHead.load(std::memory_order_relaxed)};
+	const size_t nUsed{nHead - m_nTail.load(std::memory_order_acquire)};
+	if(nUsed + nTotal > m_Ring.size()) {
+		m_nDropped.fetch_add(1, std::memory_order_relaxed);
+		g_VoiceStats.Add(VoiceStat_DropRecorder);
+		return;
+	}
+
+	voicerecordpacket packet;
+	packet.timestamp = std::chrono::duration<double>{std::chrono::system_clock::now().time_since_epoch()}.count();
+	packet.xuid = xuid;
+	packet.size = static_cast<uint32_t>(nBytes);
+	packet.sender = sender;
+	packet.tick = tick;
+	packet.reserved = 0;
+
+	CopyIn(nHead, &packet, sizeof(packet));
+	CopyIn(nHead + sizeof(packet), data, static_cast<size_t>(nBytes));
+
+	m_nHead.store(nHead + nTotal, std::memory_order_release);
+
+	// Only wake the writer when a batch crossed the threshold, it polls otherwise
+	if(nUsed < RECORD_FLUSH_BYTES && (nUsed + nTotal) >= RECORD_FLUSH_BYTES) {
+		m_Cv.notify_one();
+	}
+}
+
+void VoiceRecorder::ReportErrors()
+{
+	if(!m_bReported && m_bFailed.load(std::memory_order_acquire)) {
+		m_bReported = true;
+		smutils->LogError(myself, "Voice recording to \"%s\" failed: %s", m_Path.c_str(), m_szError);
+	}
+}
+
+void VoiceRecorder::Fail(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(m_szError, sizeof(m_szError), fmt, ap);
+	va_end(ap);
+
+	m_bFailed.store(true, std::memory_order_release);
+}
+
+bool VoiceRecorder::OpenSegment()
+{
+	char path[PLATFORM_MAX_PATH];
+
+	snprintf(path, sizeof(path), "%s_%04u.vsr", m_FullPath.c_str(), m_Header.segment);
+	m_nFile = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND|O_CLOEXEC, 0644);
+	if(m_nFile == -1) {
+		Fail("could not create \"%s\": %s", path, strerror(errno));
+		return false;
+	}
+
+	snprintf(path, sizeof(path), "%s_%04u.vsi", m_FullPath.c_str(), m_Header.segment);
+	m_nIndexFile = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND|O_CLOEXEC, 0644);
+	if(m_nIndexFile == -1) {
+		Fail("could not create \"%s\": %s", path, strerror(errno));
+		CloseSegment();
+		return false;
+	}
+
+	voicerecordindexheader index;
+	memcpy(index.magic, VOICERECORD_INDEX_MAGIC, 4);
+	index.version = VOICERECORD_VERSION;
+
+	if(!write_all(m_nFile, &m_Header, sizeof(m_Header)) || !write_all(m_nIndexFile, &index, sizeof(index))) {
+		Fail("could not write segment %u: %s", m_Header.segment, strerror(errno));
+		CloseSegment();
+		return false;
+	}
+
+	m_nOffset = sizeof(m_Header);
+	m_flLastIndexed = -1.0;
+	return true;
+}
+
+void VoiceRecorder::CloseSegment()
+{
+	if(m_nFile != -1) {
+		close(m_nFile);
+		m_nFile = -1;
+	}
+
+	if(m_nIndexFile != -1) {
+		close(m_nIndexFile);
+		m_nIndexFile = -1;
+	}
+}
+
+bool VoiceRecorder::WriteRing(size_t nStart, size_t nEnd)
+{
+	size_t nBytes{nEnd - nStart};
+	if(nBytes > 0) {
+		const size_t nPos{nStart & m_nMask};
+		const size_t nFirst{std::min(nBytes, m_Ring.size() - nPos)};
+
+		iovec iov[2];
+		iov[0].iov_base = m_Ring.data() + nPos;
+		iov[0].iov_len = nFirst;
+		iov[1].iov_base = m_Ring.data();
+		iov[1].iov_len = nBytes - nFirst;
+
+		iovec *pIov{iov};
+		int nIov{(iov[1].iov_len > 0) ? 2 : 1};
+		while(nIov > 0) {
+			const ssize_t ret{writev(m_nFile, pIov, nIov)};
+			if(ret < 0) {
+				if(errno == EINTR) {
+					continue;
+				}
+				Fail("could not write segment %u: %s", m_Header.segment, strerror(errno));
+				return false;
+			}
+
+			size_t nWritten{static_cast<size_t>(ret)};
+			while(nIov > 0 && nWritten >= pIov->iov_len) {
+				nWritten -= pIov->iov_len;
+				++pIov;
+				--nIov;
+			}
+			if(nIov > 0) {
+				pIov->iov_base = static_cast<char *>(pIov->iov_base) + nWritten;
+				pIov->iov_len -= nWritten;
+			}
+		}
+
+		m_nOffset += nBytes;
+		g_VoiceStats.Add(VoiceStat_BytesRecorded, nBytes);
+	}
+
+	if(!m_Index.empty()) {
+		if(!write_all(m_nIndexFile, m_Index.data(), m_Index.size() * sizeof(voicerecordindexentry))) {
+			Fail("could not write the index of segment %u: %s", m_Header.segment, strerror(errno));
+			return false;
+		}
+		m_Index.clear();
+	}
+
+	return true;
+}
+
+void VoiceRecorder::WriterMain()
+{
+	bool bStopping{false};
+	while(!bStopping) {
+		{
+			std::unique_lock<std::mutex> lock{m_Mutex};
+			m_Cv.wait_for(lock, RECORD_FLUSH_INTERVAL, [this]() {
+				return m_bStopping || (m_nHead.load(std::memory_order_acquire) - m_nTail.load(std::memory_order_relaxed)) >= RECORD_FLUSH_BYTES;
+			});
+			bStopping = m_bStopping;
+		}
+
+		const size_t nHead{m_nHead.load(std::memory_order_acquire)};
+		size_t nTail{m_nTail.load(std::memory_order_relaxed)};
+
+		if(m_bFailed.load(std::memory_order_relaxed)) {
+			m_nTail.store(nHead, std::memory_order_release);
+			continue;
+		}
+
+		// Walk the records to split the batch at segment ends and index it
+		size_t nBatch{nTail};
+		size_t nPos{nTail};
+		while(nPos != nHead) {
+			voicerecordpacket packet;
+			CopyOut(nPos, &packet, sizeof(packet));
+			const size_t nRecord{sizeof(packet) + packet.size};
+
+			const size_t nBatchOffset{m_nOffset + (nPos - nBatch)};
+			if(nBatchOffset + nRecord > m_nSegmentBytes && nBatchOffset > sizeof(voicerecordheader)) {
+				if(!WriteRing(nBatch, nPos)) {
+					break;
+				}
+				m_nTail.store(nPos, std::memory_order_release);
+				nBatch = nPos;
+
+				CloseSegment();
+				++m_Header.segment;
+				if(!OpenSegment()) {
+					break;
+				}
+				continue;
+			}
+
+			if(m_flLastIndexed < 0.0 || packet.timestamp >= m_flLastIndexed + VOICERECORD_INDEX_INTERVAL) {
+				m_Index.push_back(voicerecordindexentry{packet.timestamp, static_cast<uint32_t>(nBatchOffset), 0});
+				m_flLastIndexed = packet.timestamp;
+			}
+
+			nPos += nRecord;
+		}
+
+		if(m_bFailed.load(std::memory_order_relaxed)) {
+			m_Index.clear();
+			m_nTail.store(nHead, std::memory_order_release);
+			continue;
+		}
+
+		if(WriteRing(nBatch, nHead)) {
+			m_nTail.store(nHead, std::memory_order_release);
+		}
+	}
+
+	m_Index.clear();
+	CloseSegment();
+}
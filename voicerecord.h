@@ -0,0 +1,118 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+#define VOICERECORD_MAGIC "VSRC"
+#define VOICERECORD_INDEX_MAGIC "VSRI"
+#define VOICERECORD_VERSION 1
+
+// Seconds of voice between two entries of the sparse time index.
+#define VOICERECORD_INDEX_INTERVAL 1.0
+
+// A recording session is a series of append-only segment files named
+// <prefix>_<segment>.vsr, each starting with this header and followed by
+// voicerecordpacket records. Every segment has a <prefix>_<segment>.vsi
+// index next to it: a voicerecordindexheader followed by entries pointing
+// at the first record at or after their timestamp.
+struct voicerecordheader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t segment;
+	uint32_t samplerate;
+	double starttime;
+	char codec[32];
+};
+
+// Layout is the same for 32 and 64-bit builds.
+struct voicerecordpacket
+{
+	double timestamp; // Unix time in seconds
+	uint64_t xuid;
+	uint32_t size; // Bytes of voice data following the record
+	int32_t sender;
+	int32_t tick;
+	uint32_t reserved;
+};
+
+struct voicerecordindexheader
+{
+	char magic[4];
+	uint32_t version;
+};
+
+struct voicerecordindexentry
+{
+	double timestamp;
+	uint32_t offset;
+	uint32_t reserved;
+};
+
+// Records broadcast voice packets. The game thread copies each packet into
+// a single-producer single-consumer ring and a writer thread appends whole
+// batches of records to the current segment with one writev.
+class VoiceRecorder
+{
+public:
+	~VoiceRecorder();
+
+	// path is the session prefix without extension, relative to the game directory.
+	bool Start(const char *path, const char *codec, int samplerate, size_t nBufferBytes, size_t nSegmentBytes, char *error, size_t maxlen);
+	void Stop();
+	bool IsRecording() const { return m_Thread.joinable(); }
+
+	// Game thread only. Drops the packet if the writer fell behind.
+	void Record(int sender, uint64_t xuid, int tick, const char *data, int nBytes);
+
+	// Game thread only. Logs a write error of the writer thread once.
+	void ReportErrors();
+
+	unsigned int Dropped() const { return m_nDropped.load(std::memory_order_relaxed); }
+	const std::string &Path() const { return m_Path; }
+
+private:
+	void WriterMain();
+	bool OpenSegment();
+	void CloseSegment();
+	bool WriteRing(size_t nStart, size_t nEnd);
+	void Fail(const char *fmt, ...);
+
+	void CopyIn(size_t nPos, const void *src, size_t nBytes);
+	void CopyOut(size_t nPos, void *dst, size_t nBytes) const;
+
+	std::string m_FullPath;
+	std::string m_Path;
+	voicerecordheader m_Header{};
+	size_t m_nSegmentBytes{0};
+
+	std::vector<char> m_Ring;
+	size_t m_nMask{0};
+	// Monotonic positions, the ring capacity is a power of two so they may wrap
+	std::atomic<size_t> m_nHead{0};
+	std::atomic<size_t> m_nTail{0};
+	std::atomic<unsigned int> m_nDropped{0};
+
+	std::thread m_Thread;
+	std::mutex m_Mutex;
+	std::condition_variable m_Cv;
+	bool m_bStopping{false};
+
+	// Writer thread state
+	int m_nFile{-1};
+	int m_nIndexFile{-1};
+	size_t m_nOffset{0};
+	double m_flLastIndexed{0.0};
+	std::vector<voicerecordindexentry> m_Index;
+
+	std::atomic<bool> m_bFailed{false};
+	bool m_bReported{false};
+	char m_szError[256]{};
+};
+
+extern VoiceRecorder g_VoiceRecorder;
@@ -0,0 +1,225 @@
+#include "voicereplay.h"
+#include <algorithm>
+#include <cstdarg>
+#include <cstring>
+#include <limits>
+
+// Packets the reader keeps queued ahead of the game thread
+#define REPLAY_QUEUE_PACKETS 256
+#define REPLAY_READ_BUFFER (64 * 1024)
+
+VoiceReplayPlayback::~VoiceReplayPlayback()
+{
+	if(m_Thread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock{m_Mutex};
+			m_bStopping = true;
+		}
+		m_Cv.notify_one();
+		m_Thread.join();
+	}
+}
+
+bool VoiceReplayPlayback::Open(const char *path, int sender, double flStart, double flEnd, double flSpeed, char *error, size_t maxlen)
+{
+	char fullpath[PLATFORM_MAX_PATH];
+	smutils->BuildPath(Path_Game, fullpath, sizeof(fullpath), "%s", path);
+
+	m_FullPath = fullpath;
+	m_Path = path;
+	m_nSender = sender;
+	m_flFrom = std::max(flStart, 0.0);
+	m_flTo = (flEnd > 0.0) ? flEnd : std::numeric_limits<double>::infinity();
+	m_flSpeed = (flSpeed > 0.0) ? flSpeed : 1.0;
+
+	voicerecordheader header;
+	FILE *pFile{OpenSegment(0, &header)};
+	if(!pFile) {
+		smutils->Format(error, maxlen, "\"%s_0000.vsr\" is missing or not a version %d voice recording", m_Path.c_str(), VOICERECORD_VERSION);
+		return false;
+	}
+
+	m_Thread = std::thread{&VoiceReplayPlayback::ReaderMain, this, pFile, header};
+
+	return true;
+}
+
+void VoiceReplayPlayback::Fail(const char *fmt, ...)
+{
+	char error[256];
+
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(error, sizeof(error), fmt, ap);
+	va_end(ap);
+
+	std::lock_guard<std::mutex> lock{m_Mutex};
+	m_Error = error;
+	m_bDone = true;
+}
+
+FILE *VoiceReplayPlayback::OpenSegment(uint32_t nSegment, voicerecordheader *pHeader)
+{
+	char path[PLATFORM_MAX_PATH];
+	snprintf(path, sizeof(path), "%s_%04u.vsr", m_FullPath.c_str(), nSegment);
+
+	FILE *pFile{fopen(path, "rb")};
+	if(!pFile) {
+		return nullptr;
+	}
+
+	voicerecordheader header;
+	if(fread(&header, sizeof(header), 1, pFile) != 1 || memcmp(header.magic, VOICERECORD_MAGIC, 4) != 0 || header.version != VOICERECORD_VERSION) {
+		fclose(pFile);
+		return nullptr;
+	}
+
+	if(pHeader) {
+		*pHeader = header;
+	}
+
+	setvbuf(pFile, nullptr, _IOFBF, REPLAY_READ_BUFFER);
+	return pFile;
+}
+
+bool VoiceReplayPlayback::Seek(double flFrom, uint32_t &nSegment, uint32_t &nOffset)
+{
+	nSegment = 0;
+	nOffset = sizeof(voicerecordheader);
+
+	// Indexes are tiny, the last entry at or before flFrom wins
+	for(uint32_t segment{0};; ++segment) {
+		char path[PLATFORM_MAX_PATH];
+		snprintf(path, sizeof(path), "%s_%04u.vsi", m_FullPath.c_str(), segment);
+
+		FILE *pIndex{fopen(path, "rb")};
+		if(!pIndex) {
+			return true;
+		}
+
+		voicerecordindexheader header;
+		if(fread(&header, sizeof(header), 1, pIndex) != 1 || memcmp(header.magic, VOICERECORD_INDEX_MAGIC, 4) != 0) {
+			fclose(pIndex);
+			return false;
+		}
+
+		voicerecordindexentry entry;
+		while(fread(&entry, sizeof(entry), 1, pIndex) == 1) {
+			if(entry.timestamp > flFrom) {
+				fclose(pIndex);
+				return true;
+			}
+			nSegment = segment;
+			nOffset = entry.offset;
+		}
+
+		fclose(pIndex);
+	}
+}
+
+void VoiceReplayPlayback::ReaderMain(FILE *pFile, voicerecordheader header)
+{
+	const double flFrom{header.starttime + m_flFrom};
+	const double flTo{header.starttime + m_flTo};
+
+	uint32_t nSegment, nOffset;
+	if(!Seek(flFrom, nSegment, nOffset)) {
+		fclose(pFile);
+		Fail("corrupt index in \"%s\"", m_Path.c_str());
+		return;
+	}
+
+	if(nSegment != 0) {
+		fclose(pFile);
+		pFile = OpenSegment(nSegment, nullptr);
+	}
+	if(pFile) {
+		fseek(pFile, static_cast<long>(nOffset), SEEK_SET);
+	}
+
+	while(pFile) {
+		voicerecordpacket record;
+		if(fread(&record, sizeof(record), 1, pFile) != 1) {
+			// A short read is the end of the segment, or the tail of one still being written
+			fclose(pFile);
+			pFile = OpenSegment(++nSegment, nullptr);
+			continue;
+		}
+
+		if(record.timestamp > flTo) {
+			break;
+		}
+
+		if(record.timestamp < flFrom || (m_nSender != 0 && record.sender != m_nSender) || record.size > VOICE_MAX_DATA_BYTES) {
+			fseek(pFile, static_cast<long>(record.size), SEEK_CUR);
+			continue;
+		}
+
+		packet p;
+		p.timestamp = record.timestamp;
+		p.sender = record.sender;
+		p.data.resize(record.size);
+		if(fread(p.data.data(), 1, record.size, pFile) != record.size) {
+			fclose(pFile);
+			pFile = OpenSegment(++nSegment, nullptr);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock{m_Mutex};
+		m_Cv.wait(lock, [this]() { return m_bStopping || m_Queue.size() < REPLAY_QUEUE_PACKETS; });
+		if(m_bStopping) {
+			break;
+		}
+		m_Queue.emplace_back(std::move(p));
+	}
+
+	if(pFile) {
+		fclose(pFile);
+	}
+
+	std::lock_guard<std::mutex> lock{m_Mutex};
+	m_bDone = true;
+}
+
+bool VoiceReplayPlayback::RunFrame(double now)
+{
+	bool bMore;
+	{
+		std::lock_guard<std::mutex> lock{m_Mutex};
+
+		if(!m_Error.empty()) {
+			smutils->LogError(myself, "Could not replay \"%s\": %s", m_Path.c_str(), m_Error.c_str());
+			return false;
+		}
+
+		if(m_flStart < 0.0) {
+			if(m_Queue.empty()) {
+				return !m_bDone;
+			}
+			// Leading silence before the first packet in range is skipped
+			m_flStart = now;
+			m_flBase = m_Queue.front().timestamp;
+		}
+
+		const double flReplayTime{m_flBase + ((now - m_flStart) * m_flSpeed)};
+
+		m_Due.clear();
+		while(!m_Queue.empty() && m_Queue.front().timestamp <= flReplayTime) {
+			m_Due.emplace_back(std::move(m_Queue.front()));
+			m_Queue.pop_front();
+		}
+
+		bMore = !m_bDone || !m_Queue.empty();
+	}
+
+	if(!m_Due.empty()) {
+		m_Cv.notify_one();
+	}
+
+	for(const packet &p : m_Due) {
+		const int from{(m_nFrom == VOICE_ORIGINAL_SENDER) ? (p.sender - 1) : m_nFrom};
+		SendVoiceDataToListeners(m_Listeners, p.data.data(), static_cast<int>(p.data.size()), from, m_bProximity);
+	}
+
+	return bMore;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include "voiceplayback.h"
+#include "voicerecord.h"
+
+// Replays a recording made by VoiceRecorder with its original packet timing.
+// A reader thread seeks with the segment indexes and reads a bounded number
+// of packets ahead, so the game thread never touches the files.
+class VoiceReplayPlayback : public VoicePlayback
+{
+public:
+	~VoiceReplayPlayback();
+
+	// sender 0 replays every sender. Times are seconds from the start of the
+	// recording, flEnd 0 replays to the end. flSpeed scales the packet clock.
+	// The first segment is checked here, the reader thread takes it from there.
+	bool Open(const char *path, int sender, double flStart, double flEnd, double flSpeed, char *error, size_t maxlen);
+
+	virtual bool RunFrame(double now) override;
+
+private:
+	struct packet
+	{
+		double timestamp;
+		int sender;
+		std::vector<char> data;
+	};
+
+	void ReaderMain(FILE *pFile, voicerecordheader header);
+	bool Seek(double flFrom, uint32_t &nSegment, uint32_t &nOffset);
+	FILE *OpenSegment(uint32_t nSegment, voicerecordheader *pHeader);
+	void Fail(const char *fmt, ...);
+
+	std::string m_FullPath;
+	std::string m_Path;
+	int m_nSender{0};
+	double m_flFrom{0.0};
+	double m_flTo{0.0};
+	double m_flSpeed{1.0};
+
+	std::thread m_Thread;
+	std::mutex m_Mutex;
+	std::condition_variable m_Cv;
+	std::deque<packet> m_Queue;
+	bool m_bDone{false};
+	bool m_bStopping{false};
+	std::string m_Error;
+
+	// Game thread state
+	double m_flStart{-1.0};
+	double m_flBase{0.0};
+	std::vector<packet> m_Due;
+};
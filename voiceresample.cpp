@@ -0,0 +1,124 @@
+#include "voiceresample.h"
+#include "voicepcm.h"
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+#define RESAMPLE_TAPS 32
+#define RESAMPLE_KAISER_BETA 8.0
+#define RESAMPLE_ROLLOFF 0.92
+
+static constexpr const int supported_rates[]{8000, 11025, 16000, 22050, 44100, 48000};
+
+static double bessel_i0(double x)
+{
+	double sum{1.0};
+	double term{1.0};
+	for(int k{1}; k < 32; ++k) {
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+bool VoiceResampler::IsSupportedRate(int nRate)
+{
+	return std::find(std::begin(supported_rates), std::end(supported_rates), nRate) != std::end(supported_rates);
+}
+
+bool VoiceResampler::Init(int nInRate, int nOutRate)
+{
+	if(!IsSupportedRate(nInRate) || !IsSupportedRate(nOutRate)) {
+		return false;
+	}
+
+	m_nInRate = nInRate;
+	m_nOutRate = nOutRate;
+
+	const int g{std::gcd(nInRate, nOutRate)};
+	m_nUp = nOutRate / g;
+	m_nDown = nInRate / g;
+	// Keep RESAMPLE_TAPS at the output rate when decimating, the cutoff is
+	// lower so the filter has to span proportionally more input samples
+	m_nTaps = RESAMPLE_TAPS * std::max(1, (m_nDown + m_nUp - 1) / m_nUp);
+
+	m_Filter.clear();
+	if(!IsPassthrough()) {
+		// Windowed sinc at the upsampled rate, cut below the lower of both Nyquists
+		const int nLength{m_nTaps * m_nUp};
+		const double cutoff{(0.5 * RESAMPLE_ROLLOFF * std::min(1.0, (double)m_nUp / (double)m_nDown)) / m_nUp};
+		const double center{(nLength - 1) * 0.5};
+		const double norm{bessel_i0(RESAMPLE_KAISER_BETA)};
+
+		std::vector<double> prototype(nLength);
+		for(int k{0}; k < nLength; ++k) {
+			const double t{k - center};
+			const double x{2.0 * cutoff * t};
+			const double sinc{(t == 0.0) ? 1.0 : (std::sin(M_PI * x) / (M_PI * x))};
+			const double r{(2.0 * k) / (nLength - 1) - 1.0};
+			const double window{bessel_i0(RESAMPLE_KAISER_BETA * std::sqrt(std::max(0.0, 1.0 - (r * r)))) / norm};
+			prototype[k] = 2.0 * cutoff * sinc * window;
+		}
+
+		// Split into phases stored oldest sample first, each normalized to unity gain
+		m_Filter.resize(nLength);
+		for(int p{0}; p < m_nUp; ++p) {
+			double sum{0.0};
+			for(int j{0}; j < m_nTaps; ++j) {
+				sum += prototype[p + (j * m_nUp)];
+			}
+			float *phase{m_Filter.data() + (p * m_nTaps)};
+			for(int j{0}; j < m_nTaps; ++j) {
+				phase[m_nTaps - 1 - j] = static_cast<float>(prototype[p + (j * m_nUp)] / sum);
+			}
+		}
+	}
+
+	Reset();
+	return true;
+}
+
+void VoiceResampler::Reset()
+{
+	m_nPhase = 0;
+	m_History.assign(std::max(m_nTaps - 1, 0), 0.0f);
+}
+
+int VoiceResampler::Process(const celt_int16 *in, int nIn, std::vector<celt_int16> &out)
+{
+	if(nIn <= 0) {
+		return 0;
+	}
+
+	const size_t nOffset{out.size()};
+
+	if(IsPassthrough()) {
+		out.insert(out.end(), in, in + nIn);
+		return nIn;
+	}
+
+	const int nHistory{static_cast<int>(m_History.size())};
+	m_Input.resize(nHistory + nIn);
+	std::copy(m_History.begin(), m_History.end(), m_Input.begin());
+	PCM_ToFloat(in, m_Input.data() + nHistory, nIn);
+
+	const int nAvailable{static_cast<int>(m_Input.size())};
+	m_Output.resize(((static_cast<long long>(nIn) * m_nUp) / m_nDown) + 2);
+
+	int nOut{0};
+	int nPos{0};
+	while((nPos + m_nTaps) <= nAvailable) {
+		m_Output[nOut++] = PCM_DotProduct(m_Filter.data() + (m_nPhase * m_nTaps), m_Input.data() + nPos, m_nTaps);
+
+		m_nPhase += m_nDown;
+		nPos += m_nPhase / m_nUp;
+		m_nPhase %= m_nUp;
+	}
+
+	// Steps are at most ceil(m_nDown / m_nUp) samples, never more than m_nTaps, so nPos never runs past the input
+	m_History.assign(m_Input.begin() + nPos, m_Input.end());
+
+	out.resize(nOffset + nOut);
+	PCM_FromFloat(m_Output.data(), out.data() + nOffset, nOut);
+	return nOut;
+}
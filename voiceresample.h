@@ -0,0 +1,35 @@
+#pragma once
+
+#include <vector>
+#include "celt_types.h"
+
+// Streaming polyphase resampler for 16-bit mono voice. Keeps its filter
+// history between calls so a stream can be fed one frame at a time.
+class VoiceResampler
+{
+public:
+	// Rates the filters are designed for.
+	static bool IsSupportedRate(int nRate);
+
+	bool Init(int nInRate, int nOutRate);
+	void Reset();
+
+	int InRate() const { return m_nInRate; }
+	int OutRate() const { return m_nOutRate; }
+	bool IsPassthrough() const { return m_nInRate == m_nOutRate; }
+
+	// Appends the resampled samples to out and returns how many were added.
+	int Process(const celt_int16 *in, int nIn, std::vector<celt_int16> &out);
+
+private:
+	int m_nInRate{0};
+	int m_nOutRate{0};
+	int m_nUp{1};
+	int m_nDown{1};
+	int m_nTaps{0};
+	int m_nPhase{0};
+	std::vector<float> m_Filter; // m_nUp phases of m_nTaps reversed coefficients
+	std::vector<float> m_History;
+	std::vector<float> m_Input;
+	std::vector<float> m_Output;
+};
@@ -0,0 +1,168 @@
+#include "voicestats.h"
+#include "smsdk_ext.h"
+#include <tier0/dbg.h>
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstring>
+
+VoiceStats g_VoiceStats;
+
+thread_local voicestatslot *t_pVoiceStatSlot{nullptr};
+
+static int64_t steady_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void VoiceStats::Init()
+{
+	t_pVoiceStatSlot = &m_Slots[0];
+	m_nCalibrationTicks = VoiceStats_Ticks();
+	m_nCalibrationNs = steady_ns();
+	m_nResetNs = m_nCalibrationNs;
+}
+
+void VoiceStats::ClaimSlot()
+{
+	const int nSlot{m_nNextSlot.fetch_add(1, std::memory_order_relaxed)};
+	t_pVoiceStatSlot = &m_Slots[std::min(nSlot, VOICESTATS_THREAD_SLOTS - 1)];
+}
+
+void VoiceStats::Reset()
+{
+	for(int stat{0}; stat < VoiceStat_Count; ++stat) {
+		m_Baseline[stat] = Sum(static_cast<voicestat>(stat));
+	}
+
+	memset(m_Clients, 0, sizeof(m_Clients));
+	memset(m_Latency, 0, sizeof(m_Latency));
+	m_nLatencyMax = 0;
+	m_nLatencyTotal = 0;
+	m_nResetNs = steady_ns();
+}
+
+void VoiceStats::ResetClient(int client)
+{
+	memset(m_Clients[client], 0, sizeof(m_Clients[client]));
+}
+
+void VoiceStats::AddLatency(uint64_t nTicks)
+{
+	const int nBucket{(nTicks > 0) ? std::min(63 - __builtin_clzll(nTicks), VOICESTATS_LATENCY_BUCKETS - 1) : 0};
+	++m_Latency[nBucket];
+	m_nLatencyMax = std::max(m_nLatencyMax, nTicks);
+	m_nLatencyTotal += nTicks;
+}
+
+uint64_t VoiceStats::Sum(voicestat stat) const
+{
+	uint64_t sum{0};
+	for(const voicestatslot &slot : m_Slots) {
+		sum += slot.counters[stat].load(std::memory_order_relaxed);
+	}
+	return sum;
+}
+
+uint64_t VoiceStats::Get(voicestat stat) const
+{
+	return Sum(stat) - m_Baseline[stat];
+}
+
+double VoiceStats::TicksPerMicrosecond() const
+{
+	// Calibrated against the steady clock over the whole time since Init
+	const int64_t nNs{steady_ns() - m_nCalibrationNs};
+	if(nNs <= 0) {
+		return 1000.0;
+	}
+	return (double)(VoiceStats_Ticks() - m_nCalibrationTicks) / ((double)nNs / 1000.0);
+}
+
+uint64_t VoiceStats::LatencySamples() const
+{
+	uint64_t total{0};
+	for(uint64_t count : m_Latency) {
+		total += count;
+	}
+	return total;
+}
+
+double VoiceStats::LatencyPercentile(double fraction) const
+{
+	const uint64_t total{LatencySamples()};
+	if(total == 0) {
+		return 0.0;
+	}
+
+	const uint64_t target{static_cast<uint64_t>(total * fraction)};
+	uint64_t seen{0};
+	int nBucket{0};
+	for(; nBucket < VOICESTATS_LATENCY_BUCKETS - 1; ++nBucket) {
+		seen += m_Latency[nBucket];
+		if(seen > target) {
+			break;
+		}
+	}
+
+	return std::min((double)(2ull << nBucket), (double)m_nLatencyMax) / TicksPerMicrosecond();
+}
+
+double VoiceStats::LatencyMax() const
+{
+	return (double)m_nLatencyMax / TicksPerMicrosecond();
+}
+
+double VoiceStats::PacketsPerSecond() const
+{
+	const int64_t nNs{steady_ns() - m_nResetNs};
+	if(nNs <= 0) {
+		return 0.0;
+	}
+	return (double)Get(VoiceStat_PacketsIn) / ((double)nNs / 1e9);
+}
+
+double VoiceStats::NanosecondsPerRecipient() const
+{
+	const uint64_t nRecipients{Get(VoiceStat_BroadcastRecipients)};
+	if(nRecipients == 0) {
+		return 0.0;
+	}
+	return ((double)m_nLatencyTotal * 1000.0 / TicksPerMicrosecond()) / (double)nRecipients;
+}
+
+void VoiceStats::Print() const
+{
+	Msg("voicesend stats\n");
+	Msg("  in:       %" PRIu64 " packets, %" PRIu64 " bytes\n", Get(VoiceStat_PacketsIn), Get(VoiceStat_BytesIn));
+	Msg("  sent:     %" PRIu64 " messages, %" PRIu64 " bytes\n", Get(VoiceStat_MessagesSent), Get(VoiceStat_BytesSent));
+	Msg("  drops:    %" PRIu64 " blocked, %" PRIu64 " not hearing, %" PRIu64 " handled, %" PRIu64 " codec, %" PRIu64 " recorder\n",
+		Get(VoiceStat_DropBlocked), Get(VoiceStat_DropNotHearing), Get(VoiceStat_DropHandled), Get(VoiceStat_DropCodec), Get(VoiceStat_DropRecorder));
+	Msg("  budget:   %" PRIu64 " plugin, %" PRIu64 " voice, %" PRIu64 " proximity dropped\n",
+		Get(VoiceStat_DropBudgetPlugin), Get(VoiceStat_DropBudgetVoice), Get(VoiceStat_DropBudgetProximity));
+	Msg("  vad:      %" PRIu64 " silent dropped, decoder: %" PRIu64 " packets failed\n", Get(VoiceStat_DropSilent), Get(VoiceStat_DecodeFailed));
+	Msg("  forwards: %" PRIu64 " OnVoiceInit, %" PRIu64 " OnVoiceDataPre (%" PRIu64 " oversized skipped), %" PRIu64 " OnVoiceData, %" PRIu64 " OnVoiceDecoded\n",
+		Get(VoiceStat_ForwardInit), Get(VoiceStat_ForwardPre), Get(VoiceStat_SkipPreOversized), Get(VoiceStat_ForwardData), Get(VoiceStat_ForwardDecoded));
+	Msg("  encoder:  %" PRIu64 " frames, recorder: %" PRIu64 " bytes\n", Get(VoiceStat_FramesEncoded), Get(VoiceStat_BytesRecorded));
+	Msg("  broadcast: %" PRIu64 " calls, p50 %.1fus, p90 %.1fus, p99 %.1fus, max %.1fus\n",
+		LatencySamples(), LatencyPercentile(0.5), LatencyPercentile(0.9), LatencyPercentile(0.99), LatencyMax());
+	Msg("             %.1f packets/s, %" PRIu64 " recipients, %.0fns/recipient\n",
+		PacketsPerSecond(), Get(VoiceStat_BroadcastRecipients), NanosecondsPerRecipient());
+
+	bool bHeader{false};
+	for(int client{1}; client <= ABSOLUTE_PLAYER_LIMIT; ++client) {
+		const uint64_t *stats{m_Clients[client]};
+		if(!stats[VoiceClientStat_PacketsIn] && !stats[VoiceClientStat_MessagesSent] && !stats[VoiceClientStat_Drops]) {
+			continue;
+		}
+
+		if(!bHeader) {
+			Msg("  %-6s %10s %12s %10s %12s %10s\n", "client", "packets", "bytes in", "messages", "bytes sent", "drops");
+			bHeader = true;
+		}
+
+		Msg("  %-6d %10" PRIu64 " %12" PRIu64 " %10" PRIu64 " %12" PRIu64 " %10" PRIu64 "\n", client,
+			stats[VoiceClientStat_PacketsIn], stats[VoiceClientStat_BytesIn],
+			stats[VoiceClientStat_MessagesSent], stats[VoiceClientStat_BytesSent], stats[VoiceClientStat_Drops]);
+	}
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <const.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+inline uint64_t VoiceStats_Ticks() { return __rdtsc(); }
+#else
+#include <chrono>
+inline uint64_t VoiceStats_Ticks() { return std::chrono::steady_clock::now().time_since_epoch().count(); }
+#endif
+
+// Global pipeline counters, summed over every thread slot.
+enum voicestat
+{
+	VoiceStat_PacketsIn,
+	VoiceStat_BytesIn,
+	VoiceStat_MessagesSent,
+	VoiceStat_BytesSent,
+	VoiceStat_DropBlocked, // SetVoiceBlocked or OnVoiceDataPre removed the listener
+	VoiceStat_DropNotHearing,
+	VoiceStat_DropHandled, // OnVoiceDataPre returned Plugin_Handled
+	VoiceStat_DropCodec, // Listener on another codec that could not be transcoded
+	VoiceStat_DropRecorder,
+	VoiceStat_ForwardInit,
+	VoiceStat_ForwardPre,
+	VoiceStat_ForwardData,
+	VoiceStat_ForwardDecoded,
+	VoiceStat_FramesEncoded,
+	VoiceStat_BytesRecorded,
+	VoiceStat_BroadcastRecipients, // Messages sent by SV_BroadcastVoiceData itself
+	VoiceStat_DropBudgetPlugin, // Listener over its voice budget, by voicepriority
+	VoiceStat_DropBudgetVoice,
+	VoiceStat_DropBudgetProximity,
+	VoiceStat_DropSilent, // voicesend_vad found no speech in the packet
+	VoiceStat_DecodeFailed, // Sender packet the mixer, voicesend_vad or OnVoiceDecoded could not decode
+	VoiceStat_SkipPreOversized, // Packet over VOICE_MAX_DATA_BYTES relayed without calling OnVoiceDataPre
+	VoiceStat_Count
+};
+
+// Per client counters, only touched by the game thread.
+enum voiceclientstat
+{
+	VoiceClientStat_PacketsIn,
+	VoiceClientStat_BytesIn,
+	VoiceClientStat_MessagesSent,
+	VoiceClientStat_BytesSent,
+	VoiceClientStat_Drops,
+	VoiceClientStat_Count
+};
+
+#define VOICESTATS_THREAD_SLOTS 16
+#define VOICESTATS_LATENCY_BUCKETS 40
+
+// Every thread owns a slot on its own cache line and bumps it without any
+// lock prefix. Threads past the last slot share it with atomic adds.
+struct alignas(64) voicestatslot
+{
+	std::atomic<uint64_t> counters[VoiceStat_Count];
+};
+
+extern thread_local voicestatslot *t_pVoiceStatSlot;
+
+class VoiceStats
+{
+public:
+	// Claims slot 0 for the calling thread, call from the game thread.
+	void Init();
+
+	// Game thread only. Counters other threads may be bumping are never
+	// written, Get subtracts what they held at the reset instead.
+	void Reset();
+
+	inline void Add(voicestat stat, uint64_t n = 1)
+	{
+		if(!t_pVoiceStatSlot) {
+			ClaimSlot();
+		}
+
+		voicestatslot &slot{*t_pVoiceStatSlot};
+		if(&slot == &m_Slots[VOICESTATS_THREAD_SLOTS - 1]) {
+			slot.counters[stat].fetch_add(n, std::memory_order_relaxed);
+		} else {
+			slot.counters[stat].store(slot.counters[stat].load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+		}
+	}
+
+	inline void AddClient(int client, voiceclientstat stat, uint64_t n = 1)
+	{ m_Clients[client][stat] += n; }
+
+	void ResetClient(int client);
+
+	// Detour body time in TSC ticks, game thread only.
+	void AddLatency(uint64_t nTicks);
+
+	uint64_t Get(voicestat stat) const;
+	uint64_t GetClient(int client, voiceclientstat stat) const { return m_Clients[client][stat]; }
+
+	// Upper bound in microseconds of the latency bucket that holds fraction of all samples.
+	double LatencyPercentile(double fraction) const;
+	double LatencyMax() const;
+	uint64_t LatencySamples() const;
+
+	// Broadcast throughput since Init or the last Reset.
+	double PacketsPerSecond() const;
+	double NanosecondsPerRecipient() const;
+
+	void Print() const;
+
+private:
+	void ClaimSlot();
+	double TicksPerMicrosecond() const;
+
+	uint64_t Sum(voicestat stat) const;
+
+	voicestatslot m_Slots[VOICESTATS_THREAD_SLOTS];
+	std::atomic<int> m_nNextSlot{1};
+	uint64_t m_Baseline[VoiceStat_Count]{};
+	uint64_t m_Clients[ABSOLUTE_PLAYER_LIMIT + 1][VoiceClientStat_Count]{};
+	uint64_t m_Latency[VOICESTATS_LATENCY_BUCKETS]{};
+	uint64_t m_nLatencyMax{0};
+	uint64_t m_nLatencyTotal{0};
+	int64_t m_nResetNs{0};
+	uint64_t m_nCalibrationTicks{0};
+	int64_t m_nCalibrationNs{0};
+};
+
+extern VoiceStats g_VoiceStats;
+
+// Times the scope it lives in into the latency histogram.
+class VoiceStatsTimer
+{
+public:
+	VoiceStatsTimer() : m_nStart{VoiceStats_Ticks()} {}
+	~VoiceStatsTimer() { g_VoiceStats.AddLatency(VoiceStats_Ticks() - m_nStart); }
+
+private:
+	uint64_t m_nStart;
+};
@@ -0,0 +1,134 @@
+#include "voicestream.h"
+#include <algorithm>
+
+// Longest gap filled with concealment before the stream buffers again
+#define STREAM_MAX_CONCEAL_TIME 0.2
+// Frames past the delay plus this much are dropped from the front
+#define STREAM_MAX_BUFFER_TIME 1.0
+
+VoiceStreamPlayback::VoiceStreamPlayback()
+{
+	m_pCodec = nullptr;
+	m_flDelay = 0.0;
+	m_bFinished = false;
+	m_flStart = -1.0;
+	m_nSent = 0;
+	m_nConcealRun = 0;
+	m_nConcealed = 0;
+	m_nDropped = 0;
+}
+
+VoiceStreamPlayback::~VoiceStreamPlayback()
+{
+	if(m_pCodec)
+		m_pCodec->Release();
+}
+
+bool VoiceStreamPlayback::Open(double flDelay, char *error, size_t maxlen)
+{
+	m_pCodec = new VoiceCodec_Celt{};
+	if(!m_pCodec->Init(0, 0, 0)) {
+		smutils->Format(error, maxlen, "could not create the CELT codec");
+		return false;
+	}
+
+	m_flDelay = std::clamp(flDelay, 0.0, STREAM_MAX_BUFFER_TIME);
+
+	const VoiceCodec_Celt::CEncoderSettings &settings{m_pCodec->EncoderSettings()};
+	m_Pcm.resize(settings.FrameSize);
+	m_Packet.reserve(VOICE_MAX_DATA_BYTES);
+
+	return true;
+}
+
+int VoiceStreamPlayback::Push(const char *data, int nBytes)
+{
+	const VoiceCodec_Celt::CEncoderSettings &settings{m_pCodec->EncoderSettings()};
+
+	int nFrames{0};
+	for(int nOffset{0}; nOffset + settings.PacketSize <= nBytes; nOffset += settings.PacketSize) {
+		m_Frames.emplace_back(data + nOffset, data + nOffset + settings.PacketSize);
+		++nFrames;
+	}
+
+	// A sender running ahead would otherwise grow the latency without bound
+	const size_t nMaxFrames{static_cast<size_t>((m_flDelay + STREAM_MAX_BUFFER_TIME) / settings.FrameTime) + 1};
+	while(m_Frames.size() > nMaxFrames) {
+		m_Frames.pop_front();
+		++m_nDropped;
+	}
+
+	return nFrames;
+}
+
+bool VoiceStreamPlayback::RunFrame(double now)
+{
+	const VoiceCodec_Celt::CEncoderSettings &settings{m_pCodec->EncoderSettings()};
+
+	if(m_flStart < 0.0) {
+		const double flBuffered{static_cast<double>(m_Frames.size()) * settings.FrameTime};
+		if(m_Frames.empty() || (!m_bFinished && flBuffered < m_flDelay)) {
+			return !m_bFinished || !m_Frames.empty();
+		}
+
+		m_flStart = now;
+		m_nSent = 0;
+		m_nConcealRun = 0;
+	}
+
+	const int nMaxConceal{std::max(static_cast<int>(STREAM_MAX_CONCEAL_TIME / settings.FrameTime), 1)};
+
+	const int due{static_cast<int>((now - m_flStart) / settings.FrameTime) + 1 - m_nSent};
+	const int count{std::min(due, VOICE_MAX_DATA_BYTES / settings.PacketSize)};
+
+	m_Packet.clear();
+
+	int nFrames{0};
+	for(; nFrames < count; ++nFrames) {
+		if(!m_Frames.empty()) {
+			const std::vector<char> &frame{m_Frames.front()};
+
+			// Keep the decoder in step so concealment continues from the last real frame
+			m_pCodec->Decompress(reinterpret_cast<const unsigned char *>(frame.data()), static_cast<int>(frame.size()), m_Pcm.data(), settings.FrameSize);
+
+			m_Packet.insert(m_Packet.end(), frame.begin(), frame.end());
+			m_Frames.pop_front();
+			m_nConcealRun = 0;
+			continue;
+		}
+
+		if(m_bFinished) {
+			break;
+		}
+
+		if(m_nConcealRun >= nMaxConceal) {
+			m_flStart = -1.0;
+			break;
+		}
+
+		if(m_pCodec->Conceal(m_Pcm.data(), settings.FrameSize) != settings.FrameSize) {
+			m_flStart = -1.0;
+			break;
+		}
+
+		const size_t nOffset{m_Packet.size()};
+		m_Packet.resize(nOffset + settings.PacketSize);
+		const int ret{m_pCodec->Compress(m_Pcm.data(), settings.FrameSize, reinterpret_cast<unsigned char *>(m_Packet.data() + nOffset), settings.PacketSize)};
+		if(ret <= 0) {
+			m_Packet.resize(nOffset);
+			m_flStart = -1.0;
+			break;
+		}
+		m_Packet.resize(nOffset + ret);
+
+		++m_nConcealRun;
+		++m_nConcealed;
+	}
+
+	if(!m_Packet.empty()) {
+		SendVoiceDataToListeners(m_Listeners, m_Packet.data(), static_cast<int>(m_Packet.size()), m_nFrom, m_bProximity);
+	}
+	m_nSent += nFrames;
+
+	return !m_bFinished || !m_Frames.empty();
+}
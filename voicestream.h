@@ -0,0 +1,45 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+#include "voiceplayback.h"
+
+// Jitter buffer for voice a plugin pushes as it gets it. Frames of the server
+// CELT codec are queued and released at exactly FrameTime cadence once
+// flDelay seconds are buffered. When the queue runs dry the decoder's packet
+// loss concealment is encoded in place of the missing frames, and the stream
+// buffers again if the gap outlasts it.
+class VoiceStreamPlayback : public VoicePlayback
+{
+public:
+	VoiceStreamPlayback();
+	~VoiceStreamPlayback();
+
+	bool Open(double flDelay, char *error, size_t maxlen);
+
+	// Return the number of whole frames queued from data.
+	int Push(const char *data, int nBytes);
+
+	// Plays out what is buffered, then the playback ends.
+	void Finish() { m_bFinished = true; }
+
+	int Buffered() const { return static_cast<int>(m_Frames.size()); }
+	int Concealed() const { return m_nConcealed; }
+	int Dropped() const { return m_nDropped; }
+
+	virtual bool RunFrame(double now) override;
+	virtual VoiceStreamPlayback *Stream() override { return this; }
+
+private:
+	VoiceCodec_Celt *m_pCodec;
+	double m_flDelay;
+	bool m_bFinished;
+	std::deque<std::vector<char>> m_Frames;
+	std::vector<char> m_Packet;
+	std::vector<celt_int16> m_Pcm;
+	double m_flStart;
+	int m_nSent;
+	int m_nConcealRun;
+	int m_nConcealed;
+	int m_nDropped;
+};
@@ -0,0 +1,199 @@
+#include "voicetranscode.h"
+#include <algorithm>
+#include <cstring>
+
+// Quality the engine passes to IVoiceCodec::Init in voice_init
+#define ENGINE_VOICE_QUALITY 4
+
+// Enough for a full payload of the most compact engine codec
+#define TRANSCODE_MAX_SAMPLES 65536
+
+// Seconds without voice after which an encoder drops its partial frame and starts a new utterance
+#define TRANSCODE_GAP_TIME 0.25
+
+VoiceTranscoder g_VoiceTranscoder;
+
+VoiceTranscoder::~VoiceTranscoder()
+{
+	Clear();
+}
+
+bool VoiceTranscoder::CanTranscode(const voicecodecconfig &config)
+{
+	// Steam voice is decoded by the Steam client, there is no codec to load for it
+	return !config.codec.empty() && config.codec != "steam" && config.samplerate > 0;
+}
+
+void VoiceTranscoder::Clear()
+{
+	for(auto &it : m_Decoders) {
+		it.second.codec->Release();
+	}
+	m_Decoders.clear();
+
+	for(auto &it : m_Encoders) {
+		it.second.codec->Release();
+	}
+	m_Encoders.clear();
+
+	for(auto &it : m_PcmEncoders) {
+		it.second.codec->Release();
+	}
+	m_PcmEncoders.clear();
+}
+
+void VoiceTranscoder::ResetSender(int sender)
+{
+	for(streammap *streams : {&m_Decoders, &m_Encoders, &m_PcmEncoders}) {
+		for(auto it{streams->begin()}; it != streams->end();) {
+			if(it->first.sender == sender) {
+				it->second.codec->Release();
+				it = streams->erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+}
+
+VoiceTranscoder::stream *VoiceTranscoder::Open(streammap &streams, int sender, const voicecodecconfig &config)
+{
+	streamkey key{sender, config};
+
+	auto it{streams.find(key)};
+	if(it != streams.end()) {
+		return &it->second;
+	}
+
+	stream s;
+	s.samplerate = config.samplerate;
+
+	VoiceCodec_Celt::CEncoderSettings settings;
+	if(VoiceCodec_Celt::GetCodecSettings(config.codec.c_str(), config.samplerate, settings)) {
+		VoiceCodec_Celt *codec{new VoiceCodec_Celt{}};
+		if(!codec->Init(settings.SampleRate_Hz, settings.FrameSize, settings.PacketSize)) {
+			codec->Release();
+			return nullptr;
+		}
+		s.codec = codec;
+	} else {
+		s.codec = CreateEngineVoiceCodec(config.codec.c_str());
+		if(!s.codec) {
+			return nullptr;
+		}
+		if(!s.codec->Init(ENGINE_VOICE_QUALITY)) {
+			s.codec->Release();
+			return nullptr;
+		}
+	}
+
+	return &streams.emplace(std::move(key), std::move(s)).first->second;
+}
+
+void VoiceTranscoder::Transcode(int sender, int from, const voicecodecconfig &source, const char *data, int nBytes, const std::vector<transcodetarget> &targets, double now)
+{
+	// A decoder has to see every packet of its sender to stay in sync, so once
+	// open it keeps decoding while nobody needs the sender transcoded
+	stream *decoder{nullptr};
+	if(targets.empty()) {
+		auto it{m_Decoders.find(streamkey{sender, source})};
+		if(it == m_Decoders.end()) {
+			return;
+		}
+		decoder = &it->second;
+	} else {
+		decoder = Open(m_Decoders, sender, source);
+		if(!decoder) {
+			return;
+		}
+	}
+
+	// Packets lost while the sender was quiet or not transcoded leave stale prediction behind
+	if((now - decoder->lastused) > TRANSCODE_GAP_TIME) {
+		decoder->codec->ResetState();
+	}
+	decoder->lastused = now;
+
+	m_Pcm.resize(TRANSCODE_MAX_SAMPLES);
+	const int nSamples{decoder->codec->Decompress(data, nBytes, reinterpret_cast<char *>(m_Pcm.data()), TRANSCODE_MAX_SAMPLES * BYTES_PER_SAMPLE)};
+	if(nSamples <= 0 || targets.empty()) {
+		return;
+	}
+
+	Encode(m_Encoders, sender, from, decoder->samplerate, m_Pcm.data(), nSamples, targets, false, false, now);
+}
+
+int VoiceTranscoder::EncodePCM(int from, const celt_int16 *pcm, int nSamples, int nSampleRate, const std::vector<transcodetarget> &targets, bool bFinal, double now)
+{
+	if(nSamples <= 0 && !bFinal) {
+		return 0;
+	}
+
+	return Encode(m_PcmEncoders, from, from, nSampleRate, pcm, nSamples, targets, true, bFinal, now);
+}
+
+int VoiceTranscoder::Encode(streammap &streams, int key, int from, int nSampleRate, const celt_int16 *input, int nSamples, const std::vector<transcodetarget> &targets, bool bPlugin, bool bFinal, double now)
+{
+	m_Packet.resize(VOICE_MAX_DATA_BYTES);
+
+	int sent{0};
+
+	// Targets are split by proximity too, encode each config only once
+	for(size_t t{0}; t < targets.size(); ++t) {
+		const transcodetarget &target{targets[t]};
+
+		bool bDone{false};
+		for(size_t p{0}; p < t; ++p) {
+			if(*targets[p].config == *target.config) {
+				bDone = true;
+				break;
+			}
+		}
+		if(bDone) {
+			continue;
+		}
+
+		stream *encoder{Open(streams, key, *target.config)};
+		if(!encoder) {
+			continue;
+		}
+
+		// Whatever was left of the last utterance would be glued to the start of this one
+		if((now - encoder->lastused) > TRANSCODE_GAP_TIME) {
+			encoder->codec->ResetState();
+			encoder->resampler.Reset();
+		}
+		encoder->lastused = now;
+
+		const celt_int16 *pcm{input};
+		int nPcm{nSamples};
+		if(encoder->samplerate != nSampleRate) {
+			if(encoder->resampler.InRate() != nSampleRate && !encoder->resampler.Init(nSampleRate, encoder->samplerate)) {
+				continue;
+			}
+
+			m_Resampled.clear();
+			nPcm = encoder->resampler.Process(pcm, nPcm, m_Resampled);
+			pcm = m_Resampled.data();
+		}
+
+		// CELT keeps partial frames itself, other codecs buffer internally
+		const int nPacket{encoder->codec->Compress(reinterpret_cast<const char *>(pcm), nPcm, m_Packet.data(), VOICE_MAX_DATA_BYTES, bFinal)};
+		if(bFinal) {
+			encoder->codec->ResetState();
+			encoder->resampler.Reset();
+		}
+		if(nPacket <= 0) {
+			continue;
+		}
+
+		for(size_t p{t}; p < targets.size(); ++p) {
+			if(*targets[p].config == *target.config) {
+				const voicepriority priority{bPlugin ? VoicePriority_Plugin : (targets[p].proximity ? VoicePriority_Proximity : VoicePriority_Voice)};
+				sent += SendVoiceDataToListeners(targets[p].listeners, m_Packet.data(), nPacket, from, targets[p].proximity, priority);
+			}
+		}
+	}
+
+	return sent;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include "extension.h"
+#include "voiceclients.h"
+#include "voiceresample.h"
+
+// Listeners that need a sender's voice in a codec config other than its own.
+struct transcodetarget
+{
+	const voicecodecconfig *config;
+	bool proximity;
+	listenermask listeners;
+};
+
+// Decodes a sender with its own codec and re-encodes it once per distinct
+// target codec config, sharing the result across every listener on it.
+// Plugin PCM goes through the same encoders, keyed by the slot it is sent from.
+class VoiceTranscoder
+{
+public:
+	~VoiceTranscoder();
+
+	static bool CanTranscode(const voicecodecconfig &config);
+
+	// Call for every packet of a transcodable sender, targets may be empty.
+	void Transcode(int sender, int from, const voicecodecconfig &source, const char *data, int nBytes, const std::vector<transcodetarget> &targets, double now);
+
+	// bFinal pads and sends the last partial frame and starts a new stream on the next call.
+	// Returns the number of clients the encoded voice was sent to.
+	int EncodePCM(int from, const celt_int16 *pcm, int nSamples, int nSampleRate, const std::vector<transcodetarget> &targets, bool bFinal, double now);
+
+	// Drops the codec state of a sender, e.g. when the slot changes hands.
+	void ResetSender(int sender);
+	void Clear();
+
+private:
+	struct streamkey
+	{
+		int sender;
+		voicecodecconfig config;
+
+		bool operator==(const streamkey &other) const
+		{ return sender == other.sender && config == other.config; }
+	};
+
+	struct streamkeyhash
+	{
+		size_t operator()(const streamkey &key) const
+		{ return std::hash<std::string>{}(key.config.codec) ^ (static_cast<size_t>(key.config.samplerate) * 31) ^ (static_cast<size_t>(key.sender) << 20); }
+	};
+
+	struct stream
+	{
+		IVoiceCodec *codec{nullptr};
+		int samplerate{0};
+		double lastused{0.0};
+		VoiceResampler resampler;
+	};
+
+	typedef std::unordered_map<streamkey, stream, streamkeyhash> streammap;
+
+	stream *Open(streammap &streams, int sender, const voicecodecconfig &config);
+	// bPlugin sends at plugin priority instead of player voice priority.
+	int Encode(streammap &streams, int key, int from, int nSampleRate, const celt_int16 *input, int nSamples, const std::vector<transcodetarget> &targets, bool bPlugin, bool bFinal, double now);
+
+	streammap m_Decoders;
+	streammap m_Encoders;
+	streammap m_PcmEncoders;
+	std::vector<celt_int16> m_Pcm;
+	std::vector<celt_int16> m_Resampled;
+	std::vector<char> m_Packet;
+};
+
+extern VoiceTranscoder g_VoiceTranscoder;
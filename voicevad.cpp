@@ -0,0 +1,174 @@
+#include "voicevad.h"
+#include "voicepcm.h"
+#include <tier1/convar.h>
+#include <algorithm>
+#include <cmath>
+
+extern ConVar voicesend_vad;
+extern ConVar voicesend_vad_energy;
+extern ConVar voicesend_vad_flatness;
+extern ConVar voicesend_vad_hangover;
+
+// Frames this far above the energy threshold are speech whatever their spectrum
+#define VAD_LOUD_MARGIN 20.0f
+// Band the flatness is measured over, where voiced speech has its harmonics
+#define VAD_BAND_LOW 250
+#define VAD_BAND_HIGH 4000
+
+VoiceActivityDetector g_VoiceVAD;
+
+VoiceActivityDetector::VoiceActivityDetector()
+{
+	int nBits{0};
+	while((1 << nBits) < VAD_FFT_SIZE) {
+		++nBits;
+	}
+
+	for(int i{0}; i < VAD_FFT_SIZE; ++i) {
+		int rev{0};
+		for(int b{0}; b < nBits; ++b) {
+			rev |= ((i >> b) & 1) << (nBits - 1 - b);
+		}
+		m_BitRev[i] = static_cast<unsigned short>(rev);
+
+		// Hann
+		m_Window[i] = 0.5f - (0.5f * std::cos((2.0f * static_cast<float>(M_PI) * i) / VAD_FFT_SIZE));
+	}
+
+	for(int k{0}; k < VAD_FFT_SIZE / 2; ++k) {
+		m_Cos[k] = std::cos((2.0f * static_cast<float>(M_PI) * k) / VAD_FFT_SIZE);
+		m_Sin[k] = std::sin((2.0f * static_cast<float>(M_PI) * k) / VAD_FFT_SIZE);
+	}
+}
+
+float VoiceActivityDetector::Flatness(const celt_int16 *pcm, int nSamples, int nSampleRate)
+{
+	std::fill(m_Power, m_Power + (VAD_FFT_SIZE / 2), 0.0f);
+
+	// The power spectra of every block of the packet are averaged
+	const int nBlocks{std::max(nSamples / VAD_FFT_SIZE, 1)};
+	for(int block{0}; block < nBlocks; ++block) {
+		const int nOffset{block * VAD_FFT_SIZE};
+		const int nCount{std::min(VAD_FFT_SIZE, nSamples - nOffset)};
+
+		PCM_ToFloat(pcm + nOffset, m_Block, nCount);
+		std::fill(m_Block + nCount, m_Block + VAD_FFT_SIZE, 0.0f);
+
+		for(int i{0}; i < VAD_FFT_SIZE; ++i) {
+			m_Block[i] *= m_Window[i];
+		}
+
+		for(int i{0}; i < VAD_FFT_SIZE; ++i) {
+			m_Re[m_BitRev[i]] = m_Block[i];
+			m_Im[i] = 0.0f;
+		}
+
+		for(int size{2}; size <= VAD_FFT_SIZE; size <<= 1) {
+			const int half{size / 2};
+			const int step{VAD_FFT_SIZE / size};
+			for(int start{0}; start < VAD_FFT_SIZE; start += size) {
+				for(int k{0}; k < half; ++k) {
+					const float wr{m_Cos[k * step]};
+					const float wi{-m_Sin[k * step]};
+					const int i{start + k};
+					const int j{i + half};
+					const float tr{(wr * m_Re[j]) - (wi * m_Im[j])};
+					const float ti{(wr * m_Im[j]) + (wi * m_Re[j])};
+					m_Re[j] = m_Re[i] - tr;
+					m_Im[j] = m_Im[i] - ti;
+					m_Re[i] += tr;
+					m_Im[i] += ti;
+				}
+			}
+		}
+
+		for(int k{0}; k < VAD_FFT_SIZE / 2; ++k) {
+			m_Power[k] += (m_Re[k] * m_Re[k]) + (m_Im[k] * m_Im[k]);
+		}
+	}
+
+	const int nLow{std::max((VAD_BAND_LOW * VAD_FFT_SIZE) / nSampleRate, 1)};
+	const int nHigh{std::min((VAD_BAND_HIGH * VAD_FFT_SIZE) / nSampleRate, VAD_FFT_SIZE / 2)};
+	if(nHigh <= nLow) {
+		return 1.0f;
+	}
+
+	// Geometric over arithmetic mean of the power spectrum
+	float logsum{0.0f};
+	float sum{0.0f};
+	for(int k{nLow}; k < nHigh; ++k) {
+		const float power{m_Power[k] + 1e-12f};
+		logsum += std::log(power);
+		sum += power;
+	}
+
+	const float n{static_cast<float>(nHigh - nLow)};
+	return std::exp(logsum / n) / (sum / n);
+}
+
+bool VoiceActivityDetector::Process(int sender, const celt_int16 *pcm, int nSamples, int nSampleRate, double now)
+{
+	senderstate &state{m_Senders[sender]};
+
+	voiceactivitythresholds thresholds;
+	if(state.override) {
+		thresholds = state.thresholds;
+	} else {
+		thresholds.energy = voicesend_vad_energy.GetFloat();
+		thresholds.flatness = voicesend_vad_flatness.GetFloat();
+		thresholds.hangover = voicesend_vad_hangover.GetFloat();
+	}
+
+	if(nSamples <= 0 || nSampleRate <= 0) {
+		return IsSpeaking(sender, now);
+	}
+
+	const float rms{PCM_RMS(pcm, nSamples)};
+	state.energy = 20.0f * std::log10(std::max(rms, 1e-3f) / 32768.0f);
+
+	bool bSpeech{false};
+	if(state.energy >= thresholds.energy) {
+		// Quiet packets never need the spectrum
+		state.flatness = Flatness(pcm, nSamples, nSampleRate);
+		bSpeech = (state.energy >= thresholds.energy + VAD_LOUD_MARGIN) || (state.flatness < thresholds.flatness);
+	} else {
+		state.flatness = 1.0f;
+	}
+
+	if(bSpeech) {
+		state.until = now + thresholds.hangover;
+		return true;
+	}
+
+	return IsSpeaking(sender, now);
+}
+
+bool VoiceActivityDetector::IsSpeaking(int sender, double now) const
+{
+	return now < m_Senders[sender].until;
+}
+
+void VoiceActivityDetector::SetThresholds(int sender, const voiceactivitythresholds &thresholds)
+{
+	senderstate &state{m_Senders[sender]};
+	if(!state.override) {
+		state.override = true;
+		++m_nOverrides;
+	}
+	state.thresholds = thresholds;
+}
+
+void VoiceActivityDetector::ResetThresholds(int sender)
+{
+	senderstate &state{m_Senders[sender]};
+	if(state.override) {
+		state.override = false;
+		--m_nOverrides;
+	}
+}
+
+void VoiceActivityDetector::Reset(int sender)
+{
+	ResetThresholds(sender);
+	m_Senders[sender] = senderstate{};
+}
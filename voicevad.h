@@ -0,0 +1,65 @@
+#pragma once
+
+#include <const.h>
+#include "celt_header.h"
+
+#define VAD_FFT_SIZE 256
+
+struct voiceactivitythresholds
+{
+	float energy{0.0f}; // dBFS the frame has to reach
+	float flatness{0.0f}; // Spectral flatness the frame has to stay under, 0 tonal to 1 noise
+	float hangover{0.0f}; // Seconds voice keeps passing after the last speech frame
+};
+
+// Decides per sender whether a decoded voice packet is speech. A packet is
+// speech when it is loud enough and its spectrum is tonal enough, or when it
+// is far louder than the threshold. Senders stay open for a hangover after
+// their last speech packet so word ends and unvoiced sounds pass too.
+class VoiceActivityDetector
+{
+public:
+	VoiceActivityDetector();
+
+	// Return false if the packet of sender is not speech and may be dropped.
+	bool Process(int sender, const celt_int16 *pcm, int nSamples, int nSampleRate, double now);
+
+	// Thresholds of a sender replace the convars and gate it even with voicesend_vad off.
+	void SetThresholds(int sender, const voiceactivitythresholds &thresholds);
+	void ResetThresholds(int sender);
+	bool HasOverrides() const { return m_nOverrides > 0; }
+	bool HasOverride(int sender) const { return m_Senders[sender].override; }
+
+	void Reset(int sender);
+
+	// Features of the last packet of sender.
+	float LastEnergy(int sender) const { return m_Senders[sender].energy; }
+	float LastFlatness(int sender) const { return m_Senders[sender].flatness; }
+	bool IsSpeaking(int sender, double now) const;
+
+private:
+	float Flatness(const celt_int16 *pcm, int nSamples, int nSampleRate);
+
+	struct senderstate
+	{
+		bool override{false};
+		voiceactivitythresholds thresholds;
+		double until{0.0}; // End of the hangover
+		float energy{-100.0f};
+		float flatness{1.0f};
+	};
+
+	senderstate m_Senders[ABSOLUTE_PLAYER_LIMIT + 1];
+	int m_nOverrides{0};
+
+	unsigned short m_BitRev[VAD_FFT_SIZE];
+	float m_Window[VAD_FFT_SIZE];
+	float m_Cos[VAD_FFT_SIZE / 2];
+	float m_Sin[VAD_FFT_SIZE / 2];
+	float m_Block[VAD_FFT_SIZE];
+	float m_Re[VAD_FFT_SIZE];
+	float m_Im[VAD_FFT_SIZE];
+	float m_Power[VAD_FFT_SIZE / 2];
+};
+
+extern VoiceActivityDetector g_VoiceVAD;